@@ -0,0 +1,285 @@
+//==================================================================
+/**
+ *  FuseLowlevel -- the Fusepp wrapper pattern applied to the FUSE
+ *  low-level (inode based) API.
+ *
+ *  T derives from FuseLowlevel<T> and declares static handlers with
+ *  the names of the fuse_lowlevel_ops members it implements; every
+ *  other slot stays nullptr.
+ */
+
+#ifndef __FUSE_LOWLEVEL_APP_H__
+#define __FUSE_LOWLEVEL_APP_H__
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 35
+#endif
+
+#include <fuse_lowlevel.h>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+namespace Fusepp
+{
+  typedef void (*t_ll_init)(void *, struct fuse_conn_info *);
+  typedef void (*t_ll_destroy)(void *);
+  typedef void (*t_ll_lookup)(fuse_req_t, fuse_ino_t, const char *);
+  typedef void (*t_ll_forget)(fuse_req_t, fuse_ino_t, uint64_t);
+  typedef void (*t_ll_getattr)(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+  typedef void (*t_ll_setattr)(fuse_req_t, fuse_ino_t, struct stat *, int,
+                               struct fuse_file_info *);
+  typedef void (*t_ll_mkdir)(fuse_req_t, fuse_ino_t, const char *, mode_t);
+  typedef void (*t_ll_unlink)(fuse_req_t, fuse_ino_t, const char *);
+  typedef void (*t_ll_rmdir)(fuse_req_t, fuse_ino_t, const char *);
+  typedef void (*t_ll_rename)(fuse_req_t, fuse_ino_t, const char *, fuse_ino_t,
+                              const char *, unsigned int);
+  typedef void (*t_ll_link)(fuse_req_t, fuse_ino_t, fuse_ino_t, const char *);
+  typedef void (*t_ll_open)(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+  typedef void (*t_ll_read)(fuse_req_t, fuse_ino_t, size_t, off_t,
+                            struct fuse_file_info *);
+  typedef void (*t_ll_write)(fuse_req_t, fuse_ino_t, const char *, size_t,
+                             off_t, struct fuse_file_info *);
+  typedef void (*t_ll_flush)(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+  typedef void (*t_ll_release)(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+  typedef void (*t_ll_fsync)(fuse_req_t, fuse_ino_t, int,
+                             struct fuse_file_info *);
+  typedef void (*t_ll_opendir)(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+  typedef void (*t_ll_readdir)(fuse_req_t, fuse_ino_t, size_t, off_t,
+                               struct fuse_file_info *);
+  typedef void (*t_ll_releasedir)(fuse_req_t, fuse_ino_t,
+                                  struct fuse_file_info *);
+  typedef void (*t_ll_statfs)(fuse_req_t, fuse_ino_t);
+  typedef void (*t_ll_create)(fuse_req_t, fuse_ino_t, const char *, mode_t,
+                              struct fuse_file_info *);
+  typedef void (*t_ll_write_buf)(fuse_req_t, fuse_ino_t, struct fuse_bufvec *,
+                                 off_t, struct fuse_file_info *);
+  typedef void (*t_ll_forget_multi)(fuse_req_t, size_t,
+                                    struct fuse_forget_data *);
+  typedef void (*t_ll_fallocate)(fuse_req_t, fuse_ino_t, int, off_t, off_t,
+                                 struct fuse_file_info *);
+  typedef void (*t_ll_readdirplus)(fuse_req_t, fuse_ino_t, size_t, off_t,
+                                   struct fuse_file_info *);
+  typedef void (*t_ll_copy_file_range)(fuse_req_t, fuse_ino_t, off_t,
+                                       struct fuse_file_info *, fuse_ino_t,
+                                       off_t, struct fuse_file_info *, size_t,
+                                       int);
+  typedef void (*t_ll_lseek)(fuse_req_t, fuse_ino_t, off_t, int,
+                             struct fuse_file_info *);
+  typedef void (*t_ll_ioctl)(fuse_req_t, fuse_ino_t, unsigned int, void *,
+                             struct fuse_file_info *, unsigned, const void *,
+                             size_t, size_t);
+
+  template <class T>
+  class FuseLowlevel
+  {
+  public:
+    FuseLowlevel()
+    {
+      memset(&T::operations_, 0, sizeof(struct fuse_lowlevel_ops));
+      load_operations_();
+    }
+
+    // no copy
+    FuseLowlevel(const FuseLowlevel &) = delete;
+    FuseLowlevel &operator=(const FuseLowlevel &) = delete;
+
+    ~FuseLowlevel() = default;
+
+    int run(int argc, char **argv)
+    {
+      struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+      struct fuse_cmdline_opts opts;
+      int ret = 1;
+      if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+      if (opts.show_help)
+      {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto err_out1;
+      }
+      else if (opts.show_version)
+      {
+        fuse_lowlevel_version();
+        ret = 0;
+        goto err_out1;
+      }
+      if (opts.mountpoint == nullptr)
+      {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        goto err_out1;
+      }
+      session_ = fuse_session_new(&args, Operations(), sizeof(struct fuse_lowlevel_ops), this);
+      if (session_ == nullptr)
+        goto err_out1;
+      if (fuse_set_signal_handlers(session_) != 0)
+        goto err_out2;
+      if (fuse_session_mount(session_, opts.mountpoint) != 0)
+        goto err_out3;
+      fuse_daemonize(opts.foreground);
+      if (opts.singlethread)
+        ret = fuse_session_loop(session_);
+      else
+      {
+        struct fuse_loop_config config;
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        ret = fuse_session_loop_mt(session_, &config);
+      }
+      fuse_session_unmount(session_);
+    err_out3:
+      fuse_remove_signal_handlers(session_);
+    err_out2:
+      fuse_session_destroy(session_);
+      session_ = nullptr;
+    err_out1:
+      free(opts.mountpoint);
+      fuse_opt_free_args(&args);
+      return ret ? 1 : 0;
+    }
+
+    auto Operations() { return &operations_; }
+
+    struct fuse_session *session() { return session_; }
+
+    static auto this_(fuse_req_t req)
+    {
+      return static_cast<T *>(fuse_req_userdata(req));
+    }
+
+  private:
+    static void load_operations_()
+    {
+      operations_.init = T::init;
+      operations_.destroy = T::destroy;
+      operations_.lookup = T::lookup;
+      operations_.forget = T::forget;
+      operations_.getattr = T::getattr;
+      operations_.setattr = T::setattr;
+      operations_.mkdir = T::mkdir;
+      operations_.unlink = T::unlink;
+      operations_.rmdir = T::rmdir;
+      operations_.rename = T::rename;
+      operations_.link = T::link;
+      operations_.open = T::open;
+      operations_.read = T::read;
+      operations_.write = T::write;
+      operations_.flush = T::flush;
+      operations_.release = T::release;
+      operations_.fsync = T::fsync;
+      operations_.opendir = T::opendir;
+      operations_.readdir = T::readdir;
+      operations_.releasedir = T::releasedir;
+      operations_.statfs = T::statfs;
+      operations_.create = T::create;
+      operations_.write_buf = T::write_buf;
+      operations_.forget_multi = T::forget_multi;
+      operations_.fallocate = T::fallocate;
+      operations_.readdirplus = T::readdirplus;
+      operations_.copy_file_range = T::copy_file_range;
+      operations_.lseek = T::lseek;
+      operations_.ioctl = T::ioctl;
+    }
+
+    struct fuse_session *session_ = nullptr;
+
+    static struct fuse_lowlevel_ops operations_;
+
+    static t_ll_init init;
+    static t_ll_destroy destroy;
+    static t_ll_lookup lookup;
+    static t_ll_forget forget;
+    static t_ll_getattr getattr;
+    static t_ll_setattr setattr;
+    static t_ll_mkdir mkdir;
+    static t_ll_unlink unlink;
+    static t_ll_rmdir rmdir;
+    static t_ll_rename rename;
+    static t_ll_link link;
+    static t_ll_open open;
+    static t_ll_read read;
+    static t_ll_write write;
+    static t_ll_flush flush;
+    static t_ll_release release;
+    static t_ll_fsync fsync;
+    static t_ll_opendir opendir;
+    static t_ll_readdir readdir;
+    static t_ll_releasedir releasedir;
+    static t_ll_statfs statfs;
+    static t_ll_create create;
+    static t_ll_write_buf write_buf;
+    static t_ll_forget_multi forget_multi;
+    static t_ll_fallocate fallocate;
+    static t_ll_readdirplus readdirplus;
+    static t_ll_copy_file_range copy_file_range;
+    static t_ll_lseek lseek;
+    static t_ll_ioctl ioctl;
+  };
+};
+
+template <class T>
+Fusepp::t_ll_init Fusepp::FuseLowlevel<T>::init = nullptr;
+template <class T>
+Fusepp::t_ll_destroy Fusepp::FuseLowlevel<T>::destroy = nullptr;
+template <class T>
+Fusepp::t_ll_lookup Fusepp::FuseLowlevel<T>::lookup = nullptr;
+template <class T>
+Fusepp::t_ll_forget Fusepp::FuseLowlevel<T>::forget = nullptr;
+template <class T>
+Fusepp::t_ll_getattr Fusepp::FuseLowlevel<T>::getattr = nullptr;
+template <class T>
+Fusepp::t_ll_setattr Fusepp::FuseLowlevel<T>::setattr = nullptr;
+template <class T>
+Fusepp::t_ll_mkdir Fusepp::FuseLowlevel<T>::mkdir = nullptr;
+template <class T>
+Fusepp::t_ll_unlink Fusepp::FuseLowlevel<T>::unlink = nullptr;
+template <class T>
+Fusepp::t_ll_rmdir Fusepp::FuseLowlevel<T>::rmdir = nullptr;
+template <class T>
+Fusepp::t_ll_rename Fusepp::FuseLowlevel<T>::rename = nullptr;
+template <class T>
+Fusepp::t_ll_link Fusepp::FuseLowlevel<T>::link = nullptr;
+template <class T>
+Fusepp::t_ll_open Fusepp::FuseLowlevel<T>::open = nullptr;
+template <class T>
+Fusepp::t_ll_read Fusepp::FuseLowlevel<T>::read = nullptr;
+template <class T>
+Fusepp::t_ll_write Fusepp::FuseLowlevel<T>::write = nullptr;
+template <class T>
+Fusepp::t_ll_flush Fusepp::FuseLowlevel<T>::flush = nullptr;
+template <class T>
+Fusepp::t_ll_release Fusepp::FuseLowlevel<T>::release = nullptr;
+template <class T>
+Fusepp::t_ll_fsync Fusepp::FuseLowlevel<T>::fsync = nullptr;
+template <class T>
+Fusepp::t_ll_opendir Fusepp::FuseLowlevel<T>::opendir = nullptr;
+template <class T>
+Fusepp::t_ll_readdir Fusepp::FuseLowlevel<T>::readdir = nullptr;
+template <class T>
+Fusepp::t_ll_releasedir Fusepp::FuseLowlevel<T>::releasedir = nullptr;
+template <class T>
+Fusepp::t_ll_statfs Fusepp::FuseLowlevel<T>::statfs = nullptr;
+template <class T>
+Fusepp::t_ll_create Fusepp::FuseLowlevel<T>::create = nullptr;
+template <class T>
+Fusepp::t_ll_write_buf Fusepp::FuseLowlevel<T>::write_buf = nullptr;
+template <class T>
+Fusepp::t_ll_forget_multi Fusepp::FuseLowlevel<T>::forget_multi = nullptr;
+template <class T>
+Fusepp::t_ll_fallocate Fusepp::FuseLowlevel<T>::fallocate = nullptr;
+template <class T>
+Fusepp::t_ll_readdirplus Fusepp::FuseLowlevel<T>::readdirplus = nullptr;
+template <class T>
+Fusepp::t_ll_copy_file_range Fusepp::FuseLowlevel<T>::copy_file_range = nullptr;
+template <class T>
+Fusepp::t_ll_lseek Fusepp::FuseLowlevel<T>::lseek = nullptr;
+template <class T>
+Fusepp::t_ll_ioctl Fusepp::FuseLowlevel<T>::ioctl = nullptr;
+
+template <class T>
+struct fuse_lowlevel_ops Fusepp::FuseLowlevel<T>::operations_;
+
+#endif
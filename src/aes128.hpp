@@ -319,7 +319,8 @@ static const u32 rcon[] = {
 #define S_BOX_INV(t0, t1, t2, t3) (rsbox[t0] << 24) ^ (rsbox[t1] << 16) ^ (rsbox[t2] << 8) ^ (rsbox[t3])
 #define DE_TRANS_LAST(t0, t1, t2, t3) S_BOX_INV(POS0(t0), POS1(t1), POS2(t2), POS3(t3))
 #define INV_MIX_COLUMN(t) Td0[S_BOX_(POS0(t))] ^ Td1[S_BOX_(POS1(t))] ^ Td2[S_BOX_(POS2(t))] ^ Td3[S_BOX_(POS3(t))];
-u32 round_keys[44];
+// the key schedule is rebuilt by every call, so each thread keeps its own
+thread_local u32 round_keys[44];
 
 void InitRoundKey(const u8 *key)
 {
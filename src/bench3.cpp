@@ -0,0 +1,66 @@
+#include "efs.h"
+#include <thread>
+const u32 file_num = 256;
+
+shared_ptr<EasyFileSystem> efs;
+
+int stat_times = 100000;
+
+void single_thread(int id)
+{
+    i32 err;
+    string dir = "/dir" + to_string(id);
+    for (int i = 0; i < stat_times; i++)
+    {
+        shared_ptr<Inode> file = efs.get()->find(dir + "/file" + to_string(i % file_num), err);
+        assert(file != nullptr);
+        efs.get()->rdlock_inode(file.get()->get_id());
+        struct stat st = file.get()->get_stat();
+        efs.get()->unlock_inode(file.get()->get_id());
+        assert(st.st_ino == file.get()->get_id());
+    }
+}
+int main(int argc, char **argv)
+{
+    int num_threads = atoi(argv[1]);
+    assert(num_threads <= 4);
+    for (u32 i = 0; i < device_num; i++)
+    {
+        FILE *fp = fopen((root_file + to_string(i)).c_str(), "r+");
+        if (fp == nullptr)
+        {
+            int fd = open((root_file + to_string(i)).c_str(), O_RDWR | O_CREAT, 0666);
+            ftruncate(fd, device_sz / device_num);
+            close(fd);
+        }
+    }
+    shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+    efs = EasyFileSystem::create(block_device);
+    assert(efs != nullptr);
+    std::thread ths[4];
+
+    timespec s, e;
+
+    i32 err;
+    for (int i = 0; i < num_threads; i++)
+    {
+        efs.get()->create("/dir" + to_string(i), DiskInodeType::Directory, err, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH);
+        for (u32 j = 0; j < file_num; j++)
+            efs.get()->create("/dir" + to_string(i) + "/file" + to_string(j), DiskInodeType::File, err, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH);
+    }
+    clock_gettime(CLOCK_REALTIME, &s);
+    for (int i = 0; i < num_threads; ++i)
+    {
+        ths[i] = std::thread(single_thread, i);
+    }
+
+    for (int i = 0; i < num_threads; ++i)
+    {
+        ths[i].join();
+    }
+    clock_gettime(CLOCK_REALTIME, &e);
+
+    double us = (e.tv_sec - s.tv_sec) * 1000000 + (double)(e.tv_nsec - s.tv_nsec) / 1000;
+    printf("thread number %d, throughput %lf stat/s\n", num_threads, 1.0 * num_threads * stat_times * 1000000 / us);
+    return 0;
+}
@@ -42,6 +42,85 @@ i64 Bitmap::alloc(shared_ptr<BlockDevice> device)
     pthread_mutex_unlock(&lock);
     return -1;
 }
+// count bits for a reservation: the first free run long enough, or else the first free
+// bits wherever they are; nothing is taken when there are not that many free
+vector<u32> Bitmap::alloc_run(shared_ptr<BlockDevice> device, u32 count)
+{
+    vector<u32> bits;
+    if (count == 0)
+        return bits;
+    pthread_mutex_lock(&lock);
+    i64 run_start = -1;
+    u32 run_len = 0;
+    for (u32 block_id = 0; block_id < blocks && run_len < count; block_id++)
+    {
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(start_block_id + block_id, device, -1)
+            .get()
+            ->read<BitmapBlock, u32>(0, [block_id, count, &run_start, &run_len](const BitmapBlock &bitmap_block) -> u32
+                                     {
+                                         for (u32 bit = 0; bit < block_bits && run_len < count; bit++)
+                                         {
+                                             if (bitmap_block.data[bit / 64] & (1ull << (bit % 64)))
+                                             {
+                                                 run_len = 0;
+                                                 continue;
+                                             }
+                                             if (run_len++ == 0)
+                                                 run_start = block_id * block_bits + bit;
+                                         }
+                                         return 0;
+                                     });
+    }
+    if (run_len == count)
+    {
+        for (u32 i = 0; i < count; i++)
+            bits.push_back(run_start + i);
+    }
+    else
+    {
+        for (u32 block_id = 0; block_id < blocks && bits.size() < count; block_id++)
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(start_block_id + block_id, device, -1)
+                .get()
+                ->read<BitmapBlock, u32>(0, [block_id, count, &bits](const BitmapBlock &bitmap_block) -> u32
+                                         {
+                                             for (u32 bit = 0; bit < block_bits && bits.size() < count; bit++)
+                                             {
+                                                 if (!(bitmap_block.data[bit / 64] & (1ull << (bit % 64))))
+                                                     bits.push_back(block_id * block_bits + bit);
+                                             }
+                                             return 0;
+                                         });
+        if (bits.size() < count)
+        {
+            pthread_mutex_unlock(&lock);
+            return vector<u32>();
+        }
+    }
+    for (size_t i = 0; i < bits.size();)
+    {
+        u32 block_pos = bits[i] / block_bits;
+        size_t j = i;
+        while (j < bits.size() && bits[j] / block_bits == block_pos)
+            j++;
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(start_block_id + block_pos, device, -1)
+            .get()
+            ->modify_and_sync<BitmapBlock, i64>(0, [&bits, i, j](BitmapBlock &bitmap_block) -> i64
+                                                {
+                                                    for (size_t k = i; k < j; k++)
+                                                    {
+                                                        u32 bit = bits[k] % block_bits;
+                                                        bitmap_block.data[bit / 64] |= 1ull << (bit % 64);
+                                                    }
+                                                    return 0;
+                                                });
+        i = j;
+    }
+    pthread_mutex_unlock(&lock);
+    return bits;
+}
 void Bitmap::dealloc(shared_ptr<BlockDevice> device, u32 bit)
 {
     u32 block_pos = bit / block_bits;
@@ -58,17 +137,70 @@ void Bitmap::dealloc(shared_ptr<BlockDevice> device, u32 bit)
                                                 return 0;
                                             });
 }
+// the bits are sorted so that each bitmap block is modified and synced once
+void Bitmap::dealloc(shared_ptr<BlockDevice> device, vector<u32> bits)
+{
+    sort(bits.begin(), bits.end());
+    for (size_t i = 0; i < bits.size();)
+    {
+        u32 block_pos = bits[i] / block_bits;
+        size_t j = i;
+        while (j < bits.size() && bits[j] / block_bits == block_pos)
+            j++;
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(start_block_id + block_pos, device, -1)
+            .get()
+            ->modify_and_sync<BitmapBlock, i64>(0, [&bits, i, j](BitmapBlock &bitmap_block) -> i64
+                                                {
+                                                    for (size_t k = i; k < j; k++)
+                                                    {
+                                                        u32 bit = bits[k] % block_bits;
+                                                        assert((bitmap_block.data[bit / 64] & (1ull << (bit % 64))) > 0);
+                                                        bitmap_block.data[bit / 64] &= ~(1ull << (bit % 64));
+                                                    }
+                                                    return 0;
+                                                });
+        i = j;
+    }
+}
 u32 Bitmap::maximum()
 {
     return blocks * block_bits;
 }
 
+// zeroed with one request per io_max_blocks, which the device splits into long runs per stripe
 void Bitmap::clear(shared_ptr<BlockDevice> device)
 {
     Block empty;
     memset(empty.data, 0, sizeof(empty));
+    vector<BlockRequest> requests;
     for (u32 i = start_block_id; i < start_block_id + blocks; i++)
     {
-        device.get()->write_block(i, empty);
+        requests.push_back(BlockRequest{i, &empty});
+        if (requests.size() == io_max_blocks || i + 1 == start_block_id + blocks)
+        {
+            device.get()->write_blocks(requests);
+            requests.clear();
+        }
     }
+}
+// bits from .. to - 1 taken for good, such as those past the end of the area the bitmap covers
+void Bitmap::mark(shared_ptr<BlockDevice> device, u32 from, u32 to)
+{
+    for (u32 block_pos = from / block_bits; block_pos * block_bits < to; block_pos++)
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(start_block_id + block_pos, device, -1)
+            .get()
+            ->modify_and_sync<BitmapBlock, i64>(0, [block_pos, from, to](BitmapBlock &bitmap_block) -> i64
+                                                {
+                                                    for (u32 bit = max(from, block_pos * block_bits); bit < min(to, (block_pos + 1) * block_bits); bit++)
+                                                        bitmap_block.data[bit % block_bits / 64] |= 1ull << (bit % 64);
+                                                    return 0;
+                                                });
+}
+// every alloc scans from the first block, so they are kept out of the way of eviction
+void Bitmap::pin(shared_ptr<BlockDevice> device)
+{
+    for (u32 i = start_block_id; i < start_block_id + blocks; i++)
+        BLOCK_CACHE_MANAGER.pin(i, device);
 }
\ No newline at end of file
@@ -18,9 +18,13 @@ public:
     Bitmap(u32 _start_block_id, u32 _blocks);
     ~Bitmap();
     i64 alloc(shared_ptr<BlockDevice> device);
+    vector<u32> alloc_run(shared_ptr<BlockDevice> device, u32 count);
     void dealloc(shared_ptr<BlockDevice> device, u32 bit);
+    void dealloc(shared_ptr<BlockDevice> device, vector<u32> bits);
     u32 maximum();
     void clear(shared_ptr<BlockDevice> device);
+    void mark(shared_ptr<BlockDevice> device, u32 from, u32 to);
+    void pin(shared_ptr<BlockDevice> device);
 };
 
 #endif
\ No newline at end of file
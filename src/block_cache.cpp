@@ -1,115 +1,626 @@
-#include "block_cache.h"
-
-BlockCacheManager BLOCK_CACHE_MANAGER;
-
-u32 BlockCache::get_block_id()
-{
-    return block_id;
-}
-i32 BlockCache::get_inode_id()
-{
-    return inode_id;
-}
-
-BlockCache::BlockCache(u32 _block_id, shared_ptr<BlockDevice> _device, i32 _inode_id)
-{
-    block_id = _block_id;
-    inode_id = _inode_id;
-    device = _device;
-    device.get()->read_block(block_id, cache);
-    modified = false;
-    pthread_rwlock_init(&rwlock, nullptr);
-}
-void BlockCache::sync()
-{
-    if (modified)
-    {
-        modified = false;
-        device.get()->write_block(block_id, cache);
-    }
-}
-BlockCache::~BlockCache()
-{
-    sync();
-    pthread_rwlock_destroy(&rwlock);
-}
-
-BlockCacheManager::BlockCacheManager()
-{
-    for (u32 i = 0; i < block_cache_group; i++)
-        pthread_mutex_init(&locks[i], nullptr);
-}
-
-BlockCacheManager::~BlockCacheManager()
-{
-    for (u32 i = 0; i < block_cache_group; i++)
-        pthread_mutex_destroy(&locks[i]);
-}
-shared_ptr<BlockCache> BlockCacheManager::get_block_cache(u32 block_id, shared_ptr<BlockDevice> device, i32 inode_id)
-{
-    u32 group_id = block_id % block_cache_group;
-    pthread_mutex_lock(&locks[group_id]);
-    for (auto p : queue[group_id])
-    {
-        if (p.get()->get_block_id() == block_id)
-        {
-            pthread_mutex_unlock(&locks[group_id]);
-            return p;
-        }
-    }
-    if (queue[group_id].size() == block_cache_way)
-    {
-        for (auto iter = queue[group_id].begin(); iter != queue[group_id].end(); iter++)
-        {
-            if (iter->use_count() == 1)
-            {
-                queue[group_id].erase(iter);
-                break;
-            }
-        }
-    }
-    assert(queue[group_id].size() < block_cache_way);
-    shared_ptr<BlockCache> block_cache(new BlockCache(block_id, device, inode_id));
-    queue[group_id].push_back(block_cache);
-    pthread_mutex_unlock(&locks[group_id]);
-    return block_cache;
-}
-void BlockCacheManager::flush(u32 block_id)
-{
-    u32 group_id = block_id % block_cache_group;
-    pthread_mutex_lock(&locks[group_id]);
-    for (auto iter = queue[group_id].begin(); iter != queue[group_id].end(); iter++)
-    {
-        if (iter->get()->get_block_id() == block_id)
-        {
-            iter->get()->sync();
-            break;
-        }
-    }
-    pthread_mutex_unlock(&locks[group_id]);
-}
-void BlockCacheManager::flush()
-{
-    for (u32 group_id = 0; group_id < block_cache_group; group_id++)
-    {
-        pthread_mutex_lock(&locks[group_id]);
-        for (auto iter = queue[group_id].begin(); iter != queue[group_id].end(); iter++)
-        {
-            iter->get()->sync();
-        }
-        pthread_mutex_unlock(&locks[group_id]);
-    }
-}
-void BlockCacheManager::flush_inode(u32 inode_id)
-{
-    for (u32 group_id = 0; group_id < block_cache_group; group_id++)
-    {
-        pthread_mutex_lock(&locks[group_id]);
-        for (auto iter = queue[group_id].begin(); iter != queue[group_id].end(); iter++)
-        {
-            if (iter->get()->get_inode_id() == (i32)inode_id)
-                iter->get()->sync();
-        }
-        pthread_mutex_unlock(&locks[group_id]);
-    }
-}
\ No newline at end of file
+#include <sys/mman.h>
+#include "block_cache.h"
+
+BlockCacheManager BLOCK_CACHE_MANAGER;
+
+u32 BlockCache::get_block_id()
+{
+    return block_id;
+}
+i32 BlockCache::get_inode_id()
+{
+    return inode_id;
+}
+
+BlockCache::BlockCache()
+{
+    frame = &cache;
+    modified = false;
+    pinned = false;
+    seq = 0;
+    refs = 0;
+    next_free = nullptr;
+    pthread_rwlock_init(&rwlock, nullptr);
+}
+void BlockCache::reset(u32 _block_id, shared_ptr<BlockDevice> _device, i32 _inode_id, bool load)
+{
+    block_id = _block_id;
+    inode_id = _inode_id;
+    device = _device;
+    frame = device.get()->map_block(block_id);
+    if (frame == nullptr)
+    {
+        frame = &cache;
+        if (load)
+            device.get()->read_block(block_id, cache);
+        else
+            memset(cache.data, 0, block_sz);
+    }
+    modified = false;
+    pinned = false;
+}
+void BlockCache::reset(u32 _block_id, shared_ptr<BlockDevice> _device, i32 _inode_id, const Block &data)
+{
+    block_id = _block_id;
+    inode_id = _inode_id;
+    device = _device;
+    cache = data;
+    frame = &cache;
+    modified = false;
+    pinned = false;
+}
+void BlockCache::retire()
+{
+    sync();
+    device.reset();
+}
+const u8 *BlockCache::lock_shared()
+{
+    pthread_rwlock_rdlock(&rwlock);
+    return frame->data;
+}
+void BlockCache::unlock_shared()
+{
+    pthread_rwlock_unlock(&rwlock);
+}
+void BlockCache::sync()
+{
+    if (modified)
+    {
+        modified = false;
+        device.get()->write_block(block_id, *frame);
+    }
+}
+bool BlockCache::is_modified()
+{
+    return modified;
+}
+void BlockCache::sync_all(vector<BlockCacheRef> &block_caches)
+{
+    vector<BlockRequest> requests;
+    vector<BlockCache *> locked, alone;
+    for (auto &p : block_caches)
+    {
+        BlockCache *block_cache = p.get();
+        // a busy frame or one of another device is synced alone after the batch is released
+        if (block_cache->device != block_caches[0].get()->device || pthread_rwlock_tryrdlock(&block_cache->rwlock) != 0)
+        {
+            alone.push_back(block_cache);
+            continue;
+        }
+        if (!block_cache->modified)
+        {
+            pthread_rwlock_unlock(&block_cache->rwlock);
+            continue;
+        }
+        requests.push_back(BlockRequest{block_cache->block_id, block_cache->frame});
+        locked.push_back(block_cache);
+    }
+    if (!requests.empty())
+        block_caches[0].get()->device.get()->write_blocks(requests);
+    for (auto block_cache : locked)
+    {
+        block_cache->modified = false;
+        pthread_rwlock_unlock(&block_cache->rwlock);
+    }
+    for (auto block_cache : alone)
+    {
+        pthread_rwlock_rdlock(&block_cache->rwlock);
+        block_cache->sync();
+        pthread_rwlock_unlock(&block_cache->rwlock);
+    }
+}
+BlockCache::~BlockCache()
+{
+    pthread_rwlock_destroy(&rwlock);
+}
+
+BlockCacheRef::BlockCacheRef()
+{
+    p = nullptr;
+}
+BlockCacheRef::BlockCacheRef(BlockCache *_p)
+{
+    p = _p;
+    if (p != nullptr)
+        p->refs++;
+}
+BlockCacheRef::BlockCacheRef(const BlockCacheRef &other)
+{
+    p = other.p;
+    if (p != nullptr)
+        p->refs++;
+}
+BlockCacheRef::BlockCacheRef(BlockCacheRef &&other)
+{
+    p = other.p;
+    other.p = nullptr;
+}
+BlockCacheRef &BlockCacheRef::operator=(BlockCacheRef other)
+{
+    swap(p, other.p);
+    return *this;
+}
+// only the queue entry can be the last reference, and it is dropped under its group lock
+BlockCacheRef::~BlockCacheRef()
+{
+    if (p != nullptr && --p->refs == 0)
+        BLOCK_CACHE_MANAGER.free_frame(p);
+}
+BlockCache *BlockCacheRef::get() const
+{
+    return p;
+}
+BlockCache *BlockCacheRef::operator->() const
+{
+    return p;
+}
+u32 BlockCacheRef::use_count() const
+{
+    return p == nullptr ? 0 : p->refs.load();
+}
+
+BlockCacheManager::BlockCacheManager()
+{
+    arena = (BlockCache *)mmap(nullptr, sizeof(BlockCache) * block_cache_group * block_cache_way, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(arena != MAP_FAILED);
+    for (u32 i = 0; i < block_cache_group; i++)
+    {
+        pthread_mutex_init(&locks[i], nullptr);
+        evictions[i] = 0;
+        free_frames[i] = nullptr;
+        group_ready[i] = false;
+        queue[MetaPool][i].reserve(meta_cache_way);
+        queue[DataPool][i].reserve(data_cache_way);
+        for (u32 pool = MetaPool; pool <= DataPool; pool++)
+            hits[pool][i] = misses[pool][i] = 0;
+    }
+    for (u32 i = 0; i < readahead_group; i++)
+    {
+        streams[i].inode_id = -1;
+        pthread_mutex_init(&stream_locks[i], nullptr);
+    }
+    for (u32 i = 0; i < max_stripe_count; i++)
+    {
+        pthread_mutex_init(&prefetch_locks[i], nullptr);
+        pthread_cond_init(&prefetch_conds[i], nullptr);
+    }
+    prefetch_worker_count = 0;
+    prefetch_stop = false;
+    pthread_mutex_init(&prefetch_start_lock, nullptr);
+}
+
+BlockCacheManager::~BlockCacheManager()
+{
+    for (u32 i = 0; i < prefetch_worker_count; i++)
+    {
+        pthread_mutex_lock(&prefetch_locks[i]);
+        prefetch_stop = true;
+        pthread_cond_signal(&prefetch_conds[i]);
+        pthread_mutex_unlock(&prefetch_locks[i]);
+    }
+    for (u32 i = 0; i < prefetch_worker_count; i++)
+        pthread_join(prefetch_workers[i], nullptr);
+    for (u32 i = 0; i < block_cache_group; i++)
+    {
+        pthread_mutex_lock(&locks[i]);
+        queue[MetaPool][i].clear();
+        queue[DataPool][i].clear();
+        pthread_mutex_unlock(&locks[i]);
+        if (group_ready[i])
+            for (u32 j = 0; j < block_cache_way; j++)
+                arena[i * block_cache_way + j].~BlockCache();
+    }
+    munmap(arena, sizeof(BlockCache) * block_cache_group * block_cache_way);
+    for (u32 i = 0; i < block_cache_group; i++)
+        pthread_mutex_destroy(&locks[i]);
+    for (u32 i = 0; i < readahead_group; i++)
+        pthread_mutex_destroy(&stream_locks[i]);
+    for (u32 i = 0; i < max_stripe_count; i++)
+    {
+        pthread_mutex_destroy(&prefetch_locks[i]);
+        pthread_cond_destroy(&prefetch_conds[i]);
+    }
+    pthread_mutex_destroy(&prefetch_start_lock);
+}
+
+struct PrefetchWorkerArg
+{
+    BlockCacheManager *manager;
+    u32 device_id;
+};
+
+static PrefetchWorkerArg prefetch_worker_args[max_stripe_count];
+
+void *BlockCacheManager::prefetch_worker(void *arg)
+{
+    BlockCacheManager *manager = ((PrefetchWorkerArg *)arg)->manager;
+    u32 device_id = ((PrefetchWorkerArg *)arg)->device_id;
+    while (1)
+    {
+        pthread_mutex_lock(&manager->prefetch_locks[device_id]);
+        while (manager->prefetch_queue[device_id].empty() && !manager->prefetch_stop)
+            pthread_cond_wait(&manager->prefetch_conds[device_id], &manager->prefetch_locks[device_id]);
+        if (manager->prefetch_stop)
+        {
+            manager->prefetch_queue[device_id].clear();
+            pthread_mutex_unlock(&manager->prefetch_locks[device_id]);
+            break;
+        }
+        PrefetchRequest request = manager->prefetch_queue[device_id].front();
+        vector<u32> block_ids;
+        while (!manager->prefetch_queue[device_id].empty() &&
+               manager->prefetch_queue[device_id].front().inode_id == request.inode_id &&
+               manager->prefetch_queue[device_id].front().device == request.device)
+        {
+            block_ids.push_back(manager->prefetch_queue[device_id].front().block_id);
+            manager->prefetch_queue[device_id].pop_front();
+        }
+        pthread_mutex_unlock(&manager->prefetch_locks[device_id]);
+        manager->load(block_ids, request.device, request.inode_id);
+    }
+    return nullptr;
+}
+
+void BlockCacheManager::start_prefetch(u32 stripe_count)
+{
+    if (prefetch_worker_count.load(memory_order_acquire) >= stripe_count)
+        return;
+    pthread_mutex_lock(&prefetch_start_lock);
+    for (u32 i = prefetch_worker_count; i < stripe_count; i++)
+    {
+        prefetch_worker_args[i].manager = this;
+        prefetch_worker_args[i].device_id = i;
+        pthread_create(&prefetch_workers[i], nullptr, prefetch_worker, &prefetch_worker_args[i]);
+        prefetch_worker_count.store(i + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&prefetch_start_lock);
+}
+
+void BlockCacheManager::prefetch(const vector<u32> &block_ids, shared_ptr<BlockDevice> device, i32 inode_id)
+{
+    if (block_ids.empty() || device.get()->advise(block_ids))
+        return;
+    start_prefetch(device.get()->get_stripe_count());
+    for (u32 block_id : block_ids)
+    {
+        u32 device_id = device.get()->get_stripe(block_id);
+        pthread_mutex_lock(&prefetch_locks[device_id]);
+        if (prefetch_queue[device_id].size() < readahead_queue_limit)
+        {
+            prefetch_queue[device_id].push_back(PrefetchRequest{block_id, inode_id, device});
+            pthread_cond_signal(&prefetch_conds[device_id]);
+        }
+        pthread_mutex_unlock(&prefetch_locks[device_id]);
+    }
+}
+
+void BlockCacheManager::read_ahead(i32 inode_id, u32 offset, u32 size, u32 file_blocks, function<u32(u32)> map, shared_ptr<BlockDevice> device)
+{
+    if (inode_id < 0 || size == 0)
+        return;
+    u32 first = offset / block_sz;
+    u32 last = min((offset + size - 1) / block_sz, file_blocks - 1);
+    if (first >= file_blocks)
+        return;
+    u32 start = last + 1, end = last + 1;
+    ReadAheadStream &stream = streams[inode_id % readahead_group];
+    pthread_mutex_lock(&stream_locks[inode_id % readahead_group]);
+    bool sequential = stream.inode_id == inode_id && stream.next_offset == offset;
+    if (!sequential)
+    {
+        stream.inode_id = inode_id;
+        stream.window = min(max(readahead_min_window, 2 * (last - first + 1)), readahead_max_window);
+        stream.ahead = start;
+        sequential = offset == 0;
+    }
+    stream.next_offset = offset + size;
+    if (sequential)
+    {
+        start = max(start, stream.ahead);
+        if (stream.ahead <= end + stream.window / 2)
+        {
+            end = min(max(stream.ahead, end) + stream.window, file_blocks);
+            stream.ahead = end;
+            stream.window = min(stream.window * 2, readahead_max_window);
+        }
+        else
+            end = max(start, end);
+    }
+    pthread_mutex_unlock(&stream_locks[inode_id % readahead_group]);
+    vector<u32> block_ids;
+    for (u32 i = start; i < end; i++)
+    {
+        u32 block_id = map(i);
+        if (block_id != 0)
+            block_ids.push_back(block_id);
+    }
+    prefetch(block_ids, device, inode_id);
+}
+static u32 pool_of(i32 inode_id)
+{
+    return inode_id < 0 ? MetaPool : DataPool;
+}
+static u32 pool_way(u32 pool)
+{
+    return pool == MetaPool ? meta_cache_way : data_cache_way;
+}
+bool BlockCacheManager::evict(u32 pool, u32 group_id)
+{
+    vector<BlockCacheRef> &entries = queue[pool][group_id];
+    if (entries.size() < pool_way(pool))
+        return true;
+    for (auto iter = entries.begin(); iter != entries.end(); iter++)
+    {
+        if (iter->use_count() == 1 && !iter->get()->pinned)
+        {
+            entries.erase(iter);
+            evictions[group_id]++;
+            return true;
+        }
+    }
+    return false;
+}
+BlockCache *BlockCacheManager::alloc_frame(u32 group_id)
+{
+    if (!group_ready[group_id])
+    {
+        for (u32 j = 0; j < block_cache_way; j++)
+        {
+            BlockCache *frame = new (&arena[group_id * block_cache_way + j]) BlockCache();
+            frame->next_free = free_frames[group_id];
+            free_frames[group_id] = frame;
+        }
+        group_ready[group_id] = true;
+    }
+    BlockCache *frame = free_frames[group_id];
+    assert(frame != nullptr);
+    free_frames[group_id] = frame->next_free;
+    return frame;
+}
+void BlockCacheManager::free_frame(BlockCache *frame)
+{
+    u32 group_id = (frame - arena) / block_cache_way;
+    frame->retire();
+    frame->next_free = free_frames[group_id];
+    free_frames[group_id] = frame;
+}
+void BlockCacheManager::use_huge_pages()
+{
+    madvise(arena, sizeof(BlockCache) * block_cache_group * block_cache_way, MADV_HUGEPAGE);
+}
+BlockCacheRef *BlockCacheManager::find(u32 group_id, u32 block_id)
+{
+    for (u32 pool = MetaPool; pool <= DataPool; pool++)
+    {
+        for (auto &p : queue[pool][group_id])
+        {
+            if (p.get()->get_block_id() == block_id)
+                return &p;
+        }
+    }
+    return nullptr;
+}
+BlockCacheRef BlockCacheManager::get_block_cache(u32 block_id, shared_ptr<BlockDevice> device, i32 inode_id, bool load)
+{
+    u32 group_id = block_id % block_cache_group;
+    u32 pool = pool_of(inode_id);
+    pthread_mutex_lock(&locks[group_id]);
+    BlockCacheRef *found = find(group_id, block_id);
+    if (found != nullptr)
+    {
+        BlockCacheRef block_cache = *found;
+        // a block reused by another file follows it, whichever pool it stays in
+        if (inode_id >= 0)
+            block_cache.get()->inode_id = inode_id;
+        hits[pool][group_id]++;
+        pthread_mutex_unlock(&locks[group_id]);
+        return block_cache;
+    }
+    misses[pool][group_id]++;
+    bool evicted = evict(pool, group_id);
+    assert(evicted);
+    BlockCache *frame = alloc_frame(group_id);
+    frame->reset(block_id, device, inode_id, load);
+    BlockCacheRef block_cache(frame);
+    queue[pool][group_id].push_back(block_cache);
+    pthread_mutex_unlock(&locks[group_id]);
+    return block_cache;
+}
+// a block whose group evicted or took a direct write meanwhile may be newer on the device
+void BlockCacheManager::load(const vector<u32> &block_ids, shared_ptr<BlockDevice> device, i32 inode_id)
+{
+    vector<u32> missing;
+    vector<u64> seen;
+    for (u32 block_id : block_ids)
+    {
+        if (block_id == 0)
+            continue;
+        u32 group_id = block_id % block_cache_group;
+        pthread_mutex_lock(&locks[group_id]);
+        if (find(group_id, block_id) == nullptr)
+        {
+            missing.push_back(block_id);
+            seen.push_back(evictions[group_id]);
+        }
+        pthread_mutex_unlock(&locks[group_id]);
+    }
+    if (missing.empty())
+        return;
+    if (missing.size() == 1 || device.get()->map_block(missing[0]) != nullptr)
+    {
+        for (u32 block_id : missing)
+            get_block_cache(block_id, device, inode_id);
+        return;
+    }
+    vector<Block> blocks(missing.size());
+    vector<BlockRequest> requests;
+    for (u32 i = 0; i < missing.size(); i++)
+        requests.push_back(BlockRequest{missing[i], &blocks[i]});
+    device.get()->read_blocks(requests);
+    u32 pool = pool_of(inode_id);
+    for (u32 i = 0; i < missing.size(); i++)
+    {
+        u32 group_id = missing[i] % block_cache_group;
+        pthread_mutex_lock(&locks[group_id]);
+        if (find(group_id, missing[i]) == nullptr && evictions[group_id] == seen[i] && evict(pool, group_id))
+        {
+            BlockCache *frame = alloc_frame(group_id);
+            frame->reset(missing[i], device, inode_id, blocks[i]);
+            queue[pool][group_id].push_back(BlockCacheRef(frame));
+            misses[pool][group_id]++;
+        }
+        pthread_mutex_unlock(&locks[group_id]);
+    }
+}
+void BlockCacheManager::read_direct(const vector<u32> &block_ids, Block *blocks, shared_ptr<BlockDevice> device)
+{
+    vector<BlockRequest> requests;
+    for (u32 i = 0; i < block_ids.size(); i++)
+    {
+        if (block_ids[i] == 0)
+        {
+            memset(blocks[i].data, 0, block_sz);
+            continue;
+        }
+        u32 group_id = block_ids[i] % block_cache_group;
+        pthread_mutex_lock(&locks[group_id]);
+        BlockCacheRef *found = find(group_id, block_ids[i]);
+        BlockCacheRef block_cache = found != nullptr ? *found : BlockCacheRef();
+        pthread_mutex_unlock(&locks[group_id]);
+        if (block_cache.get() == nullptr)
+            requests.push_back(BlockRequest{block_ids[i], &blocks[i]});
+        else
+        {
+            Block *dst = &blocks[i];
+            block_cache.get()->read<Block, u32>(0, [dst](const Block &data) -> u32
+                                                {
+                                                    *dst = data;
+                                                    return 0;
+                                                });
+        }
+    }
+    if (!requests.empty())
+        device.get()->read_blocks(requests);
+}
+// the cached copy is left dirty so a racing write-back of its old contents is redone
+void BlockCacheManager::write_direct(const vector<u32> &block_ids, const Block *blocks, shared_ptr<BlockDevice> device)
+{
+    vector<BlockRequest> requests;
+    for (u32 i = 0; i < block_ids.size(); i++)
+        requests.push_back(BlockRequest{block_ids[i], (Block *)&blocks[i]});
+    device.get()->write_blocks(requests);
+    for (u32 i = 0; i < block_ids.size(); i++)
+    {
+        u32 group_id = block_ids[i] % block_cache_group;
+        pthread_mutex_lock(&locks[group_id]);
+        evictions[group_id]++;
+        BlockCacheRef *found = find(group_id, block_ids[i]);
+        BlockCacheRef block_cache = found != nullptr ? *found : BlockCacheRef();
+        pthread_mutex_unlock(&locks[group_id]);
+        if (block_cache.get() != nullptr)
+        {
+            const Block *src = &blocks[i];
+            block_cache.get()->modify<Block, u32>(0, [src](Block &data) -> u32
+                                                  {
+                                                      data = *src;
+                                                      return 0;
+                                                  });
+        }
+    }
+}
+void BlockCacheManager::flush(u32 block_id)
+{
+    u32 group_id = block_id % block_cache_group;
+    pthread_mutex_lock(&locks[group_id]);
+    BlockCacheRef *found = find(group_id, block_id);
+    BlockCacheRef block_cache = found != nullptr ? *found : BlockCacheRef();
+    pthread_mutex_unlock(&locks[group_id]);
+    if (block_cache.get() != nullptr)
+    {
+        pthread_rwlock_rdlock(&block_cache.get()->rwlock);
+        block_cache.get()->sync();
+        pthread_rwlock_unlock(&block_cache.get()->rwlock);
+    }
+}
+void BlockCacheManager::flush()
+{
+    vector<BlockCacheRef> dirty;
+    for (u32 group_id = 0; group_id < block_cache_group; group_id++)
+    {
+        pthread_mutex_lock(&locks[group_id]);
+        for (u32 pool = MetaPool; pool <= DataPool; pool++)
+        {
+            for (auto iter = queue[pool][group_id].begin(); iter != queue[pool][group_id].end(); iter++)
+            {
+                if (iter->get()->is_modified())
+                    dirty.push_back(*iter);
+            }
+        }
+        pthread_mutex_unlock(&locks[group_id]);
+    }
+    if (!dirty.empty())
+        BlockCache::sync_all(dirty);
+}
+void BlockCacheManager::flush_inode(u32 inode_id)
+{
+    vector<BlockCacheRef> dirty;
+    for (u32 group_id = 0; group_id < block_cache_group; group_id++)
+    {
+        pthread_mutex_lock(&locks[group_id]);
+        for (u32 pool = MetaPool; pool <= DataPool; pool++)
+            for (auto iter = queue[pool][group_id].begin(); iter != queue[pool][group_id].end(); iter++)
+            {
+                if (iter->get()->get_inode_id() == (i32)inode_id && iter->get()->is_modified())
+                    dirty.push_back(*iter);
+            }
+        pthread_mutex_unlock(&locks[group_id]);
+    }
+    if (!dirty.empty())
+        BlockCache::sync_all(dirty);
+}
+// at most half of a group's metadata ways may be pinned, the rest keep serving misses
+bool BlockCacheManager::pin(u32 block_id, shared_ptr<BlockDevice> device)
+{
+    BlockCacheRef block_cache = get_block_cache(block_id, device, -1);
+    u32 group_id = block_id % block_cache_group;
+    pthread_mutex_lock(&locks[group_id]);
+    u32 pinned = 0;
+    for (auto &p : queue[MetaPool][group_id])
+        pinned += p.get()->pinned;
+    bool ok = block_cache.get()->pinned || pinned < meta_cache_way / 2;
+    if (ok)
+        block_cache.get()->pinned = true;
+    pthread_mutex_unlock(&locks[group_id]);
+    return ok;
+}
+void BlockCacheManager::get_stats(u32 pool, u64 &hit, u64 &miss)
+{
+    hit = miss = 0;
+    for (u32 group_id = 0; group_id < block_cache_group; group_id++)
+    {
+        pthread_mutex_lock(&locks[group_id]);
+        hit += hits[pool][group_id];
+        miss += misses[pool][group_id];
+        pthread_mutex_unlock(&locks[group_id]);
+    }
+}
+vector<CachedBlock> BlockCacheManager::get_cached(shared_ptr<BlockDevice> device)
+{
+    vector<CachedBlock> cached;
+    for (u32 pool = MetaPool; pool <= DataPool; pool++)
+    {
+        for (u32 group_id = 0; group_id < block_cache_group; group_id++)
+        {
+            pthread_mutex_lock(&locks[group_id]);
+            for (auto &p : queue[pool][group_id])
+            {
+                if (p.get()->device == device)
+                    cached.push_back(CachedBlock{p.get()->get_block_id(), p.get()->get_inode_id()});
+            }
+            pthread_mutex_unlock(&locks[group_id]);
+        }
+    }
+    return cached;
+}
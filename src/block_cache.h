@@ -1,82 +1,233 @@
-#ifndef __BLOCKCACHE_H_
-#define __BLOCKCACHE_H_
-
-#include "block_dev.h"
-
-class BlockCache
-{
-    Block cache;
-    u32 block_id;
-    i32 inode_id;
-    shared_ptr<BlockDevice> device;
-    bool modified;
-    pthread_rwlock_t rwlock;
-    template <typename T>
-    const T &get_ref(u32 offset)
-    {
-        assert(offset + sizeof(T) <= block_sz);
-        return *(T *)&cache.data[offset];
-    }
-
-    template <typename T>
-    T &get_mut(u32 offset)
-
-    {
-        assert(offset + sizeof(T) <= block_sz);
-        modified = true;
-        return *(T *)&cache.data[offset];
-    }
-
-public:
-    u32 get_block_id();
-    i32 get_inode_id();
-    BlockCache(u32 _block_id, shared_ptr<BlockDevice> _device, i32 _inode_id);
-
-    template <typename T, typename V>
-    V read(u32 offset, function<V(const T &)> f)
-    {
-        pthread_rwlock_rdlock(&rwlock);
-        V v = f(get_ref<T>(offset));
-        pthread_rwlock_unlock(&rwlock);
-        return v;
-    }
-    template <typename T, typename V>
-    V modify(u32 offset, function<V(T &)> f)
-    {
-        pthread_rwlock_wrlock(&rwlock);
-        V v = f(get_mut<T>(offset));
-        pthread_rwlock_unlock(&rwlock);
-        return v;
-    }
-
-    template <typename T, typename V>
-    V modify_and_sync(u32 offset, function<V(T &)> f)
-    {
-        pthread_rwlock_wrlock(&rwlock);
-        V v = f(get_mut<T>(offset));
-        sync();
-        pthread_rwlock_unlock(&rwlock);
-        return v;
-    }
-
-    void sync();
-    ~BlockCache();
-};
-
-class BlockCacheManager
-{
-    vector<shared_ptr<BlockCache>> queue[block_cache_group];
-    pthread_mutex_t locks[block_cache_group];
-
-public:
-    BlockCacheManager();
-    ~BlockCacheManager();
-    shared_ptr<BlockCache> get_block_cache(u32 block_id, shared_ptr<BlockDevice> device, i32 inode_id);
-    void flush(u32 block_id);
-    void flush();
-    void flush_inode(u32 inode_id);
-};
-
-extern BlockCacheManager BLOCK_CACHE_MANAGER;
-
+#ifndef __BLOCKCACHE_H_
+#define __BLOCKCACHE_H_
+
+#include "block_dev.h"
+
+class BlockCacheRef;
+
+// a cache frame lives in the BlockCacheManager arena for the whole run and is
+// recycled through its group's free list once the last BlockCacheRef is gone
+class alignas(64) BlockCache
+{
+    Block cache;
+    // the cached bytes: cache itself, or the block in place when the device maps it
+    Block *frame;
+    u32 block_id;
+    i32 inode_id;
+    shared_ptr<BlockDevice> device;
+    // set by writers under the frame lock, cleared by sync under at least the read lock
+    atomic<bool> modified;
+    bool pinned;
+    pthread_rwlock_t rwlock;
+    atomic<u32> seq;
+    atomic<u32> refs;
+    BlockCache *next_free;
+    friend class BlockCacheRef;
+    friend class BlockCacheManager;
+    template <typename T>
+    const T &get_ref(u32 offset)
+    {
+        assert(offset + sizeof(T) <= block_sz);
+        return *(T *)&frame->data[offset];
+    }
+
+    template <typename T>
+    T &get_mut(u32 offset)
+
+    {
+        assert(offset + sizeof(T) <= block_sz);
+        modified = true;
+        return *(T *)&frame->data[offset];
+    }
+
+public:
+    u32 get_block_id();
+    i32 get_inode_id();
+    BlockCache();
+    void reset(u32 _block_id, shared_ptr<BlockDevice> _device, i32 _inode_id, bool load);
+    void reset(u32 _block_id, shared_ptr<BlockDevice> _device, i32 _inode_id, const Block &data);
+    void retire();
+
+    // writers make seq odd for the duration of a change, see peek
+    void begin_write()
+    {
+        seq.store(seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+    void end_write()
+    {
+        seq.store(seq.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    template <typename T, typename V, typename F>
+    V read(u32 offset, F f)
+    {
+        pthread_rwlock_rdlock(&rwlock);
+        V v = f(get_ref<T>(offset));
+        pthread_rwlock_unlock(&rwlock);
+        return v;
+    }
+    template <typename T, typename V, typename F>
+    V modify(u32 offset, F f)
+    {
+        pthread_rwlock_wrlock(&rwlock);
+        begin_write();
+        V v = f(get_mut<T>(offset));
+        end_write();
+        pthread_rwlock_unlock(&rwlock);
+        return v;
+    }
+
+    template <typename T, typename V, typename F>
+    V modify_and_sync(u32 offset, F f)
+    {
+        pthread_rwlock_wrlock(&rwlock);
+        begin_write();
+        V v = f(get_mut<T>(offset));
+        end_write();
+        sync();
+        pthread_rwlock_unlock(&rwlock);
+        return v;
+    }
+
+    // a copy of a small value taken without the lock: it is kept only if no
+    // writer ran meanwhile, and after a few lost races the lock is taken after all
+    template <typename T>
+    T peek(u32 offset)
+    {
+        static_assert(is_trivially_copyable<T>::value, "peek copies raw bytes");
+        assert(offset + sizeof(T) <= block_sz);
+        T v;
+        for (u32 i = 0; i < seqlock_retries; i++)
+        {
+            u32 s = seq.load(memory_order_acquire);
+            if (s & 1)
+                continue;
+            memcpy(&v, &frame->data[offset], sizeof(T));
+            atomic_thread_fence(memory_order_acquire);
+            if (seq.load(memory_order_relaxed) == s)
+                return v;
+        }
+        pthread_rwlock_rdlock(&rwlock);
+        memcpy(&v, &frame->data[offset], sizeof(T));
+        pthread_rwlock_unlock(&rwlock);
+        return v;
+    }
+
+    // hold the block shared while its bytes are handed out by pointer
+    const u8 *lock_shared();
+    void unlock_shared();
+
+    bool is_modified();
+    void sync();
+    // write the dirty ones back with one multi-block request
+    static void sync_all(vector<BlockCacheRef> &block_caches);
+    ~BlockCache();
+};
+
+// intrusive counted reference to a frame, used like shared_ptr<BlockCache>
+class BlockCacheRef
+{
+    BlockCache *p;
+
+public:
+    BlockCacheRef();
+    explicit BlockCacheRef(BlockCache *_p);
+    BlockCacheRef(const BlockCacheRef &other);
+    BlockCacheRef(BlockCacheRef &&other);
+    BlockCacheRef &operator=(BlockCacheRef other);
+    ~BlockCacheRef();
+    BlockCache *get() const;
+    BlockCache *operator->() const;
+    u32 use_count() const;
+};
+
+// sequential access state of one file, in blocks
+struct ReadAheadStream
+{
+    i32 inode_id;
+    u32 next_offset;
+    u32 window;
+    u32 ahead;
+};
+
+struct PrefetchRequest
+{
+    u32 block_id;
+    i32 inode_id;
+    shared_ptr<BlockDevice> device;
+};
+
+enum CachePool
+{
+    MetaPool = 0,
+    DataPool = 1,
+};
+
+// a cached block as recorded for warming the cache up on the next mount
+struct CachedBlock
+{
+    u32 block_id;
+    i32 inode_id;
+};
+
+class BlockCacheManager
+{
+    // a block lives in one pool only, chosen by its inode tag when it is first cached;
+    // both pools of a group share the group lock, and a miss only evicts from its own pool
+    vector<BlockCacheRef> queue[2][block_cache_group];
+    pthread_mutex_t locks[block_cache_group];
+    // bumped by every eviction and direct write, see load
+    u64 evictions[block_cache_group];
+    u64 hits[2][block_cache_group];
+    u64 misses[2][block_cache_group];
+    bool evict(u32 pool, u32 group_id);
+    BlockCacheRef *find(u32 group_id, u32 block_id);
+
+    // group g owns frames [g * block_cache_way, (g + 1) * block_cache_way) of the arena,
+    // so frames are taken and returned under the group lock alone
+    BlockCache *arena;
+    BlockCache *free_frames[block_cache_group];
+    bool group_ready[block_cache_group];
+    BlockCache *alloc_frame(u32 group_id);
+
+    ReadAheadStream streams[readahead_group];
+    pthread_mutex_t stream_locks[readahead_group];
+
+    // one worker per stripe of the device, so prefetches are read and decrypted in parallel
+    deque<PrefetchRequest> prefetch_queue[max_stripe_count];
+    pthread_mutex_t prefetch_locks[max_stripe_count];
+    pthread_cond_t prefetch_conds[max_stripe_count];
+    pthread_t prefetch_workers[max_stripe_count];
+    atomic<u32> prefetch_worker_count;
+    bool prefetch_stop;
+    pthread_mutex_t prefetch_start_lock;
+    static void *prefetch_worker(void *arg);
+    void start_prefetch(u32 stripe_count);
+
+public:
+    BlockCacheManager();
+    ~BlockCacheManager();
+    BlockCacheRef get_block_cache(u32 block_id, shared_ptr<BlockDevice> device, i32 inode_id, bool load = true);
+    void free_frame(BlockCache *frame);
+    void use_huge_pages();
+    void load(const vector<u32> &block_ids, shared_ptr<BlockDevice> device, i32 inode_id);
+    void prefetch(const vector<u32> &block_ids, shared_ptr<BlockDevice> device, i32 inode_id);
+    void read_ahead(i32 inode_id, u32 offset, u32 size, u32 file_blocks, function<u32(u32)> map, shared_ptr<BlockDevice> device);
+    void flush(u32 block_id);
+    void flush();
+    void flush_inode(u32 inode_id);
+    // move blocks between blocks[] and the device without caching them; cached
+    // copies are read from, or brought up to date with what was written
+    void read_direct(const vector<u32> &block_ids, Block *blocks, shared_ptr<BlockDevice> device);
+    void write_direct(const vector<u32> &block_ids, const Block *blocks, shared_ptr<BlockDevice> device);
+    // keep a block cached for the rest of the run, its pool evicts around it
+    bool pin(u32 block_id, shared_ptr<BlockDevice> device);
+    void get_stats(u32 pool, u64 &hit, u64 &miss);
+    // the blocks of device now cached, metadata first
+    vector<CachedBlock> get_cached(shared_ptr<BlockDevice> device);
+};
+
+extern BlockCacheManager BLOCK_CACHE_MANAGER;
+
 #endif
\ No newline at end of file
@@ -1,52 +1,525 @@
-#include <fcntl.h>
-#include <unistd.h>
-#include "block_dev.h"
-#include "aes128.hpp"
-#include "sha3.hpp"
-extern int errno;
-BlockDevice::BlockDevice(string password)
-{
-    sha3_256((const u8 *)password.c_str(), password.size(), md);
-    for (u32 i = 0; i < device_num; i++)
-    {
-        fp[i] = fopen((root_file + to_string(i)).c_str(), "r+");
-        assert(fp[i] != nullptr);
-        pthread_rwlock_init(&rwlock[i], nullptr);
-    }
-}
-
-BlockDevice::~BlockDevice()
-{
-    for (u32 i = 0; i < device_num; i++)
-    {
-        fclose(fp[i]);
-        pthread_rwlock_destroy(&rwlock[i]);
-    }
-}
-
-void BlockDevice::read_block(u32 block_id, Block &block)
-{
-    assert(block_id < device_block_num);
-    u32 device_id = block_id % device_num;
-    block_id /= device_num;
-    pthread_rwlock_rdlock(&rwlock[device_id]);
-    fseek(fp[device_id], block_id * block_sz, SEEK_SET);
-    Block new_block;
-    fread(&new_block, block_sz, 1, fp[device_id]);
-    aes128_cbc_decrypt((u8 *)&new_block, (u8 *)&block, block_sz, md, md + 16);
-    pthread_rwlock_unlock(&rwlock[device_id]);
-}
-
-void BlockDevice::write_block(u32 block_id, const Block &block)
-{
-    assert(block_id < device_block_num);
-    u32 device_id = block_id % device_num;
-    block_id /= device_num;
-    pthread_rwlock_wrlock(&rwlock[device_id]);
-    Block new_block;
-    aes128_cbc_encrypt((u8 *)&block, (u8 *)&new_block, block_sz, md, md + 16);
-    fseek(fp[device_id], block_id * block_sz, SEEK_SET);
-    fwrite(&new_block, block_sz, 1, fp[device_id]);
-    fflush(fp[device_id]);
-    pthread_rwlock_unlock(&rwlock[device_id]);
-}
\ No newline at end of file
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include "block_dev.h"
+#include "aes128.hpp"
+#include "sha3.hpp"
+extern int errno;
+
+AlignedBufferPool::AlignedBufferPool()
+{
+    align = block_sz;
+    pthread_mutex_init(&lock, nullptr);
+}
+
+AlignedBufferPool::~AlignedBufferPool()
+{
+    for (u32 i = 0; i < buffer_pool_classes; i++)
+        for (u8 *buffer : free_buffers[i])
+            free(buffer);
+    pthread_mutex_destroy(&lock);
+}
+
+void AlignedBufferPool::set_align(u32 _align)
+{
+    align = _align;
+}
+
+u32 AlignedBufferPool::size_class(size_t len)
+{
+    u32 c = 0;
+    while (((size_t)align << c) < len)
+        c++;
+    assert(c < buffer_pool_classes);
+    return c;
+}
+
+u8 *AlignedBufferPool::acquire(size_t len)
+{
+    u32 c = size_class(len);
+    pthread_mutex_lock(&lock);
+    if (!free_buffers[c].empty())
+    {
+        u8 *buffer = free_buffers[c].back();
+        free_buffers[c].pop_back();
+        pthread_mutex_unlock(&lock);
+        return buffer;
+    }
+    pthread_mutex_unlock(&lock);
+    void *buffer = nullptr;
+    int re = posix_memalign(&buffer, align, (size_t)align << c);
+    assert(re == 0);
+    return (u8 *)buffer;
+}
+
+void AlignedBufferPool::release(u8 *buffer, size_t len)
+{
+    u32 c = size_class(len);
+    pthread_mutex_lock(&lock);
+    if (free_buffers[c].size() < buffer_pool_keep)
+    {
+        free_buffers[c].push_back(buffer);
+        buffer = nullptr;
+    }
+    pthread_mutex_unlock(&lock);
+    free(buffer);
+}
+
+BlockDevice::BlockDevice(string password, u32 _stripe_count, u32 _stripe_unit, CipherType _cipher, bool _direct, u32 _total_blocks)
+{
+    assert(_stripe_count > 0 && _stripe_count <= max_stripe_count && _stripe_unit > 0);
+    assert(_total_blocks % (_stripe_count * _stripe_unit) == 0);
+    stripe_count = _stripe_count;
+    stripe_unit = _stripe_unit;
+    cipher = _cipher;
+    total_blocks = _total_blocks;
+    direct = _direct;
+    io_align = block_sz;
+    workers_started = false;
+    stop = false;
+    pthread_mutex_init(&start_lock, nullptr);
+    sha3_256((const u8 *)password.c_str(), password.size(), md);
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        fp[i] = fopen((root_file + to_string(i)).c_str(), "r+");
+        assert(fp[i] != nullptr);
+        fd[i] = fileno(fp[i]);
+        pthread_rwlock_init(&rwlock[i], nullptr);
+        pthread_mutex_init(&job_locks[i], nullptr);
+        pthread_cond_init(&job_conds[i], nullptr);
+    }
+    if (direct)
+    {
+        // the file system block size is a multiple of the logical block size of the disk under it
+        struct statvfs st;
+        if (fstatvfs(fd[0], &st) == 0 && st.f_bsize > block_sz && st.f_bsize <= 64 * 1024)
+            io_align = st.f_bsize;
+        for (u32 i = 0; i < stripe_count; i++)
+        {
+            fd[i] = open((root_file + to_string(i)).c_str(), O_RDWR | O_DIRECT);
+            // a host file system without O_DIRECT support keeps the buffered path
+            if (fd[i] < 0)
+            {
+                for (u32 j = 0; j < i; j++)
+                {
+                    close(fd[j]);
+                    fd[j] = fileno(fp[j]);
+                }
+                fd[i] = fileno(fp[i]);
+                direct = false;
+                io_align = block_sz;
+                break;
+            }
+        }
+    }
+    buffers.set_align(io_align);
+}
+
+BlockDevice::~BlockDevice()
+{
+    if (workers_started)
+    {
+        for (u32 i = 0; i < stripe_count; i++)
+        {
+            pthread_mutex_lock(&job_locks[i]);
+            stop = true;
+            pthread_cond_signal(&job_conds[i]);
+            pthread_mutex_unlock(&job_locks[i]);
+        }
+        for (u32 i = 0; i < stripe_count; i++)
+            pthread_join(workers[i], nullptr);
+    }
+    pthread_mutex_destroy(&start_lock);
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        if (direct)
+            close(fd[i]);
+        fclose(fp[i]);
+        pthread_rwlock_destroy(&rwlock[i]);
+        pthread_mutex_destroy(&job_locks[i]);
+        pthread_cond_destroy(&job_conds[i]);
+    }
+}
+
+u32 BlockDevice::get_total_blocks()
+{
+    return total_blocks;
+}
+
+u32 BlockDevice::get_stripe_count()
+{
+    return stripe_count;
+}
+
+u32 BlockDevice::get_stripe_unit()
+{
+    return stripe_unit;
+}
+
+bool BlockDevice::is_direct()
+{
+    return direct;
+}
+
+CipherType BlockDevice::get_cipher()
+{
+    return cipher;
+}
+
+u32 BlockDevice::get_stripe(u32 block_id)
+{
+    return block_id / stripe_unit % stripe_count;
+}
+
+// stripe units of stripe_unit blocks go round-robin over the device files
+void BlockDevice::locate(u32 block_id, u32 &stripe_id, u32 &stripe_block_id)
+{
+    assert(block_id < total_blocks);
+    stripe_id = block_id / stripe_unit % stripe_count;
+    stripe_block_id = block_id / (stripe_unit * stripe_count) * stripe_unit + block_id % stripe_unit;
+}
+
+void BlockDevice::start_workers()
+{
+    pthread_mutex_lock(&start_lock);
+    if (!workers_started)
+    {
+        for (u32 i = 0; i < stripe_count; i++)
+        {
+            worker_args[i].device = this;
+            worker_args[i].stripe_id = i;
+            pthread_create(&workers[i], nullptr, stripe_worker, &worker_args[i]);
+        }
+        workers_started = true;
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+void *BlockDevice::stripe_worker(void *arg)
+{
+    BlockDevice *device = ((StripeWorkerArg *)arg)->device;
+    u32 stripe_id = ((StripeWorkerArg *)arg)->stripe_id;
+    while (1)
+    {
+        pthread_mutex_lock(&device->job_locks[stripe_id]);
+        while (device->jobs[stripe_id].empty() && !device->stop)
+            pthread_cond_wait(&device->job_conds[stripe_id], &device->job_locks[stripe_id]);
+        if (device->jobs[stripe_id].empty())
+        {
+            pthread_mutex_unlock(&device->job_locks[stripe_id]);
+            break;
+        }
+        StripeJob job = device->jobs[stripe_id].front();
+        device->jobs[stripe_id].pop_front();
+        pthread_mutex_unlock(&device->job_locks[stripe_id]);
+        if (job.write)
+            device->write_stripe(stripe_id, job.requests);
+        else
+            device->read_stripe(stripe_id, job.requests);
+        pthread_mutex_lock(&job.batch->lock);
+        if (--job.batch->remaining == 0)
+            pthread_cond_signal(&job.batch->cond);
+        pthread_mutex_unlock(&job.batch->lock);
+    }
+    return nullptr;
+}
+
+// requests of one stripe arrive sorted by their position in the device file;
+// returns the end of the run of adjacent blocks starting at requests[i]
+u32 BlockDevice::next_run(u32 stripe_id, const vector<BlockRequest> &requests, u32 i, u32 &first_block_id)
+{
+    u32 first_stripe_id;
+    locate(requests[i].block_id, first_stripe_id, first_block_id);
+    u32 j = i + 1;
+    while (j < requests.size() && j - i < io_max_blocks)
+    {
+        u32 next_stripe_id, next_block_id;
+        locate(requests[j].block_id, next_stripe_id, next_block_id);
+        if (next_block_id != first_block_id + (j - i))
+            break;
+        j++;
+    }
+    return j;
+}
+
+// each run is read with one pread, widened to io_align for O_DIRECT
+void BlockDevice::read_stripe(u32 stripe_id, vector<BlockRequest> &requests)
+{
+    pthread_rwlock_rdlock(&rwlock[stripe_id]);
+    for (u32 i = 0; i < requests.size();)
+    {
+        u32 first_block_id;
+        u32 j = next_run(stripe_id, requests, i, first_block_id);
+        off_t start = (off_t)first_block_id * block_sz, end = start + (off_t)(j - i) * block_sz;
+        off_t aligned_start = start / io_align * io_align, aligned_end = (end + io_align - 1) / io_align * io_align;
+        u8 *buf = buffers.acquire(aligned_end - aligned_start);
+        pread(fd[stripe_id], buf, aligned_end - aligned_start, aligned_start);
+        for (u32 k = i; k < j; k++)
+        {
+            u8 *src = buf + (start - aligned_start) + (size_t)(k - i) * block_sz;
+            if (cipher == Aes128)
+                aes128_cbc_decrypt(src, (u8 *)requests[k].block, block_sz, md, md + 16);
+            else
+                memcpy(requests[k].block, src, block_sz);
+        }
+        buffers.release(buf, aligned_end - aligned_start);
+        i = j;
+    }
+    pthread_rwlock_unlock(&rwlock[stripe_id]);
+}
+
+// a run that does not cover whole host blocks reads the partial ones first; the
+// exclusive stripe lock keeps that read-modify-write from racing another writer
+void BlockDevice::write_stripe(u32 stripe_id, const vector<BlockRequest> &requests)
+{
+    pthread_rwlock_wrlock(&rwlock[stripe_id]);
+    for (u32 i = 0; i < requests.size();)
+    {
+        u32 first_block_id;
+        u32 j = next_run(stripe_id, requests, i, first_block_id);
+        off_t start = (off_t)first_block_id * block_sz, end = start + (off_t)(j - i) * block_sz;
+        off_t aligned_start = start / io_align * io_align, aligned_end = (end + io_align - 1) / io_align * io_align;
+        u8 *buf = buffers.acquire(aligned_end - aligned_start);
+        if (aligned_start < start)
+            pread(fd[stripe_id], buf, io_align, aligned_start);
+        if (aligned_end > end && !(aligned_end - io_align == aligned_start && aligned_start < start))
+            pread(fd[stripe_id], buf + (aligned_end - io_align - aligned_start), io_align, aligned_end - io_align);
+        for (u32 k = i; k < j; k++)
+        {
+            u8 *dst = buf + (start - aligned_start) + (size_t)(k - i) * block_sz;
+            if (cipher == Aes128)
+                aes128_cbc_encrypt((u8 *)requests[k].block, dst, block_sz, md, md + 16);
+            else
+                memcpy(dst, requests[k].block, block_sz);
+        }
+        pwrite(fd[stripe_id], buf, aligned_end - aligned_start, aligned_start);
+        buffers.release(buf, aligned_end - aligned_start);
+        i = j;
+    }
+    pthread_rwlock_unlock(&rwlock[stripe_id]);
+}
+
+void BlockDevice::read_block(u32 block_id, Block &block)
+{
+    u32 stripe_id, stripe_block_id;
+    locate(block_id, stripe_id, stripe_block_id);
+    vector<BlockRequest> requests(1, BlockRequest{block_id, &block});
+    read_stripe(stripe_id, requests);
+}
+
+void BlockDevice::write_block(u32 block_id, const Block &block)
+{
+    u32 stripe_id, stripe_block_id;
+    locate(block_id, stripe_id, stripe_block_id);
+    vector<BlockRequest> requests(1, BlockRequest{block_id, (Block *)&block});
+    write_stripe(stripe_id, requests);
+}
+
+void BlockDevice::submit(const vector<BlockRequest> &requests, bool write)
+{
+    vector<BlockRequest> stripes[max_stripe_count];
+    for (auto &request : requests)
+        stripes[get_stripe(request.block_id)].push_back(request);
+    u32 used = 0, last = 0;
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        if (stripes[i].empty())
+            continue;
+        // within a stripe, block order equals file order
+        sort(stripes[i].begin(), stripes[i].end(), [](const BlockRequest &a, const BlockRequest &b)
+             { return a.block_id < b.block_id; });
+        used++;
+        last = i;
+    }
+    if (used == 0)
+        return;
+    // a request confined to one stripe gains nothing from a hand-off
+    if (used == 1)
+    {
+        if (write)
+            write_stripe(last, stripes[last]);
+        else
+            read_stripe(last, stripes[last]);
+        return;
+    }
+    start_workers();
+    StripeBatch batch;
+    pthread_mutex_init(&batch.lock, nullptr);
+    pthread_cond_init(&batch.cond, nullptr);
+    batch.remaining = used;
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        if (stripes[i].empty())
+            continue;
+        pthread_mutex_lock(&job_locks[i]);
+        jobs[i].push_back(StripeJob{stripes[i], write, &batch});
+        pthread_cond_signal(&job_conds[i]);
+        pthread_mutex_unlock(&job_locks[i]);
+    }
+    pthread_mutex_lock(&batch.lock);
+    while (batch.remaining > 0)
+        pthread_cond_wait(&batch.cond, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.cond);
+}
+
+void BlockDevice::read_blocks(vector<BlockRequest> &requests)
+{
+    submit(requests, false);
+}
+
+void BlockDevice::write_blocks(const vector<BlockRequest> &requests)
+{
+    submit(requests, true);
+}
+
+Block *BlockDevice::map_block(u32 block_id)
+{
+    return nullptr;
+}
+
+bool BlockDevice::advise(const vector<u32> &block_ids)
+{
+    return false;
+}
+
+// the files only get longer, a failure part way leaves some of them too long, which is harmless
+bool BlockDevice::grow(u32 _total_blocks)
+{
+    assert(_total_blocks % (stripe_count * stripe_unit) == 0 && _total_blocks >= total_blocks);
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        if (ftruncate(fileno(fp[i]), (off_t)_total_blocks / stripe_count * block_sz) != 0)
+            return false;
+    }
+    total_blocks = _total_blocks;
+    return true;
+}
+
+MmapBlockDevice::MmapBlockDevice(u32 _stripe_count, u32 _stripe_unit, u32 _total_blocks) : BlockDevice("", _stripe_count, _stripe_unit, Plain, false, _total_blocks)
+{
+    length = (size_t)total_blocks / stripe_count * block_sz;
+    reserved = (size_t)block_unwritten_flag / stripe_count * block_sz;
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        base[i] = (u8 *)mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(base[i] != MAP_FAILED);
+        u8 *mapped = (u8 *)mmap(base[i], length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fileno(fp[i]), 0);
+        assert(mapped == base[i]);
+        // the read-ahead engine decides what to fetch, the kernel should not guess
+        madvise(base[i], length, MADV_RANDOM);
+    }
+}
+
+MmapBlockDevice::~MmapBlockDevice()
+{
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        msync(base[i], length, MS_SYNC);
+        munmap(base[i], reserved);
+    }
+}
+
+u8 *MmapBlockDevice::block_addr(u32 block_id)
+{
+    u32 stripe_id, stripe_block_id;
+    locate(block_id, stripe_id, stripe_block_id);
+    return base[stripe_id] + (size_t)stripe_block_id * block_sz;
+}
+
+// msync and madvise want a page aligned start
+static u8 *page_floor(u8 *addr)
+{
+    static const uintptr_t page_sz = sysconf(_SC_PAGESIZE);
+    return (u8 *)((uintptr_t)addr & ~(page_sz - 1));
+}
+
+void MmapBlockDevice::sync_range(u8 *addr, size_t len, int flags)
+{
+    u8 *start = page_floor(addr);
+    msync(start, addr + len - start, flags);
+}
+
+// the new range is mapped in place over the reservation, the blocks already handed out stay put
+bool MmapBlockDevice::grow(u32 _total_blocks)
+{
+    if (!BlockDevice::grow(_total_blocks))
+        return false;
+    size_t new_length = (size_t)_total_blocks / stripe_count * block_sz;
+    // the file offset of a mapping is page aligned, so the last page of the old range is mapped again
+    size_t from = (u8 *)page_floor(base[0] + length) - base[0];
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        if (mmap(base[i] + from, new_length - from, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fileno(fp[i]), from) == MAP_FAILED)
+            return false;
+        madvise(base[i] + from, new_length - from, MADV_RANDOM);
+    }
+    length = new_length;
+    return true;
+}
+
+void MmapBlockDevice::read_block(u32 block_id, Block &block)
+{
+    memcpy(&block, block_addr(block_id), block_sz);
+}
+
+void MmapBlockDevice::write_block(u32 block_id, const Block &block)
+{
+    u8 *addr = block_addr(block_id);
+    if (addr != (const u8 *)&block)
+        memcpy(addr, &block, block_sz);
+    sync_range(addr, block_sz, MS_ASYNC);
+}
+
+void MmapBlockDevice::read_blocks(vector<BlockRequest> &requests)
+{
+    for (auto &request : requests)
+        read_block(request.block_id, *request.block);
+}
+
+// a flush: runs of adjacent blocks are written back with one synchronous msync each
+void MmapBlockDevice::write_blocks(const vector<BlockRequest> &requests)
+{
+    vector<u8 *> addrs;
+    for (auto &request : requests)
+    {
+        u8 *addr = block_addr(request.block_id);
+        if (addr != (const u8 *)request.block)
+            memcpy(addr, request.block, block_sz);
+        addrs.push_back(addr);
+    }
+    sort(addrs.begin(), addrs.end());
+    for (u32 i = 0; i < addrs.size();)
+    {
+        u32 j = i + 1;
+        while (j < addrs.size() && addrs[j] == addrs[j - 1] + block_sz)
+            j++;
+        sync_range(addrs[i], addrs[j - 1] + block_sz - addrs[i], MS_SYNC);
+        i = j;
+    }
+}
+
+Block *MmapBlockDevice::map_block(u32 block_id)
+{
+    return (Block *)block_addr(block_id);
+}
+
+bool MmapBlockDevice::advise(const vector<u32> &block_ids)
+{
+    vector<u8 *> addrs;
+    for (u32 block_id : block_ids)
+        addrs.push_back(block_addr(block_id));
+    sort(addrs.begin(), addrs.end());
+    for (u32 i = 0; i < addrs.size();)
+    {
+        u32 j = i + 1;
+        while (j < addrs.size() && addrs[j] == addrs[j - 1] + block_sz)
+            j++;
+        u8 *start = page_floor(addrs[i]);
+        madvise(start, addrs[j - 1] + block_sz - start, MADV_WILLNEED);
+        i = j;
+    }
+    return true;
+}
@@ -1,25 +1,135 @@
-#ifndef __BLOCKDEV_H_
-#define __BLOCKDEV_H_
-#include "utils.h"
-#include <pthread.h>
-#include <stdio.h>
-
-struct Block
-{
-    u8 data[block_sz];
-};
-
-class BlockDevice
-{
-    pthread_rwlock_t rwlock[device_num];
-    FILE *fp[device_num];
-    u8 md[32];
-
-public:
-    BlockDevice(string password);
-    void read_block(u32 block_id, Block &block);
-    void write_block(u32 block_id, const Block &block);
-    ~BlockDevice();
-};
-
-#endif
\ No newline at end of file
+#ifndef __BLOCKDEV_H_
+#define __BLOCKDEV_H_
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+
+struct Block
+{
+    u8 data[block_sz];
+};
+
+struct BlockRequest
+{
+    u32 block_id;
+    Block *block;
+};
+
+// a multi-block request in flight, done once every stripe it touches has finished
+struct StripeBatch
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    u32 remaining;
+};
+
+struct StripeJob
+{
+    vector<BlockRequest> requests;
+    bool write;
+    StripeBatch *batch;
+};
+
+// I/O buffers aligned for O_DIRECT, recycled by power-of-two size class
+class AlignedBufferPool
+{
+    u32 align;
+    vector<u8 *> free_buffers[buffer_pool_classes];
+    pthread_mutex_t lock;
+    u32 size_class(size_t len);
+
+public:
+    AlignedBufferPool();
+    void set_align(u32 _align);
+    u8 *acquire(size_t len);
+    void release(u8 *buffer, size_t len);
+    ~AlignedBufferPool();
+};
+
+class BlockDevice;
+
+struct StripeWorkerArg
+{
+    BlockDevice *device;
+    u32 stripe_id;
+};
+
+class BlockDevice
+{
+protected:
+    u32 stripe_count;
+    u32 stripe_unit;
+    CipherType cipher;
+    // raised by grow while requests for the old blocks are running
+    atomic<u32> total_blocks;
+    pthread_rwlock_t rwlock[max_stripe_count];
+    FILE *fp[max_stripe_count];
+    int fd[max_stripe_count];
+    u8 md[32];
+    // with O_DIRECT every transfer covers whole host blocks
+    bool direct;
+    u32 io_align;
+    AlignedBufferPool buffers;
+
+    deque<StripeJob> jobs[max_stripe_count];
+    pthread_mutex_t job_locks[max_stripe_count];
+    pthread_cond_t job_conds[max_stripe_count];
+    pthread_t workers[max_stripe_count];
+    StripeWorkerArg worker_args[max_stripe_count];
+    bool workers_started;
+    bool stop;
+    pthread_mutex_t start_lock;
+    static void *stripe_worker(void *arg);
+    void start_workers();
+    void locate(u32 block_id, u32 &stripe_id, u32 &stripe_block_id);
+    u32 next_run(u32 stripe_id, const vector<BlockRequest> &requests, u32 i, u32 &first_block_id);
+    void read_stripe(u32 stripe_id, vector<BlockRequest> &requests);
+    void write_stripe(u32 stripe_id, const vector<BlockRequest> &requests);
+    void submit(const vector<BlockRequest> &requests, bool write);
+
+public:
+    BlockDevice(string password, u32 _stripe_count = device_num, u32 _stripe_unit = 1, CipherType _cipher = Aes128, bool _direct = false, u32 _total_blocks = device_block_num);
+    bool is_direct();
+    u32 get_total_blocks();
+    u32 get_stripe_count();
+    u32 get_stripe_unit();
+    u32 get_stripe(u32 block_id);
+    CipherType get_cipher();
+    virtual void read_block(u32 block_id, Block &block);
+    virtual void write_block(u32 block_id, const Block &block);
+    // fan the blocks out to their stripes and return when all of them are done
+    virtual void read_blocks(vector<BlockRequest> &requests);
+    virtual void write_blocks(const vector<BlockRequest> &requests);
+    // the block in place, for devices whose storage can be addressed directly
+    virtual Block *map_block(u32 block_id);
+    // hint upcoming reads, true if the device handles read-ahead itself
+    virtual bool advise(const vector<u32> &block_ids);
+    // extend every stripe file to hold _total_blocks blocks; the new blocks read as zeros
+    virtual bool grow(u32 _total_blocks);
+    virtual ~BlockDevice();
+};
+
+// plaintext volume mapped into memory: cache entries point at the mapped pages,
+// so blocks are neither read nor copied and a write-back is an msync of the range
+class MmapBlockDevice : public BlockDevice
+{
+    u8 *base[max_stripe_count];
+    size_t length;
+    // address space kept free after each mapping, so that growing never moves a block
+    size_t reserved;
+    u8 *block_addr(u32 block_id);
+    void sync_range(u8 *addr, size_t len, int flags);
+
+public:
+    MmapBlockDevice(u32 _stripe_count = device_num, u32 _stripe_unit = 1, u32 _total_blocks = device_block_num);
+    void read_block(u32 block_id, Block &block);
+    void write_block(u32 block_id, const Block &block);
+    void read_blocks(vector<BlockRequest> &requests);
+    void write_blocks(const vector<BlockRequest> &requests);
+    Block *map_block(u32 block_id);
+    bool advise(const vector<u32> &block_ids);
+    bool grow(u32 _total_blocks);
+    ~MmapBlockDevice();
+};
+
+#endif
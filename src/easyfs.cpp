@@ -2,265 +2,668 @@
 
 #include <iostream>
 #include <string>
-
-#include "Fuse-impl.h"
+#include <stddef.h>
+#include <linux/falloc.h>
 
 using namespace std;
 
-int EasyFS::getattr(const char *path, struct stat *stbuf, struct fuse_file_info *)
+// FUSE reserves inode number 1 for the root, our root inode is 0
+static inline u32 to_inode_id(fuse_ino_t ino)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	i32 err;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	shared_ptr<Inode> inode = fs.get()->find(path, err);
-	if (inode == nullptr)
+	return ino - FUSE_ROOT_ID;
+}
+
+static inline fuse_ino_t to_ino(u32 inode_id)
+{
+	return inode_id + FUSE_ROOT_ID;
+}
+
+const struct fuse_opt easyfs_opts[] = {
+	{"attr_timeout=%lf", offsetof(EasyFSConfig, attr_timeout), 0},
+	{"entry_timeout=%lf", offsetof(EasyFSConfig, entry_timeout), 0},
+	{"writeback_cache", offsetof(EasyFSConfig, writeback_cache), 1},
+	{"max_write=%u", offsetof(EasyFSConfig, max_write), 0},
+	{"odirect", offsetof(EasyFSConfig, odirect), 1},
+	{"huge_pages", offsetof(EasyFSConfig, huge_pages), 1},
+	FUSE_OPT_END};
+
+struct fuse_entry_param EasyFS::get_entry(shared_ptr<Inode> inode)
+{
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = to_ino(inode.get()->get_id());
+	e.attr = inode.get()->get_stat();
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = config.attr_timeout;
+	e.entry_timeout = config.entry_timeout;
+	return e;
+}
+
+void *EasyFS::notify_worker(void *arg)
+{
+	EasyFS *self = static_cast<EasyFS *>(arg);
+	pthread_mutex_lock(&self->notify_lock);
+	while (1)
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -err;
+		while (self->notify_queue.empty() && !self->notify_stop)
+			pthread_cond_wait(&self->notify_cond, &self->notify_lock);
+		if (self->notify_queue.empty())
+			break;
+		u32 inode_id = self->notify_queue.front();
+		self->notify_queue.pop_front();
+		pthread_mutex_unlock(&self->notify_lock);
+		fuse_lowlevel_notify_inval_inode(self->session(), to_ino(inode_id), 0, 0);
+		pthread_mutex_lock(&self->notify_lock);
 	}
-	u32 uid, gid;
-	fs.get()->get_user(uid, gid);
-	if (!inode.get()->permit_r(uid, gid))
+	pthread_mutex_unlock(&self->notify_lock);
+	return nullptr;
+}
+
+// drop the kernel's cached pages and attributes after we changed an inode behind its back
+void EasyFS::notify_inval_inode(u32 inode_id)
+{
+	pthread_mutex_lock(&notify_lock);
+	notify_queue.push_back(inode_id);
+	pthread_cond_signal(&notify_cond);
+	pthread_mutex_unlock(&notify_lock);
+}
+
+void *EasyFS::warm_worker(void *arg)
+{
+	EasyFS *self = static_cast<EasyFS *>(arg);
+	self->fs.get()->warm_up(warm_file, self->warm_stop);
+	return nullptr;
+}
+
+void EasyFS::init(void *userdata, struct fuse_conn_info *conn)
+{
+	EasyFS *self = static_cast<EasyFS *>(userdata);
+	// let write payloads arrive in a pipe, write_buf then reads them straight into cache blocks
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+	// buffer small writes in the kernel page cache and send them in max_write sized chunks
+	if (self->config.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	if (self->config.max_write > 0)
+		conn->max_write = self->config.max_write;
+	pthread_create(&self->notifier, nullptr, notify_worker, self);
+	pthread_create(&self->warmer, nullptr, warm_worker, self);
+}
+
+void EasyFS::destroy(void *userdata)
+{
+	EasyFS *self = static_cast<EasyFS *>(userdata);
+	pthread_mutex_lock(&self->notify_lock);
+	self->notify_stop = true;
+	pthread_cond_signal(&self->notify_cond);
+	pthread_mutex_unlock(&self->notify_lock);
+	pthread_join(self->notifier, nullptr);
+	self->warm_stop = true;
+	pthread_join(self->warmer, nullptr);
+	self->fs.get()->forget_all();
+	self->fs.get()->flush_delayed();
+	self->fs.get()->save_cached(warm_file);
+	const char *pool_names[2] = {"metadata", "data"};
+	for (u32 pool = MetaPool; pool <= DataPool; pool++)
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -EACCES;
+		u64 hit, miss;
+		BLOCK_CACHE_MANAGER.get_stats(pool, hit, miss);
+		fprintf(stderr, "%s cache: %llu hits, %llu misses\n", pool_names[pool], (unsigned long long)hit, (unsigned long long)miss);
 	}
-	*stbuf = inode.get()->get_stat();
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return 0;
 }
 
-int EasyFS::opendir(const char *path, struct fuse_file_info *fi)
+void EasyFS::lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
 	i32 err;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	shared_ptr<Inode> inode = fs.get()->find(path, err);
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	shared_ptr<Inode> inode = fs.get()->lookup(to_inode_id(parent), name, ctx->uid, ctx->gid, err, true);
 	if (inode == nullptr)
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -err;
+		fuse_reply_err(req, err);
+		return;
 	}
-	if (!inode.get()->is_dir())
+	struct fuse_entry_param e = this_(req)->get_entry(inode);
+	fuse_reply_entry(req, &e);
+}
+
+void EasyFS::forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	fs.get()->forget(to_inode_id(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+void EasyFS::forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	for (size_t i = 0; i < count; i++)
+		fs.get()->forget(to_inode_id(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+void EasyFS::getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *)
+{
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	u32 inode_id = to_inode_id(ino);
+	shared_ptr<Inode> inode = fs.get()->get_inode(inode_id);
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	fs.get()->rdlock_inode(inode_id);
+	if (!fs.get()->permit(inode, ctx->uid, ctx->gid, R_OK))
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -ENOTDIR;
+		fs.get()->unlock_inode(inode_id);
+		fuse_reply_err(req, EACCES);
+		return;
 	}
-	u32 uid, gid;
-	fs.get()->get_user(uid, gid);
-	u32 flags = fi->flags & O_ACCMODE;
-	if ((flags == O_RDONLY || flags == O_RDWR) && !inode.get()->permit_r(uid, gid))
+	struct stat st = inode.get()->get_stat();
+	fs.get()->unlock_inode(inode_id);
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, this_(req)->config.attr_timeout);
+}
+
+void EasyFS::setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *)
+{
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	u32 inode_id = to_inode_id(ino);
+	shared_ptr<Inode> inode = fs.get()->get_inode(inode_id);
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	fs.get()->wrlock_inode(inode_id);
+	if ((to_set & (FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) && inode.get()->is_readonly())
+	{
+		fs.get()->unlock_inode(inode_id);
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	if ((to_set & FUSE_SET_ATTR_SIZE) && inode.get()->is_dir())
+	{
+		fs.get()->unlock_inode(inode_id);
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	if ((to_set & FUSE_SET_ATTR_SIZE) && (attr->st_size < 0 || (u64)attr->st_size > (u64)indirect2_bound * block_sz))
+	{
+		fs.get()->unlock_inode(inode_id);
+		fuse_reply_err(req, attr->st_size < 0 ? EINVAL : EFBIG);
+		return;
+	}
+	// only the owner may chmod and only root may chown
+	u32 owner_mode, owner_uid, owner_gid;
+	inode.get()->get_permission(owner_mode, owner_uid, owner_gid);
+	if ((ctx->uid != 0 && (to_set & FUSE_SET_ATTR_MODE) && ctx->uid != owner_uid) ||
+		(ctx->uid != 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))))
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -EACCES;
+		fs.get()->unlock_inode(inode_id);
+		fuse_reply_err(req, EPERM);
+		return;
 	}
-	if ((flags == O_WRONLY || flags == O_RDWR) && !inode.get()->permit_w(uid, gid))
+	if ((to_set & FUSE_SET_ATTR_SIZE) && !fs.get()->permit(inode, ctx->uid, ctx->gid, W_OK))
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -EACCES;
+		fs.get()->unlock_inode(inode_id);
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE)
+		inode.get()->truncate(attr->st_size);
+	if (to_set & FUSE_SET_ATTR_MODE)
+		fs.get()->set_mode(inode, attr->st_mode & ~S_IFMT);
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+	{
+		u32 uid = owner_uid, gid = owner_gid;
+		if (to_set & FUSE_SET_ATTR_UID)
+			uid = attr->st_uid;
+		if (to_set & FUSE_SET_ATTR_GID)
+			gid = attr->st_gid;
+		fs.get()->set_owner(inode, uid, gid);
+	}
+	struct stat st = inode.get()->get_stat();
+	fs.get()->unlock_inode(inode_id);
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, this_(req)->config.attr_timeout);
+}
+
+void EasyFS::opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	shared_ptr<Inode> inode = fs.get()->get_inode(to_inode_id(ino));
+	if (!inode.get()->is_dir())
+	{
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	u32 flags = fi->flags & O_ACCMODE;
+	if (((flags == O_RDONLY || flags == O_RDWR) && !fs.get()->permit(inode, ctx->uid, ctx->gid, R_OK)) ||
+		((flags == O_WRONLY || flags == O_RDWR) && !fs.get()->permit(inode, ctx->uid, ctx->gid, W_OK)))
+	{
+		fuse_reply_err(req, EACCES);
+		return;
 	}
 	fi->fh = inode.get()->get_id();
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return 0;
+	fuse_reply_open(req, fi);
 }
 
-int EasyFS::readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+// the offset of an entry is its directory slot + 1, so a listing resumes without rescanning;
+// slots are read one directory block at a time and their inodes stat'ed per inode block
+void EasyFS::fill_dir(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info *fi, bool plus)
 {
-	if (fi->fh == (uint64_t)-1)
-		return -ENOENT;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
+	EasyFS *self = this_(req);
+	shared_ptr<EasyFileSystem> fs = self->fs;
 	shared_ptr<Inode> inode = fs.get()->get_inode(fi->fh);
-	auto childs = inode.get()->ls();
-	for (auto child : childs)
+	vector<char> buf(size);
+	size_t buf_size = 0;
+	u32 index = offset;
+	bool full = false;
+	DirEntry dirents[dirents_per_block];
+	fs.get()->rdlock_inode(fi->fh);
+	while (!full)
 	{
-		shared_ptr<Inode> inode_child = fs.get()->get_inode(child.second);
-		struct stat st = inode_child.get()->get_stat();
-		filler(buf, child.first.c_str(), &st, 0, FUSE_FILL_DIR_PLUS);
+		u32 count = inode.get()->read_dirents(index, dirents, dirents_per_block - index % dirents_per_block);
+		if (count == 0)
+			break;
+		vector<u32> slots, inode_ids;
+		for (u32 i = 0; i < count; i++)
+		{
+			if (dirents[i].get_name().length() > 0)
+			{
+				slots.push_back(index + i);
+				inode_ids.push_back(dirents[i].get_inode_number());
+			}
+		}
+		vector<struct stat> stats;
+		if (plus)
+			stats = fs.get()->get_stats(inode_ids);
+		for (u32 i = 0; i < slots.size(); i++)
+		{
+			string name = dirents[slots[i] - index].get_name();
+			size_t entry_size;
+			if (plus)
+			{
+				struct fuse_entry_param e;
+				memset(&e, 0, sizeof(e));
+				e.ino = to_ino(inode_ids[i]);
+				e.attr = stats[i];
+				e.attr.st_ino = e.ino;
+				e.attr_timeout = self->config.attr_timeout;
+				e.entry_timeout = self->config.entry_timeout;
+				entry_size = fuse_add_direntry_plus(req, buf.data() + buf_size, size - buf_size, name.c_str(), &e, slots[i] + 1);
+			}
+			else
+			{
+				struct stat st;
+				memset(&st, 0, sizeof(st));
+				st.st_ino = to_ino(inode_ids[i]);
+				entry_size = fuse_add_direntry(req, buf.data() + buf_size, size - buf_size, name.c_str(), &st, slots[i] + 1);
+			}
+			if (entry_size > size - buf_size)
+			{
+				full = true;
+				break;
+			}
+			buf_size += entry_size;
+			// every entry returned by readdirplus counts as a lookup
+			if (plus)
+				fs.get()->add_lookup(inode_ids[i], 1);
+		}
+		index += count;
 	}
-	return 0;
+	fs.get()->unlock_inode(fi->fh);
+	fuse_reply_buf(req, buf.data(), buf_size);
+}
+
+void EasyFS::readdir(fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	fill_dir(req, size, offset, fi, false);
 }
 
-int EasyFS::releasedir(const char *, struct fuse_file_info *fi)
+void EasyFS::readdirplus(fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	fill_dir(req, size, offset, fi, true);
+}
+
+void EasyFS::releasedir(fuse_req_t req, fuse_ino_t, struct fuse_file_info *fi)
 {
 	fi->fh = (uint64_t)-1;
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-int EasyFS::open(const char *path, struct fuse_file_info *fi)
+void EasyFS::open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	i32 err;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	shared_ptr<Inode> inode = fs.get()->find(path, err);
-	if (inode == nullptr)
-	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -err;
-	}
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	shared_ptr<Inode> inode = fs.get()->get_inode(to_inode_id(ino));
 	if (inode.get()->is_dir())
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -EISDIR;
+		fuse_reply_err(req, EISDIR);
+		return;
 	}
-	u32 uid, gid;
-	fs.get()->get_user(uid, gid);
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 	u32 flags = fi->flags & O_ACCMODE;
-	if ((flags == O_RDONLY || flags == O_RDWR) && !inode.get()->permit_r(uid, gid))
+	if (((flags == O_RDONLY || flags == O_RDWR) && !fs.get()->permit(inode, ctx->uid, ctx->gid, R_OK)) ||
+		((flags == O_WRONLY || flags == O_RDWR || (fi->flags & O_TRUNC)) && !fs.get()->permit(inode, ctx->uid, ctx->gid, W_OK)))
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -EACCES;
-	}
-	if ((flags == O_WRONLY || flags == O_RDWR) && !inode.get()->permit_w(uid, gid))
-	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -EACCES;
+		fuse_reply_err(req, EACCES);
+		return;
 	}
+	// all data changes pass through the kernel, so its page cache stays valid across opens;
+	// a truncation done here is the exception and is invalidated explicitly
 	if (fi->flags & O_TRUNC)
+	{
+		fs.get()->wrlock_inode(inode.get()->get_id());
 		inode.get()->clear();
+		fs.get()->unlock_inode(inode.get()->get_id());
+		this_(req)->notify_inval_inode(inode.get()->get_id());
+	}
+	else if (!(fi->flags & O_DIRECT))
+		fi->keep_cache = 1;
+	// O_DIRECT bypasses the page cache here and the block cache below
+	if (fi->flags & O_DIRECT)
+		fi->direct_io = 1;
 	fi->fh = inode.get()->get_id();
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return 0;
+	fuse_reply_open(req, fi);
 }
 
-int EasyFS::read(const char *, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+void EasyFS::read(fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	if (fi->fh == (uint64_t)-1)
-		return -ENOENT;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
 	shared_ptr<Inode> inode = fs.get()->get_inode(fi->fh);
-	return inode->read_at(offset, (u8 *)buf, size);
+	// no file reaches past the block map, and the offsets below are 32 bits
+	if ((u64)offset >= (u64)indirect2_bound * block_sz)
+	{
+		fuse_reply_buf(req, nullptr, 0);
+		return;
+	}
+	// a long or O_DIRECT read is streamed from the device instead of filling the cache
+	if ((fi->flags & O_DIRECT) || size >= stream_threshold)
+	{
+		vector<u8> buf(size);
+		u32 read_size = inode->read_at(offset, buf.data(), size, (fi->flags & O_DIRECT) != 0);
+		fuse_reply_buf(req, (const char *)buf.data(), read_size);
+		return;
+	}
+	vector<BlockSlice> slices;
+	inode->read_slices(offset, size, slices);
+	// reply straight from the cached blocks, they stay locked until the data is sent
+	vector<struct iovec> iov(slices.size());
+	static const Block zero_block = {};
+	for (u32 i = 0; i < slices.size(); i++)
+	{
+		// a hole has no block behind it
+		if (slices[i].block.get() == nullptr)
+			iov[i].iov_base = (void *)(zero_block.data + slices[i].offset);
+		else
+			iov[i].iov_base = (void *)(slices[i].block.get()->lock_shared() + slices[i].offset);
+		iov[i].iov_len = slices[i].len;
+	}
+	if (iov.empty())
+		fuse_reply_buf(req, nullptr, 0);
+	else
+		fuse_reply_iov(req, iov.data(), iov.size());
+	for (auto &slice : slices)
+		if (slice.block.get() != nullptr)
+			slice.block.get()->unlock_shared();
 }
 
-int EasyFS::write(const char *, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+void EasyFS::write_buf(fuse_req_t req, fuse_ino_t, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi)
 {
-	if (fi->fh == (uint64_t)-1)
-		return -ENOENT;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
 	shared_ptr<Inode> inode = fs.get()->get_inode(fi->fh);
-	return inode->write_at(offset, (u8 *)buf, size);
+	bool failed = false;
+	// a write crossing the largest file size the block map can address stops short of it
+	u64 max_size = (u64)indirect2_bound * block_sz;
+	if ((u64)offset >= max_size)
+	{
+		fuse_reply_err(req, EFBIG);
+		return;
+	}
+	u32 size = min((u64)fuse_buf_size(bufv), max_size - offset);
+	// shared, so writes only wait while a snapshot is taken or the file is shared
+	fs.get()->rdlock_inode(fi->fh);
+	u32 write_size = inode->write_from(offset, size, [bufv, &failed](u8 *dst, u32 len)
+									   {
+										   struct fuse_bufvec dst_buf = FUSE_BUFVEC_INIT(len);
+										   dst_buf.buf[0].mem = dst;
+										   if (fuse_buf_copy(&dst_buf, bufv, (enum fuse_buf_copy_flags)0) != (ssize_t)len)
+											   failed = true;
+									   },
+									   (fi->flags & O_DIRECT) != 0);
+	fs.get()->unlock_inode(fi->fh);
+	if (failed)
+		fuse_reply_err(req, EIO);
+	else
+		fuse_reply_write(req, write_size);
 }
 
-int EasyFS::fsync(const char *, int isdatasync, struct fuse_file_info *fi)
+void EasyFS::fsync(fuse_req_t req, fuse_ino_t, int isdatasync, struct fuse_file_info *fi)
 {
-	if (fi->fh == (uint64_t)-1)
-		return -ENOENT;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
 	shared_ptr<Inode> inode = fs.get()->get_inode(fi->fh);
 	inode->sync();
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-int EasyFS::release(const char *, struct fuse_file_info *fi)
+void EasyFS::release(fuse_req_t req, fuse_ino_t, struct fuse_file_info *fi)
 {
-	if (fi->fh == (uint64_t)-1)
-		return -ENOENT;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
 	shared_ptr<Inode> inode = fs.get()->get_inode(fi->fh);
 	inode->sync();
 	fi->fh = (uint64_t)-1;
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-int EasyFS::create(const char *path, mode_t mode, struct fuse_file_info *fi)
+void EasyFS::create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
 	i32 err;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	shared_ptr<Inode> inode = fs.get()->create(path, DiskInodeType::File, err, mode);
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	shared_ptr<Inode> inode = fs.get()->create(to_inode_id(parent), name, DiskInodeType::File, ctx->uid, ctx->gid, err, mode & ~S_IFMT, true);
 	if (inode == nullptr)
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -err;
+		fuse_reply_err(req, err);
+		return;
 	}
+	if (fi->flags & O_DIRECT)
+		fi->direct_io = 1;
 	fi->fh = inode.get()->get_id();
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return 0;
+	struct fuse_entry_param e = this_(req)->get_entry(inode);
+	fuse_reply_create(req, &e, fi);
 }
 
-int EasyFS::mkdir(const char *path, mode_t mode)
+void EasyFS::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
 	i32 err;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	shared_ptr<Inode> inode = fs.get()->create(path, DiskInodeType::Directory, err, mode);
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	shared_ptr<Inode> inode(nullptr);
+	// mkdir in /.snapshots takes a snapshot of the whole tree under that name
+	if (fs.get()->is_snapshot_dir(to_inode_id(parent)))
+		inode = fs.get()->snapshot(to_inode_id(parent), name, ctx->uid, ctx->gid, err, true);
+	else
+		inode = fs.get()->create(to_inode_id(parent), name, DiskInodeType::Directory, ctx->uid, ctx->gid, err, mode & ~S_IFMT, true);
 	if (inode == nullptr)
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -err;
+		fuse_reply_err(req, err);
+		return;
 	}
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return 0;
+	struct fuse_entry_param e = this_(req)->get_entry(inode);
+	fuse_reply_entry(req, &e);
+}
+
+void EasyFS::unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	i64 re = fs.get()->unlink(to_inode_id(parent), name, ctx->uid, ctx->gid);
+	fuse_reply_err(req, -re);
 }
 
-int EasyFS::unlink(const char *path)
+void EasyFS::rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	i64 re = fs.get()->unlink(path);
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return re;
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	i64 re;
+	if (fs.get()->is_snapshot_dir(to_inode_id(parent)))
+		re = fs.get()->remove_snapshot(to_inode_id(parent), name, ctx->uid, ctx->gid);
+	else
+		re = fs.get()->unlink(to_inode_id(parent), name, ctx->uid, ctx->gid);
+	fuse_reply_err(req, -re);
 }
 
-int EasyFS::rmdir(const char *path)
+void EasyFS::rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	i64 re = fs.get()->unlink(path);
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return re;
+	if (flags != 0)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	i64 re = fs.get()->rename(to_inode_id(parent), name, to_inode_id(newparent), newname, ctx->uid, ctx->gid);
+	fuse_reply_err(req, -re);
 }
 
-int EasyFS::rename(const char *from, const char *to, unsigned int flags)
+void EasyFS::link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	i64 re = fs.get()->rename(from, to);
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return re;
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	i64 re = fs.get()->link(to_inode_id(ino), to_inode_id(newparent), newname, ctx->uid, ctx->gid);
+	if (re < 0)
+	{
+		fuse_reply_err(req, -re);
+		return;
+	}
+	// the kernel holds a reference on ino for the duration of the call
+	fs.get()->add_lookup(to_inode_id(ino), 1);
+	struct fuse_entry_param e = this_(req)->get_entry(fs.get()->get_inode(to_inode_id(ino)));
+	fuse_reply_entry(req, &e);
 }
 
-int EasyFS::link(const char *from, const char *to)
+// file offsets beyond what the block map can address are clamped to its end
+static u32 clamp_offset(u64 offset)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	i64 re = fs.get()->link(from, to);
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return re;
+	return (u32)min(offset, (u64)indirect2_bound * block_sz);
 }
 
-int EasyFS::chmod(const char *path, mode_t mode, struct fuse_file_info *)
+void EasyFS::fallocate(fuse_req_t req, fuse_ino_t, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	i32 err;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	shared_ptr<Inode> inode = fs.get()->find(path, err);
-	if (inode == nullptr)
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	shared_ptr<Inode> inode = fs.get()->get_inode(fi->fh);
+	if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -err;
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
 	}
-	inode.get()->set_mode(mode);
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return 0;
+	if (offset < 0 || length <= 0)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	u32 start = clamp_offset(offset);
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+	{
+		fs.get()->rdlock_inode(fi->fh);
+		inode->punch_hole(start, clamp_offset((u64)offset + length) - start);
+		fs.get()->unlock_inode(fi->fh);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	if ((u64)offset + length > (u64)indirect2_bound * block_sz && !(mode & FALLOC_FL_KEEP_SIZE))
+	{
+		fuse_reply_err(req, EFBIG);
+		return;
+	}
+	fs.get()->rdlock_inode(fi->fh);
+	i32 re = inode->preallocate(start, clamp_offset((u64)offset + length) - start, (mode & FALLOC_FL_KEEP_SIZE) != 0);
+	fs.get()->unlock_inode(fi->fh);
+	fuse_reply_err(req, -re);
 }
 
-int EasyFS::chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *)
+// both files stay locked, so neither can drop a block while it is being shared
+void EasyFS::copy_file_range(fuse_req_t req, fuse_ino_t, off_t off_in, struct fuse_file_info *fi_in, fuse_ino_t, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags)
 {
-	pthread_mutex_lock(&this_()->inode_lock);
-	i32 err;
-	shared_ptr<EasyFileSystem> fs = this_()->fs;
-	shared_ptr<Inode> inode = fs.get()->find(path, err);
-	if (inode == nullptr)
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	shared_ptr<Inode> src = fs.get()->get_inode(fi_in->fh);
+	shared_ptr<Inode> dst = fs.get()->get_inode(fi_out->fh);
+	if (flags != 0 || off_in < 0 || off_out < 0)
 	{
-		pthread_mutex_unlock(&this_()->inode_lock);
-		return -err;
+		fuse_reply_err(req, EINVAL);
+		return;
 	}
-	inode.get()->set_owner(uid, gid);
-	pthread_mutex_unlock(&this_()->inode_lock);
-	return 0;
+	if (!src.get()->is_file() || !dst.get()->is_file())
+	{
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	u64 max_size = (u64)indirect2_bound * block_sz;
+	len = min((u64)len, max_size);
+	if ((u64)off_in >= max_size || len == 0)
+	{
+		fuse_reply_write(req, 0);
+		return;
+	}
+	if ((u64)off_out + len > max_size)
+	{
+		if ((u64)off_out >= max_size)
+		{
+			fuse_reply_err(req, EFBIG);
+			return;
+		}
+		len = max_size - off_out;
+	}
+	if (fi_in->fh == fi_out->fh && (u64)off_in < (u64)off_out + len && (u64)off_out < (u64)off_in + len)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	vector<u32> locked = {(u32)fi_in->fh, (u32)fi_out->fh};
+	fs.get()->wrlock_inodes(locked);
+	u32 copied = dst.get()->copy_from(src, off_in, off_out, len);
+	fs.get()->unlock_inodes(locked);
+	fuse_reply_write(req, copied);
+}
+
+void EasyFS::lseek(fuse_req_t req, fuse_ino_t, off_t off, int whence, struct fuse_file_info *fi)
+{
+	shared_ptr<EasyFileSystem> fs = this_(req)->fs;
+	shared_ptr<Inode> inode = fs.get()->get_inode(fi->fh);
+	if ((whence != SEEK_DATA && whence != SEEK_HOLE) || off < 0)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	i64 re = inode->seek(clamp_offset(off), whence);
+	if (re < 0)
+		fuse_reply_err(req, -re);
+	else
+		fuse_reply_lseek(req, re);
 }
 
-int EasyFS::utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi)
+// efs_ioc_cache_stats is open to any user; efs_ioc_grow needs root, and the new blocks can
+// be allocated as soon as it returns
+void EasyFS::ioctl(fuse_req_t req, fuse_ino_t, unsigned int cmd, void *, struct fuse_file_info *, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
 {
-	return 0;
-}
\ No newline at end of file
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	if (cmd == efs_ioc_cache_stats && !(flags & FUSE_IOCTL_COMPAT) && out_bufsz == sizeof(CacheStats))
+	{
+		CacheStats stats;
+		for (u32 pool = MetaPool; pool <= DataPool; pool++)
+			BLOCK_CACHE_MANAGER.get_stats(pool, stats.hits[pool], stats.misses[pool]);
+		fuse_reply_ioctl(req, 0, &stats, sizeof(stats));
+		return;
+	}
+	if (cmd != efs_ioc_grow || (flags & FUSE_IOCTL_COMPAT) || in_bufsz != sizeof(u64))
+	{
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+	if (ctx->uid != 0)
+	{
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	u64 size;
+	memcpy(&size, in_buf, sizeof(size));
+	i32 re = this_(req)->fs.get()->grow(size / block_sz);
+	if (re != 0)
+		fuse_reply_err(req, -re);
+	else
+		fuse_reply_ioctl(req, 0, nullptr, 0);
+}
@@ -1,67 +1,116 @@
 #ifndef __EASYFS_H_
 #define __EASYFS_H_
 
-#include "Fuse.h"
-
-#include "Fuse-impl.h"
+#include "FuseLowlevel.h"
 #include "efs.h"
 
-class EasyFS : public Fusepp::Fuse<EasyFS>
+// mount options: -o attr_timeout=T,entry_timeout=T,writeback_cache,max_write=N
+// (max_read=N is handled by libfuse itself)
+struct EasyFSConfig
+{
+  double attr_timeout = 1.0;
+  double entry_timeout = 1.0;
+  int writeback_cache = 0;
+  unsigned max_write = 0;
+  // open the device files with O_DIRECT so blocks are cached by us only
+  int odirect = 0;
+  // back the block cache arena with transparent huge pages
+  int huge_pages = 0;
+};
+
+extern const struct fuse_opt easyfs_opts[];
+
+class EasyFS : public Fusepp::FuseLowlevel<EasyFS>
 {
   shared_ptr<BlockDevice> device;
   shared_ptr<EasyFileSystem> fs;
-  u32 uid, gid;
-  pthread_mutex_t inode_lock;
+  EasyFSConfig config;
+
+  // kernel cache invalidations are sent from a separate thread, never from inside a request
+  pthread_t notifier;
+  pthread_mutex_t notify_lock;
+  pthread_cond_t notify_cond;
+  deque<u32> notify_queue;
+  bool notify_stop;
+  static void *notify_worker(void *arg);
+  void notify_inval_inode(u32 inode_id);
+
+  // reloads the blocks cached at the last unmount while requests are already served
+  pthread_t warmer;
+  atomic<bool> warm_stop;
+  static void *warm_worker(void *arg);
+
+  struct fuse_entry_param get_entry(shared_ptr<Inode> inode);
+  static void fill_dir(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info *fi, bool plus);
 
 public:
-  EasyFS(shared_ptr<BlockDevice> _device, shared_ptr<EasyFileSystem> _fs, u32 _uid, u32 _gid)
+  EasyFS(shared_ptr<BlockDevice> _device, shared_ptr<EasyFileSystem> _fs, EasyFSConfig _config)
   {
     device = _device;
     fs = _fs;
-    uid = _uid;
-    gid = _gid;
-    pthread_mutex_init(&inode_lock, nullptr);
+    config = _config;
+    notify_stop = false;
+    warm_stop = false;
+    pthread_mutex_init(&notify_lock, nullptr);
+    pthread_cond_init(&notify_cond, nullptr);
   }
   ~EasyFS()
   {
-    pthread_mutex_destroy(&inode_lock);
+    pthread_mutex_destroy(&notify_lock);
+    pthread_cond_destroy(&notify_cond);
   }
 
-  static int getattr(const char *path, struct stat *stbuf, struct fuse_file_info *);
+  static void init(void *userdata, struct fuse_conn_info *conn);
+
+  static void destroy(void *userdata);
+
+  static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+  static void forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+
+  static void forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+
+  static void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+  static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+
+  static void opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+  static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
 
-  static int opendir(const char *path, struct fuse_file_info *fi);
+  static void readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
 
-  static int readdir(const char *, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags);
+  static void releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
-  static int releasedir(const char *, struct fuse_file_info *fi);
+  static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
-  static int open(const char *path, struct fuse_file_info *fi);
+  static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
 
-  static int read(const char *, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+  static void write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi);
 
-  static int write(const char *, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+  static void fsync(fuse_req_t req, fuse_ino_t ino, int isdatasync, struct fuse_file_info *fi);
 
-  static int fsync(const char *, int isdatasync, struct fuse_file_info *fi);
+  static void release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
-  static int release(const char *, struct fuse_file_info *fi);
+  static void create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
 
-  static int create(const char *path, mode_t mode, struct fuse_file_info *fi);
+  static void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
 
-  static int mkdir(const char *path, mode_t mode);
+  static void unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
 
-  static int unlink(const char *path);
+  static void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
 
-  static int rmdir(const char *path);
+  static void rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags);
 
-  static int rename(const char *from, const char *to, unsigned int flags);
+  static void link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname);
 
-  static int link(const char *from, const char *to);
+  static void fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
 
-  static int chmod(const char *path, mode_t mode, struct fuse_file_info *);
+  static void lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi);
 
-  static int chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi);
+  static void copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags);
 
-  static int utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi);
+  static void ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz);
 };
 
 #endif
@@ -1,347 +1,1184 @@
-#include "efs.h"
-
-EasyFileSystem::EasyFileSystem(shared_ptr<BlockDevice> _block_device, shared_ptr<Bitmap> _inode_bitmap, shared_ptr<Bitmap> _data_bitmap, u32 _inode_area_start_block, u32 _data_area_start_block)
-{
-    block_device = _block_device;
-    inode_bitmap = _inode_bitmap;
-    data_bitmap = _data_bitmap;
-    inode_area_start_block = _inode_area_start_block;
-    data_area_start_block = _data_area_start_block;
-    u32 root_inode_block_id, root_inode_offset;
-    get_disk_inode_pos(0, root_inode_block_id, root_inode_offset);
-    root = shared_ptr<Inode>(new Inode(0, root_inode_block_id, root_inode_offset, this, _block_device));
-    uid = gid = 0;
-}
-shared_ptr<EasyFileSystem> EasyFileSystem::open(shared_ptr<BlockDevice> _block_device)
-{
-    u32 inode_area_blocks, data_bitmap_blocks, data_area_blocks;
-    bool valid = BLOCK_CACHE_MANAGER
-                     .get_block_cache(0, _block_device, -1)
-                     .get()
-                     ->read<SuperBlock, bool>(0, [&inode_area_blocks, &data_bitmap_blocks, &data_area_blocks](const SuperBlock &super_block) -> u32
-                                              {
-                                                  if (!super_block.is_valid())
-                                                      return false;
-                                                  inode_area_blocks = super_block.inode_area_blocks;
-                                                  data_bitmap_blocks = super_block.data_bitmap_blocks;
-                                                  data_area_blocks = super_block.data_area_blocks;
-                                                  return true;
-                                              });
-    if (!valid)
-        return shared_ptr<EasyFileSystem>(nullptr);
-    u32 inode_total_blocks = inode_bitmap_blocks + inode_area_blocks;
-    shared_ptr<Bitmap> inode_bitmap = shared_ptr<Bitmap>(new Bitmap(1, inode_bitmap_blocks));
-    shared_ptr<Bitmap> data_bitmap = shared_ptr<Bitmap>(new Bitmap(1 + inode_total_blocks, data_bitmap_blocks));
-    shared_ptr<EasyFileSystem> efs = shared_ptr<EasyFileSystem>(new EasyFileSystem(_block_device, inode_bitmap, data_bitmap, 1 + inode_bitmap_blocks, 1 + inode_total_blocks + data_bitmap_blocks));
-    assert(efs.get()->root->is_dir());
-    return efs;
-}
-shared_ptr<EasyFileSystem> EasyFileSystem::create(shared_ptr<BlockDevice> _block_device)
-{
-    shared_ptr<Bitmap> inode_bitmap = shared_ptr<Bitmap>(new Bitmap(1, inode_bitmap_blocks));
-    u32 inode_num = inode_bitmap.get()->maximum();
-    u32 inode_area_blocks = (inode_num * inode_size + block_sz - 1) / block_sz;
-    u32 inode_total_blocks = inode_bitmap_blocks + inode_area_blocks;
-    u32 data_total_blocks = device_block_num - 1 - inode_total_blocks;
-    u32 data_bitmap_blocks = (data_total_blocks + block_bits) / (block_bits + 1);
-    u32 data_area_blocks = data_total_blocks - data_bitmap_blocks;
-    shared_ptr<Bitmap> data_bitmap = shared_ptr<Bitmap>(new Bitmap(1 + inode_total_blocks, data_bitmap_blocks));
-    inode_bitmap.get()->clear(_block_device);
-    data_bitmap.get()->clear(_block_device);
-    assert(inode_bitmap.get()->alloc(_block_device) == 0);
-    shared_ptr<EasyFileSystem> efs = shared_ptr<EasyFileSystem>(new EasyFileSystem(_block_device, inode_bitmap, data_bitmap, 1 + inode_bitmap_blocks, 1 + inode_total_blocks + data_bitmap_blocks));
-    BLOCK_CACHE_MANAGER
-        .get_block_cache(0, _block_device, -1)
-        .get()
-        ->modify<SuperBlock, u32>(0, [inode_area_blocks, data_bitmap_blocks, data_area_blocks](SuperBlock &super_block) -> u32
-                                  {
-                                      super_block.initialize(device_block_num, inode_bitmap_blocks, inode_area_blocks, data_bitmap_blocks, data_area_blocks);
-                                      return 0;
-                                  });
-    u32 root_inode_block_id, root_inode_offset;
-    efs->get_disk_inode_pos(0, root_inode_block_id, root_inode_offset);
-    BLOCK_CACHE_MANAGER
-        .get_block_cache(root_inode_block_id, _block_device, -1)
-        .get()
-        ->modify<DiskInode, u32>(root_inode_offset, [](DiskInode &disk_inode) -> u32
-                                 {
-                                     disk_inode.initialize(DiskInodeType::Directory);
-                                     return 0;
-                                 });
-    BLOCK_CACHE_MANAGER.flush();
-    assert(efs->root.get()->is_dir());
-    return efs;
-}
-void EasyFileSystem::get_disk_inode_pos(u32 inode_id, u32 &block_id, u32 &block_offset)
-{
-    block_id = inode_area_start_block + inode_id / inodes_per_block;
-    block_offset = (inode_id % inodes_per_block) * inode_size;
-}
-u32 EasyFileSystem::get_inode_id(u32 block_id, u32 block_offset)
-{
-    return (block_id - inode_area_start_block) * inodes_per_block + block_offset / inode_size;
-}
-u32 EasyFileSystem::alloc_inode()
-{
-    return inode_bitmap.get()->alloc(block_device);
-}
-u32 EasyFileSystem::alloc_data()
-{
-    return data_bitmap.get()->alloc(block_device) + data_area_start_block;
-}
-void EasyFileSystem::dealloc_inode(u32 inode_id)
-{
-    inode_bitmap.get()->dealloc(block_device, inode_id);
-}
-void EasyFileSystem::dealloc_data(u32 block_id)
-{
-    data_bitmap.get()->dealloc(block_device, block_id - data_area_start_block);
-}
-
-shared_ptr<Inode> EasyFileSystem::find(string path, i32 &err)
-{
-    vector<string> paths = split_path(path);
-    if (paths.size() == 0)
-        return root;
-    shared_ptr<Inode> parent = root;
-    for (u32 i = 0; i < paths.size() - 1; i++)
-    {
-        if (!parent.get()->is_dir())
-        {
-            err = ENOTDIR;
-            return shared_ptr<Inode>(nullptr);
-        }
-        if (!(parent.get()->permit_r(uid, gid) && parent.get()->permit_x(uid, gid)))
-        {
-            err = EACCES;
-            return shared_ptr<Inode>(nullptr);
-        }
-        shared_ptr<Inode> child = parent.get()->find(paths[i]);
-        if (child == nullptr)
-        {
-            err = ENOENT;
-            return shared_ptr<Inode>(nullptr);
-        }
-        parent = child;
-    }
-    if (!parent.get()->is_dir())
-    {
-        err = ENOTDIR;
-        return shared_ptr<Inode>(nullptr);
-    }
-    string last = paths.back();
-    shared_ptr<Inode> child = parent.get()->find(last);
-    if (child == nullptr)
-        err = ENOENT;
-    return child;
-}
-shared_ptr<Inode> EasyFileSystem::create(string path, DiskInodeType type, i32 &err, u32 mode)
-{
-    vector<string> paths = split_path(path);
-    assert(paths.size() > 0);
-    shared_ptr<Inode> parent = root;
-    for (u32 i = 0; i < paths.size() - 1; i++)
-    {
-        if (!parent.get()->is_dir())
-        {
-            err = ENOTDIR;
-            return shared_ptr<Inode>(nullptr);
-        }
-        if (!(parent.get()->permit_r(uid, gid) && parent.get()->permit_x(uid, gid)))
-        {
-            err = EACCES;
-            return shared_ptr<Inode>(nullptr);
-        }
-        shared_ptr<Inode> child = parent.get()->find(paths[i]);
-        if (child == nullptr)
-        {
-            err = ENOENT;
-            return shared_ptr<Inode>(nullptr);
-        }
-        parent = child;
-    }
-    if (!parent.get()->is_dir())
-    {
-        err = ENOTDIR;
-        return shared_ptr<Inode>(nullptr);
-    }
-    if (!parent.get()->permit_w(uid, gid))
-    {
-        err = EACCES;
-        return shared_ptr<Inode>(nullptr);
-    }
-    string last = paths.back();
-    if (last.size() > name_length_limit)
-    {
-        err = ENAMETOOLONG;
-        return shared_ptr<Inode>(nullptr);
-    }
-    if (parent.get()->find(last) != nullptr)
-    {
-        err = EEXIST;
-        return shared_ptr<Inode>(nullptr);
-    }
-    shared_ptr<Inode> child = parent.get()->create(last, type, uid, gid, mode);
-    return child;
-}
-i64 EasyFileSystem::unlink(string path)
-{
-    vector<string> paths = split_path(path);
-    assert(paths.size() > 0);
-    shared_ptr<Inode> parent = root;
-    for (u32 i = 0; i < paths.size() - 1; i++)
-    {
-        if (!parent.get()->is_dir())
-            return -ENOTDIR;
-        if (!(parent.get()->permit_r(uid, gid) && parent.get()->permit_x(uid, gid)))
-            return -EACCES;
-        shared_ptr<Inode> child = parent.get()->find(paths[i]);
-        if (child == nullptr)
-            return -ENOENT;
-        parent = child;
-    }
-    if (!parent.get()->is_dir())
-        return -ENOTDIR;
-    if (!parent.get()->permit_w(uid, gid))
-        return -EACCES;
-    string last = paths.back();
-    shared_ptr<Inode> child = parent.get()->find(last);
-    if (child == nullptr)
-        return -ENOENT;
-    if (child.get()->is_dir() && child.get()->get_dirent_num() > 0)
-    {
-        return -ENOTEMPTY;
-    }
-    parent.get()->remove(last);
-    if (child.get()->sub_nlink())
-    {
-        child.get()->clear();
-        dealloc_inode(child.get()->get_id());
-    }
-    return 0;
-}
-i64 EasyFileSystem::rename(string from, string to)
-{
-    vector<string> paths_from = split_path(from);
-    vector<string> paths_to = split_path(to);
-    assert(paths_from.size() > 0 && paths_to.size() > 0);
-    shared_ptr<Inode> parent_from = root;
-    for (u32 i = 0; i < paths_from.size() - 1; i++)
-    {
-        if (!parent_from.get()->is_dir())
-            return -ENOTDIR;
-        if (!(parent_from.get()->permit_r(uid, gid) && parent_from.get()->permit_x(uid, gid)))
-            return -EACCES;
-        shared_ptr<Inode> child_from = parent_from.get()->find(paths_from[i]);
-        if (child_from == nullptr)
-            return -ENOENT;
-        parent_from = child_from;
-    }
-    if (!parent_from.get()->is_dir())
-        return -ENOTDIR;
-    string last_from = paths_from.back();
-    shared_ptr<Inode> child_from = parent_from.get()->find(last_from);
-    if (child_from == nullptr)
-        return -ENOENT;
-    if (child_from.get()->is_dir())
-        return -EPERM;
-    shared_ptr<Inode> parent_to = root;
-    for (u32 i = 0; i < paths_to.size() - 1; i++)
-    {
-        if (!parent_to.get()->is_dir())
-            return -ENOTDIR;
-        if (!(parent_to.get()->permit_r(uid, gid) && parent_to.get()->permit_x(uid, gid)))
-            return -EACCES;
-        shared_ptr<Inode> child_to = parent_to.get()->find(paths_to[i]);
-        if (child_to == nullptr)
-            return -ENOENT;
-        parent_to = child_to;
-    }
-    if (!parent_to.get()->is_dir())
-        return -ENOTDIR;
-    if (!parent_to.get()->permit_w(uid, gid))
-        return -EACCES;
-    string last_to = paths_to.back();
-    if (last_to.size() > name_length_limit)
-    {
-        return -ENAMETOOLONG;
-    }
-    shared_ptr<Inode> child_to = parent_to.get()->find(last_to);
-    if (child_to != nullptr)
-        return -EEXIST;
-    parent_to.get()->link(last_to, child_from.get()->get_id());
-    parent_from.get()->remove(last_from);
-    return 0;
-}
-i64 EasyFileSystem::link(string from, string to)
-{
-    vector<string> paths_from = split_path(from);
-    vector<string> paths_to = split_path(to);
-    assert(paths_from.size() > 0 && paths_to.size() > 0);
-    shared_ptr<Inode> parent_from = root;
-    for (u32 i = 0; i < paths_from.size() - 1; i++)
-    {
-        if (!parent_from.get()->is_dir())
-            return -ENOTDIR;
-        if (!(parent_from.get()->permit_r(uid, gid) && parent_from.get()->permit_x(uid, gid)))
-            return -EACCES;
-        shared_ptr<Inode> child_from = parent_from.get()->find(paths_from[i]);
-        if (child_from == nullptr)
-            return -ENOENT;
-        parent_from = child_from;
-    }
-    if (!parent_from.get()->is_dir())
-        return -ENOTDIR;
-    string last_from = paths_from.back();
-    shared_ptr<Inode> child_from = parent_from.get()->find(last_from);
-    if (child_from == nullptr)
-        return -ENOENT;
-    if (child_from.get()->is_dir())
-        return -EPERM;
-    shared_ptr<Inode> parent_to = root;
-    for (u32 i = 0; i < paths_to.size() - 1; i++)
-    {
-        if (!parent_to.get()->is_dir())
-            return -ENOTDIR;
-        if (!(parent_to.get()->permit_r(uid, gid) && parent_to.get()->permit_x(uid, gid)))
-            return -EACCES;
-        shared_ptr<Inode> child_to = parent_to.get()->find(paths_to[i]);
-        if (child_to == nullptr)
-            return -ENOENT;
-        parent_to = child_to;
-    }
-    if (!parent_to.get()->is_dir())
-        return -ENOTDIR;
-    if (!parent_to.get()->permit_w(uid, gid))
-        return -EACCES;
-    string last_to = paths_to.back();
-    if (last_to.size() > name_length_limit)
-    {
-        return -ENAMETOOLONG;
-    }
-    shared_ptr<Inode> child_to = parent_to.get()->find(last_to);
-    if (child_to != nullptr)
-        return -EEXIST;
-    child_from.get()->add_nlink();
-    parent_to.get()->link(last_to, child_from.get()->get_id());
-    return 0;
-}
-
-shared_ptr<Inode> EasyFileSystem::get_inode(u32 inode_id)
-{
-    u32 inode_block_id, inode_offset;
-    get_disk_inode_pos(inode_id, inode_block_id, inode_offset);
-    return shared_ptr<Inode>(new Inode(inode_id, inode_block_id, inode_offset, this, block_device));
-}
-
-void EasyFileSystem::set_user(u32 _uid, u32 _gid)
-{
-    uid = _uid;
-    gid = _gid;
-}
-
-void EasyFileSystem::get_user(u32 &_uid, u32 &_gid)
-{
-    _uid = uid;
-    _gid = gid;
+#include "efs.h"
+
+EasyFileSystem::EasyFileSystem(shared_ptr<BlockDevice> _block_device, shared_ptr<Bitmap> _inode_bitmap, shared_ptr<Bitmap> _data_bitmap, u32 _inode_area_start_block, u32 _data_area_start_block)
+{
+    block_device = _block_device;
+    inode_bitmap = _inode_bitmap;
+    inode_area_start_block = _inode_area_start_block;
+    segments[0].bitmap = _data_bitmap;
+    segments[0].data_start = _data_area_start_block;
+    segments[0].data_blocks = 0;
+    segments[0].refcount_start = 0;
+    segments[0].refcount_blocks = 0;
+    segment_count = 1;
+    pthread_mutex_init(&grow_lock, nullptr);
+    pthread_mutex_init(&snapshot_lock, nullptr);
+    u32 root_inode_block_id, root_inode_offset;
+    get_disk_inode_pos(0, root_inode_block_id, root_inode_offset);
+    root = shared_ptr<Inode>(new Inode(0, root_inode_block_id, root_inode_offset, this, _block_device));
+    for (u32 i = 0; i < inode_lock_group; i++)
+    {
+        pthread_rwlock_init(&inode_locks[i], nullptr);
+        permission_generation[i] = 0;
+    }
+    for (u32 i = 0; i < permission_cache_size; i++)
+    {
+        permission_cache[i].valid = false;
+        pthread_mutex_init(&permission_locks[i], nullptr);
+    }
+    pthread_mutex_init(&lookup_lock, nullptr);
+    delayed_total = 0;
+    pthread_mutex_init(&delayed_lock, nullptr);
+    BLOCK_CACHE_MANAGER.pin(0, _block_device);
+    inode_bitmap.get()->pin(_block_device);
+    _data_bitmap.get()->pin(_block_device);
+}
+EasyFileSystem::~EasyFileSystem()
+{
+    pthread_mutex_destroy(&delayed_lock);
+    pthread_mutex_destroy(&grow_lock);
+    pthread_mutex_destroy(&snapshot_lock);
+    for (u32 i = 0; i < inode_lock_group; i++)
+        pthread_rwlock_destroy(&inode_locks[i]);
+    for (u32 i = 0; i < permission_cache_size; i++)
+        pthread_mutex_destroy(&permission_locks[i]);
+    pthread_mutex_destroy(&lookup_lock);
+}
+shared_ptr<EasyFileSystem> EasyFileSystem::open(shared_ptr<BlockDevice> _block_device)
+{
+    u32 inode_bitmap_blocks, inode_area_blocks, data_bitmap_blocks, data_area_blocks;
+    bool current = true;
+    bool valid = BLOCK_CACHE_MANAGER
+                     .get_block_cache(0, _block_device, -1)
+                     .get()
+                     ->read<SuperBlock, bool>(0, [&inode_bitmap_blocks, &inode_area_blocks, &data_bitmap_blocks, &data_area_blocks, &current, &_block_device](const SuperBlock &super_block) -> u32
+                                              {
+                                                  if (!super_block.is_valid())
+                                                      return false;
+                                                  if (super_block.get_stripe_count() != _block_device.get()->get_stripe_count() ||
+                                                      super_block.get_stripe_unit() != _block_device.get()->get_stripe_unit() ||
+                                                      super_block.get_cipher() != _block_device.get()->get_cipher() ||
+                                                      super_block.total_blocks != _block_device.get()->get_total_blocks() ||
+                                                      super_block.get_segment_count() > max_grow_segments)
+                                                      return false;
+                                                  inode_bitmap_blocks = super_block.inode_bitmap_blocks;
+                                                  inode_area_blocks = super_block.inode_area_blocks;
+                                                  data_bitmap_blocks = super_block.data_bitmap_blocks;
+                                                  data_area_blocks = super_block.data_area_blocks;
+                                                  current = super_block.is_current();
+                                                  return true;
+                                              });
+    if (!valid)
+        return shared_ptr<EasyFileSystem>(nullptr);
+    if (!current)
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(0, _block_device, -1)
+            .get()
+            ->modify_and_sync<SuperBlock, u32>(0, [](SuperBlock &super_block) -> u32
+                                               {
+                                                   super_block.upgrade();
+                                                   return 0;
+                                               });
+    u32 inode_total_blocks = inode_bitmap_blocks + inode_area_blocks;
+    shared_ptr<Bitmap> inode_bitmap = shared_ptr<Bitmap>(new Bitmap(1, inode_bitmap_blocks));
+    shared_ptr<Bitmap> data_bitmap = shared_ptr<Bitmap>(new Bitmap(1 + inode_total_blocks, data_bitmap_blocks));
+    shared_ptr<EasyFileSystem> efs = shared_ptr<EasyFileSystem>(new EasyFileSystem(_block_device, inode_bitmap, data_bitmap, 1 + inode_bitmap_blocks, 1 + inode_total_blocks + data_bitmap_blocks));
+    assert(efs.get()->root->is_dir());
+    efs.get()->load_segments();
+    efs.get()->load_refcounts();
+    efs.get()->load_block_counts();
+    efs.get()->make_snapshot_dir();
+    return efs;
+}
+// block 0 is at the start of the first device file whatever the geometry,
+// so the super block can be read before the other files are opened;
+// a plaintext volume shows its magic as is, an encrypted one only after decryption
+bool EasyFileSystem::probe(string password, u32 &stripe_count, u32 &stripe_unit, CipherType &cipher, u32 &total_blocks)
+{
+    Block block;
+    const SuperBlock &super_block = *(const SuperBlock *)block.data;
+    BlockDevice("", 1, 1, Plain).read_block(0, block);
+    if (!super_block.is_valid() || super_block.get_cipher() != Plain)
+    {
+        BlockDevice(password, 1, 1, Aes128).read_block(0, block);
+        if (!super_block.is_valid() || super_block.get_cipher() != Aes128)
+            return false;
+    }
+    stripe_count = super_block.get_stripe_count();
+    stripe_unit = super_block.get_stripe_unit();
+    cipher = super_block.get_cipher();
+    total_blocks = super_block.total_blocks;
+    return stripe_count > 0 && stripe_count <= max_stripe_count && stripe_unit > 0 &&
+           super_block.get_block_size() == block_sz && total_blocks % (stripe_count * stripe_unit) == 0;
+}
+shared_ptr<EasyFileSystem> EasyFileSystem::create(shared_ptr<BlockDevice> _block_device, u32 inode_count)
+{
+    u32 total_blocks = _block_device.get()->get_total_blocks();
+    u32 inode_bitmap_blocks = max(1u, (inode_count + block_bits - 1) / block_bits);
+    // the inode table and the first data bitmap and data blocks have to fit
+    if ((u64)inode_bitmap_blocks * (1 + block_bits / inodes_per_block) + 3 > total_blocks)
+        return shared_ptr<EasyFileSystem>(nullptr);
+    shared_ptr<Bitmap> inode_bitmap = shared_ptr<Bitmap>(new Bitmap(1, inode_bitmap_blocks));
+    u32 inode_num = inode_bitmap.get()->maximum();
+    u32 inode_area_blocks = inode_num / inodes_per_block;
+    u32 inode_total_blocks = inode_bitmap_blocks + inode_area_blocks;
+    u32 data_total_blocks = total_blocks - 1 - inode_total_blocks;
+    u32 data_bitmap_blocks = (data_total_blocks + block_bits) / (block_bits + 1);
+    u32 data_area_blocks = data_total_blocks - data_bitmap_blocks;
+    shared_ptr<Bitmap> data_bitmap = shared_ptr<Bitmap>(new Bitmap(1 + inode_total_blocks, data_bitmap_blocks));
+    inode_bitmap.get()->clear(_block_device);
+    data_bitmap.get()->clear(_block_device);
+    assert(inode_bitmap.get()->alloc(_block_device) == 0);
+    shared_ptr<EasyFileSystem> efs = shared_ptr<EasyFileSystem>(new EasyFileSystem(_block_device, inode_bitmap, data_bitmap, 1 + inode_bitmap_blocks, 1 + inode_total_blocks + data_bitmap_blocks));
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(0, _block_device, -1)
+        .get()
+        ->modify<SuperBlock, u32>(0, [total_blocks, inode_bitmap_blocks, inode_area_blocks, data_bitmap_blocks, data_area_blocks, &_block_device](SuperBlock &super_block) -> u32
+                                  {
+                                      super_block.initialize(total_blocks, inode_bitmap_blocks, inode_area_blocks, data_bitmap_blocks, data_area_blocks,
+                                                             _block_device.get()->get_stripe_count(), _block_device.get()->get_stripe_unit(),
+                                                             _block_device.get()->get_cipher());
+                                      return 0;
+                                  });
+    u32 root_inode_block_id, root_inode_offset;
+    efs->get_disk_inode_pos(0, root_inode_block_id, root_inode_offset);
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(root_inode_block_id, _block_device, -1)
+        .get()
+        ->modify<DiskInode, u32>(root_inode_offset, [](DiskInode &disk_inode) -> u32
+                                 {
+                                     disk_inode.initialize(DiskInodeType::Directory);
+                                     return 0;
+                                 });
+    efs.get()->load_segments();
+    efs.get()->load_refcounts();
+    efs.get()->make_snapshot_dir();
+    BLOCK_CACHE_MANAGER.flush();
+    assert(efs->root.get()->is_dir());
+    return efs;
+}
+// the first data area comes from the geometry, the grown ones are listed in the super block
+void EasyFileSystem::load_segments()
+{
+    vector<GrownSegment> grown;
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(0, block_device, -1)
+        .get()
+        ->read<SuperBlock, u32>(0, [this, &grown](const SuperBlock &super_block) -> u32
+                                {
+                                    this->segments[0].data_blocks = super_block.data_area_blocks;
+                                    for (u32 i = 0; i < super_block.get_segment_count(); i++)
+                                        grown.push_back(super_block.get_segment(i));
+                                    return 0;
+                                });
+    for (u32 i = 0; i < grown.size(); i++)
+    {
+        DataSegment &segment = segments[i + 1];
+        segment.bitmap = shared_ptr<Bitmap>(new Bitmap(grown[i].start, grown[i].bitmap_blocks));
+        segment.data_start = grown[i].start + grown[i].bitmap_blocks;
+        segment.data_blocks = grown[i].data_blocks;
+        segment.refcount_start = segment.data_start;
+        segment.refcount_blocks = (segment.data_blocks + block_sz - 1) / block_sz;
+        segment.bitmap.get()->pin(block_device);
+    }
+    segment_count = grown.size() + 1;
+}
+// the reference count table of the first data area sits in one run taken from the data bitmaps;
+// a volume without room for it works as before, only copy_file_range copies instead of sharing
+void EasyFileSystem::load_refcounts()
+{
+    DataSegment &segment = segments[0];
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(0, block_device, -1)
+        .get()
+        ->read<SuperBlock, u32>(0, [&segment](const SuperBlock &super_block) -> u32
+                                {
+                                    segment.refcount_start = super_block.get_refcount_start();
+                                    segment.refcount_blocks = super_block.get_refcount_blocks();
+                                    return 0;
+                                });
+    if (segment.refcount_blocks > 0)
+        return;
+    u32 need = (segment.data_blocks + block_sz - 1) / block_sz;
+    vector<u32> run = alloc_data_run(need);
+    if (run.size() < need || run.back() - run.front() != need - 1)
+    {
+        dealloc_data(run);
+        return;
+    }
+    for (u32 block_id : run)
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(block_id, block_device, -1, false)
+            .get()
+            ->modify_and_sync<Block, u32>(0, [](Block &block) -> u32
+                                          {
+                                              memset(block.data, 0, block_sz);
+                                              return 0;
+                                          });
+    segment.refcount_start = run.front();
+    segment.refcount_blocks = need;
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(0, block_device, -1)
+        .get()
+        ->modify_and_sync<SuperBlock, u32>(0, [&segment](SuperBlock &super_block) -> u32
+                                           {
+                                               super_block.set_refcount(segment.refcount_start, segment.refcount_blocks);
+                                               return 0;
+                                           });
+}
+// a volume from before files kept their block count has every file counted once
+void EasyFileSystem::load_block_counts()
+{
+    bool counted = BLOCK_CACHE_MANAGER
+                       .get_block_cache(0, block_device, -1)
+                       .get()
+                       ->read<SuperBlock, bool>(0, [](const SuperBlock &super_block) -> bool
+                                                { return super_block.has_block_counts(); });
+    if (counted)
+        return;
+    for (u32 bitmap_block = 1; bitmap_block < inode_area_start_block; bitmap_block++)
+    {
+        BitmapBlock bits = BLOCK_CACHE_MANAGER
+                               .get_block_cache(bitmap_block, block_device, -1)
+                               .get()
+                               ->peek<BitmapBlock>(0);
+        for (u32 i = 0; i < block_bits; i++)
+        {
+            if (!(bits.data[i / 64] & (1ull << (i % 64))))
+                continue;
+            u32 block_id, block_offset;
+            get_disk_inode_pos((bitmap_block - 1) * block_bits + i, block_id, block_offset);
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(block_id, block_device, -1)
+                .get()
+                ->modify_and_sync<DiskInode, u32>(block_offset, [this](DiskInode &disk_inode) -> u32
+                                                  {
+                                                      if (disk_inode.is_file())
+                                                          disk_inode.recount_blocks(this->block_device);
+                                                      return 0;
+                                                  });
+        }
+    }
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(0, block_device, -1)
+        .get()
+        ->modify_and_sync<SuperBlock, u32>(0, [](SuperBlock &super_block) -> u32
+                                           {
+                                               super_block.set_block_counts();
+                                               return 0;
+                                           });
+}
+void EasyFileSystem::get_disk_inode_pos(u32 inode_id, u32 &block_id, u32 &block_offset)
+{
+    block_id = inode_area_start_block + inode_id / inodes_per_block;
+    block_offset = (inode_id % inodes_per_block) * inode_size;
+}
+u32 EasyFileSystem::get_inode_id(u32 block_id, u32 block_offset)
+{
+    return (block_id - inode_area_start_block) * inodes_per_block + block_offset / inode_size;
+}
+u32 EasyFileSystem::alloc_inode()
+{
+    return inode_bitmap.get()->alloc(block_device);
+}
+// the segments are tried in order, so the first data area fills before the grown ones
+u32 EasyFileSystem::alloc_data()
+{
+    u32 count = segment_count.load(memory_order_acquire);
+    for (u32 i = 0; i + 1 < count; i++)
+    {
+        i64 bit = segments[i].bitmap.get()->alloc(block_device);
+        if (bit >= 0)
+            return bit + segments[i].data_start;
+    }
+    return segments[count - 1].bitmap.get()->alloc(block_device) + segments[count - 1].data_start;
+}
+// a run never spans two segments; callers take single blocks for what is missing
+vector<u32> EasyFileSystem::alloc_data_run(u32 count)
+{
+    u32 n = segment_count.load(memory_order_acquire);
+    for (u32 i = 0; i < n; i++)
+    {
+        vector<u32> block_ids = segments[i].bitmap.get()->alloc_run(block_device, count);
+        if (block_ids.empty())
+            continue;
+        for (u32 &block_id : block_ids)
+            block_id += segments[i].data_start;
+        return block_ids;
+    }
+    return vector<u32>();
+}
+void EasyFileSystem::dealloc_inode(u32 inode_id)
+{
+    inode_bitmap.get()->dealloc(block_device, inode_id);
+}
+// the segments lie in ascending order, so a block belongs to the last one starting at or before it
+const DataSegment &EasyFileSystem::segment_of(u32 block_id)
+{
+    u32 i = segment_count.load(memory_order_acquire) - 1;
+    while (i > 0 && block_id < segments[i].data_start)
+        i--;
+    return segments[i];
+}
+// a block other files still share only loses a reference
+void EasyFileSystem::dealloc_data(u32 block_id)
+{
+    if (!unshare_data(block_id))
+    {
+        const DataSegment &segment = segment_of(block_id);
+        segment.bitmap.get()->dealloc(block_device, block_id - segment.data_start);
+    }
+}
+void EasyFileSystem::dealloc_data(const vector<u32> &block_ids)
+{
+    vector<u32> bits[max_grow_segments + 1];
+    for (u32 block_id : block_ids)
+    {
+        if (!unshare_data(block_id))
+        {
+            const DataSegment &segment = segment_of(block_id);
+            bits[&segment - segments].push_back(block_id - segment.data_start);
+        }
+    }
+    for (u32 i = 0; i < segment_count.load(memory_order_acquire); i++)
+    {
+        if (!bits[i].empty())
+            segments[i].bitmap.get()->dealloc(block_device, bits[i]);
+    }
+}
+// true if the block was shared, and drop one reference; an unshared block cannot gain
+// one meanwhile, since only its owner can hand it out, so a plain read settles that case
+bool EasyFileSystem::unshare_data(u32 block_id)
+{
+    if (!is_shared(block_id))
+        return false;
+    const DataSegment &segment = segment_of(block_id);
+    u32 pos = block_id - segment.data_start;
+    return BLOCK_CACHE_MANAGER
+        .get_block_cache(segment.refcount_start + pos / block_sz, block_device, -1)
+        .get()
+        ->modify_and_sync<Block, bool>(0, [pos](Block &block) -> bool
+                                       {
+                                           if (block.data[pos % block_sz] == 0)
+                                               return false;
+                                           block.data[pos % block_sz]--;
+                                           return true;
+                                       });
+}
+bool EasyFileSystem::is_shared(u32 block_id)
+{
+    const DataSegment &segment = segment_of(block_id);
+    if (segment.refcount_blocks == 0)
+        return false;
+    u32 pos = block_id - segment.data_start;
+    return BLOCK_CACHE_MANAGER
+               .get_block_cache(segment.refcount_start + pos / block_sz, block_device, -1)
+               .get()
+               ->peek<u8>(pos % block_sz) != 0;
+}
+// add a reference to each block, grouped by table block; false where the count is full,
+// the table is missing or the block is a hole
+vector<bool> EasyFileSystem::share_data(const vector<u32> &block_ids)
+{
+    vector<bool> shared(block_ids.size(), false);
+    // the table block and the byte in it counting each block
+    vector<u32> order, table_blocks(block_ids.size()), slots(block_ids.size());
+    for (u32 i = 0; i < block_ids.size(); i++)
+    {
+        if (block_ids[i] == 0)
+            continue;
+        const DataSegment &segment = segment_of(block_ids[i]);
+        if (segment.refcount_blocks == 0)
+            continue;
+        u32 pos = block_ids[i] - segment.data_start;
+        table_blocks[i] = segment.refcount_start + pos / block_sz;
+        slots[i] = pos % block_sz;
+        order.push_back(i);
+    }
+    sort(order.begin(), order.end(), [&block_ids](u32 a, u32 b)
+         { return block_ids[a] < block_ids[b]; });
+    u32 i = 0;
+    while (i < order.size())
+    {
+        u32 table_block = table_blocks[order[i]];
+        u32 j = i;
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(table_block, block_device, -1)
+            .get()
+            ->modify_and_sync<Block, u32>(0, [&table_blocks, &slots, &order, &shared, &j, table_block](Block &block) -> u32
+                                          {
+                                              while (j < order.size() && table_blocks[order[j]] == table_block)
+                                              {
+                                                  u8 &count = block.data[slots[order[j]]];
+                                                  if (count < refcount_max)
+                                                  {
+                                                      count++;
+                                                      shared[order[j]] = true;
+                                                  }
+                                                  j++;
+                                              }
+                                              return 0;
+                                          });
+        i = j;
+    }
+    return shared;
+}
+
+// the new blocks are laid out as a bitmap, a reference count table and data, and written
+// before the super block lists them; only then are they published to alloc_data, so a
+// crash part way leaves the volume at its old size
+i32 EasyFileSystem::grow(u64 total_blocks)
+{
+    u32 stripe_blocks = block_device.get()->get_stripe_count() * block_device.get()->get_stripe_unit();
+    if (total_blocks >= block_unwritten_flag)
+        return -EFBIG;
+    u32 new_total = total_blocks / stripe_blocks * stripe_blocks;
+    pthread_mutex_lock(&grow_lock);
+    u32 old_total = block_device.get()->get_total_blocks();
+    u32 count = segment_count;
+    u32 added = new_total > old_total ? new_total - old_total : 0;
+    u32 bitmap_blocks = (added + block_bits) / (block_bits + 1);
+    u32 data_blocks = added - bitmap_blocks;
+    u32 refcount_blocks = (data_blocks + block_sz - 1) / block_sz;
+    i32 err = 0;
+    if (data_blocks <= refcount_blocks)
+        err = -EINVAL;
+    else if (count > max_grow_segments)
+        err = -ENOSPC;
+    else if (!block_device.get()->grow(new_total))
+        err = -EIO;
+    if (err != 0)
+    {
+        pthread_mutex_unlock(&grow_lock);
+        return err;
+    }
+    Block empty;
+    memset(empty.data, 0, sizeof(empty));
+    vector<BlockRequest> requests;
+    for (u32 i = old_total; i < old_total + bitmap_blocks + refcount_blocks; i++)
+    {
+        requests.push_back(BlockRequest{i, &empty});
+        if (requests.size() == io_max_blocks || i + 1 == old_total + bitmap_blocks + refcount_blocks)
+        {
+            block_device.get()->write_blocks(requests);
+            requests.clear();
+        }
+    }
+    DataSegment &segment = segments[count];
+    segment.bitmap = shared_ptr<Bitmap>(new Bitmap(old_total, bitmap_blocks));
+    segment.data_start = old_total + bitmap_blocks;
+    segment.data_blocks = data_blocks;
+    segment.refcount_start = segment.data_start;
+    segment.refcount_blocks = refcount_blocks;
+    // the bits past the end of a data area would hand out blocks of the next segment
+    DataSegment &last = segments[count - 1];
+    last.bitmap.get()->mark(block_device, last.data_blocks, last.bitmap.get()->maximum());
+    segment.bitmap.get()->mark(block_device, 0, refcount_blocks);
+    segment.bitmap.get()->mark(block_device, data_blocks, segment.bitmap.get()->maximum());
+    segment.bitmap.get()->pin(block_device);
+    GrownSegment grown = {old_total, bitmap_blocks, data_blocks};
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(0, block_device, -1)
+        .get()
+        ->modify_and_sync<SuperBlock, u32>(0, [grown, new_total](SuperBlock &super_block) -> u32
+                                           {
+                                               super_block.add_segment(grown, new_total);
+                                               return 0;
+                                           });
+    segment_count.store(count + 1, memory_order_release);
+    pthread_mutex_unlock(&grow_lock);
+    return 0;
+}
+
+shared_ptr<Inode> EasyFileSystem::find_parent(const vector<string> &paths, i32 &err)
+{
+    shared_ptr<Inode> parent = root;
+    for (u32 i = 0; i < paths.size() - 1; i++)
+    {
+        parent = lookup(parent.get()->get_id(), paths[i], 0, 0, err);
+        if (parent == nullptr)
+            return parent;
+    }
+    if (!parent.get()->is_dir())
+    {
+        err = ENOTDIR;
+        return shared_ptr<Inode>(nullptr);
+    }
+    return parent;
+}
+shared_ptr<Inode> EasyFileSystem::find(string path, i32 &err)
+{
+    vector<string> paths = split_path(path);
+    if (paths.size() == 0)
+        return root;
+    shared_ptr<Inode> parent = find_parent(paths, err);
+    if (parent == nullptr)
+        return parent;
+    return lookup(parent.get()->get_id(), paths.back(), 0, 0, err);
+}
+shared_ptr<Inode> EasyFileSystem::create(string path, DiskInodeType type, i32 &err, u32 mode)
+{
+    vector<string> paths = split_path(path);
+    assert(paths.size() > 0);
+    shared_ptr<Inode> parent = find_parent(paths, err);
+    if (parent == nullptr)
+        return parent;
+    return create(parent.get()->get_id(), paths.back(), type, 0, 0, err, mode);
+}
+i64 EasyFileSystem::unlink(string path)
+{
+    vector<string> paths = split_path(path);
+    assert(paths.size() > 0);
+    i32 err;
+    shared_ptr<Inode> parent = find_parent(paths, err);
+    if (parent == nullptr)
+        return -err;
+    return unlink(parent.get()->get_id(), paths.back(), 0, 0);
+}
+i64 EasyFileSystem::rename(string from, string to)
+{
+    vector<string> paths_from = split_path(from);
+    vector<string> paths_to = split_path(to);
+    assert(paths_from.size() > 0 && paths_to.size() > 0);
+    i32 err;
+    shared_ptr<Inode> parent_from = find_parent(paths_from, err);
+    if (parent_from == nullptr)
+        return -err;
+    shared_ptr<Inode> parent_to = find_parent(paths_to, err);
+    if (parent_to == nullptr)
+        return -err;
+    return rename(parent_from.get()->get_id(), paths_from.back(), parent_to.get()->get_id(), paths_to.back(), 0, 0);
+}
+i64 EasyFileSystem::link(string from, string to)
+{
+    vector<string> paths_to = split_path(to);
+    assert(paths_to.size() > 0);
+    i32 err;
+    shared_ptr<Inode> child_from = find(from, err);
+    if (child_from == nullptr)
+        return -err;
+    shared_ptr<Inode> parent_to = find_parent(paths_to, err);
+    if (parent_to == nullptr)
+        return -err;
+    return link(child_from.get()->get_id(), parent_to.get()->get_id(), paths_to.back(), 0, 0);
+}
+
+shared_ptr<Inode> EasyFileSystem::lookup(u32 parent_id, string name, u32 uid, u32 gid, i32 &err, bool remember)
+{
+    shared_ptr<Inode> parent = get_inode(parent_id);
+    if (!parent.get()->is_dir())
+    {
+        err = ENOTDIR;
+        return shared_ptr<Inode>(nullptr);
+    }
+    if (!permit(parent, uid, gid, R_OK | X_OK))
+    {
+        err = EACCES;
+        return shared_ptr<Inode>(nullptr);
+    }
+    rdlock_inode(parent_id);
+    shared_ptr<Inode> child = parent.get()->find(name);
+    if (child == nullptr)
+        err = ENOENT;
+    else if (remember)
+        add_lookup(child.get()->get_id(), 1);
+    unlock_inode(parent_id);
+    return child;
+}
+shared_ptr<Inode> EasyFileSystem::create(u32 parent_id, string name, DiskInodeType type, u32 uid, u32 gid, i32 &err, u32 mode, bool remember)
+{
+    if (name.size() > name_length_limit)
+    {
+        err = ENAMETOOLONG;
+        return shared_ptr<Inode>(nullptr);
+    }
+    shared_ptr<Inode> parent = get_inode(parent_id);
+    shared_ptr<Inode> child(nullptr);
+    wrlock_inode(parent_id);
+    // the parent may have been removed while the caller was looking it up
+    if (!parent.get()->is_dir())
+        err = ENOTDIR;
+    else if (parent.get()->get_nlink() == 0)
+        err = ENOENT;
+    else if (parent.get()->is_readonly())
+        err = EROFS;
+    else if (!permit(parent, uid, gid, W_OK))
+        err = EACCES;
+    else if (parent.get()->find(name) != nullptr)
+        err = EEXIST;
+    else
+    {
+        child = parent.get()->create(name, type, uid, gid, mode);
+        if (remember)
+            add_lookup(child.get()->get_id(), 1);
+    }
+    unlock_inode(parent_id);
+    return child;
+}
+i64 EasyFileSystem::unlink(u32 parent_id, string name, u32 uid, u32 gid)
+{
+    shared_ptr<Inode> parent = get_inode(parent_id);
+    if (!parent.get()->is_dir())
+        return -ENOTDIR;
+    while (1)
+    {
+        rdlock_inode(parent_id);
+        shared_ptr<Inode> child = parent.get()->find(name);
+        unlock_inode(parent_id);
+        if (child == nullptr)
+            return -ENOENT;
+        vector<u32> locked = {parent_id, child.get()->get_id()};
+        wrlock_inodes(locked);
+        // retry if the entry changed between the lookup and taking the locks
+        shared_ptr<Inode> current = parent.get()->find(name);
+        if (current == nullptr || current.get()->get_id() != child.get()->get_id())
+        {
+            unlock_inodes(locked);
+            continue;
+        }
+        i64 re = 0;
+        if (parent.get()->get_nlink() == 0)
+            re = -ENOENT;
+        else if (parent.get()->is_readonly())
+            re = -EROFS;
+        else if (!permit(parent, uid, gid, W_OK))
+            re = -EACCES;
+        else if (child.get()->is_dir() && child.get()->get_dirent_num() > 0)
+            re = -ENOTEMPTY;
+        else
+        {
+            parent.get()->remove(name);
+            if (child.get()->sub_nlink() && !defer_release(child.get()->get_id()))
+                release(child);
+        }
+        unlock_inodes(locked);
+        return re;
+    }
+}
+i64 EasyFileSystem::rename(u32 parent_from_id, string name_from, u32 parent_to_id, string name_to, u32 uid, u32 gid)
+{
+    if (name_to.size() > name_length_limit)
+    {
+        return -ENAMETOOLONG;
+    }
+    shared_ptr<Inode> parent_from = get_inode(parent_from_id);
+    shared_ptr<Inode> parent_to = get_inode(parent_to_id);
+    if (!parent_from.get()->is_dir() || !parent_to.get()->is_dir())
+        return -ENOTDIR;
+    while (1)
+    {
+        rdlock_inode(parent_from_id);
+        shared_ptr<Inode> child_from = parent_from.get()->find(name_from);
+        unlock_inode(parent_from_id);
+        if (child_from == nullptr)
+            return -ENOENT;
+        vector<u32> locked = {parent_from_id, parent_to_id, child_from.get()->get_id()};
+        wrlock_inodes(locked);
+        shared_ptr<Inode> current = parent_from.get()->find(name_from);
+        if (current == nullptr || current.get()->get_id() != child_from.get()->get_id())
+        {
+            unlock_inodes(locked);
+            continue;
+        }
+        i64 re = 0;
+        if (parent_from.get()->get_nlink() == 0 || parent_to.get()->get_nlink() == 0)
+            re = -ENOENT;
+        else if (child_from.get()->is_dir())
+            re = -EPERM;
+        // an entry never leaves a snapshot, nor does a snapshot file move
+        else if (parent_from.get()->is_readonly() || parent_to.get()->is_readonly() || child_from.get()->is_readonly())
+            re = -EROFS;
+        else if (!permit(parent_from, uid, gid, W_OK) || !permit(parent_to, uid, gid, W_OK))
+            re = -EACCES;
+        else if (parent_to.get()->find(name_to) != nullptr)
+            re = -EEXIST;
+        else
+        {
+            parent_to.get()->link(name_to, child_from.get()->get_id());
+            parent_from.get()->remove(name_from);
+        }
+        unlock_inodes(locked);
+        return re;
+    }
+}
+i64 EasyFileSystem::link(u32 inode_id, u32 parent_to_id, string name_to, u32 uid, u32 gid)
+{
+    if (name_to.size() > name_length_limit)
+    {
+        return -ENAMETOOLONG;
+    }
+    shared_ptr<Inode> child_from = get_inode(inode_id);
+    shared_ptr<Inode> parent_to = get_inode(parent_to_id);
+    if (!parent_to.get()->is_dir())
+        return -ENOTDIR;
+    vector<u32> locked = {parent_to_id, inode_id};
+    wrlock_inodes(locked);
+    i64 re = 0;
+    if (parent_to.get()->get_nlink() == 0 || child_from.get()->get_nlink() == 0)
+        re = -ENOENT;
+    else if (child_from.get()->is_dir())
+        re = -EPERM;
+    else if (parent_to.get()->is_readonly() || child_from.get()->is_readonly())
+        re = -EROFS;
+    else if (!permit(parent_to, uid, gid, W_OK))
+        re = -EACCES;
+    else if (parent_to.get()->find(name_to) != nullptr)
+        re = -EEXIST;
+    else
+    {
+        child_from.get()->add_nlink();
+        parent_to.get()->link(name_to, inode_id);
+    }
+    unlock_inodes(locked);
+    return re;
+}
+
+// snapshots live in /.snapshots, made at format time or on the first mount of an older volume
+void EasyFileSystem::make_snapshot_dir()
+{
+    if (root.get()->find(snapshot_dir_name) != nullptr)
+        return;
+    u32 mode, uid, gid;
+    root.get()->get_permission(mode, uid, gid);
+    root.get()->create(snapshot_dir_name, DiskInodeType::Directory, uid, gid, mode);
+}
+bool EasyFileSystem::is_snapshot_dir(u32 inode_id)
+{
+    if (inode_id == 0)
+        return false;
+    rdlock_inode(0);
+    shared_ptr<Inode> dir = root.get()->find(snapshot_dir_name);
+    unlock_inode(0);
+    return dir != nullptr && dir.get()->get_id() == inode_id;
+}
+// the data blocks are shared through the reference counts and copied on the next write to
+// either side; only the inodes, directories and block maps are new
+void EasyFileSystem::clone_tree(shared_ptr<Inode> src, shared_ptr<Inode> dst, unordered_map<u32, shared_ptr<Inode>> &cloned)
+{
+    u32 src_id = src.get()->get_id();
+    u32 slots = src.get()->get_stat().st_size / dirent_sz;
+    vector<DirEntry> dirents(slots);
+    slots = src.get()->read_dirents(0, dirents.data(), slots);
+    for (u32 i = 0; i < slots; i++)
+    {
+        string name = dirents[i].get_name();
+        if (name.empty() || (src_id == 0 && name == snapshot_dir_name))
+            continue;
+        u32 child_id = dirents[i].get_inode_number();
+        auto iter = cloned.find(child_id);
+        if (iter != cloned.end())
+        {
+            // a second link to a file already cloned
+            dst.get()->link(name, iter->second.get()->get_id());
+            iter->second.get()->add_nlink();
+            continue;
+        }
+        shared_ptr<Inode> child = get_inode(child_id);
+        u32 mode, uid, gid;
+        child.get()->get_permission(mode, uid, gid);
+        struct stat st = child.get()->get_stat();
+        bool is_dir = child.get()->is_dir();
+        shared_ptr<Inode> copy = dst.get()->create(name, is_dir ? DiskInodeType::Directory : DiskInodeType::File, uid, gid, mode);
+        if (!is_dir)
+        {
+            copy.get()->copy_from(child, 0, 0, st.st_size);
+            if (st.st_nlink > 1)
+                cloned[child_id] = copy;
+        }
+        copy.get()->set_atime(st.st_atime);
+        copy.get()->set_ctime(st.st_ctime);
+        copy.get()->set_readonly();
+        permission_generation[copy.get()->get_id() % inode_lock_group]++;
+        if (is_dir)
+            clone_tree(child, copy, cloned);
+    }
+}
+// every lock group is taken in ascending order, as wrlock_inodes does, so no request changes
+// the tree while it is cloned and the snapshot shows it at a single point in time
+shared_ptr<Inode> EasyFileSystem::snapshot(u32 parent_id, string name, u32 uid, u32 gid, i32 &err, bool remember)
+{
+    if (name.size() > name_length_limit)
+    {
+        err = ENAMETOOLONG;
+        return shared_ptr<Inode>(nullptr);
+    }
+    shared_ptr<Inode> parent = get_inode(parent_id);
+    shared_ptr<Inode> snap(nullptr);
+    pthread_mutex_lock(&snapshot_lock);
+    for (u32 i = 0; i < inode_lock_group; i++)
+        pthread_rwlock_wrlock(&inode_locks[i]);
+    if (parent.get()->get_nlink() == 0)
+        err = ENOENT;
+    else if (!permit(parent, uid, gid, W_OK))
+        err = EACCES;
+    else if (parent.get()->find(name) != nullptr)
+        err = EEXIST;
+    else
+    {
+        u32 mode, root_uid, root_gid;
+        root.get()->get_permission(mode, root_uid, root_gid);
+        snap = parent.get()->create(name, DiskInodeType::Directory, root_uid, root_gid, mode);
+        snap.get()->set_readonly();
+        permission_generation[snap.get()->get_id() % inode_lock_group]++;
+        if (remember)
+            add_lookup(snap.get()->get_id(), 1);
+    }
+    if (snap != nullptr)
+    {
+        unordered_map<u32, shared_ptr<Inode>> cloned;
+        clone_tree(root, snap, cloned);
+    }
+    for (u32 i = inode_lock_group; i > 0; i--)
+        pthread_rwlock_unlock(&inode_locks[i - 1]);
+    pthread_mutex_unlock(&snapshot_lock);
+    return snap;
+}
+// nothing writes into a snapshot, so only lookups and reads still in flight are waited for
+void EasyFileSystem::remove_tree(shared_ptr<Inode> dir)
+{
+    u32 dir_id = dir.get()->get_id();
+    rdlock_inode(dir_id);
+    u32 slots = dir.get()->get_stat().st_size / dirent_sz;
+    vector<DirEntry> dirents(slots);
+    slots = dir.get()->read_dirents(0, dirents.data(), slots);
+    unlock_inode(dir_id);
+    for (u32 i = 0; i < slots; i++)
+    {
+        if (dirents[i].get_name().empty())
+            continue;
+        shared_ptr<Inode> child = get_inode(dirents[i].get_inode_number());
+        if (child.get()->is_dir())
+            remove_tree(child);
+        vector<u32> locked = {dir_id, child.get()->get_id()};
+        wrlock_inodes(locked);
+        if (child.get()->sub_nlink() && !defer_release(child.get()->get_id()))
+            release(child);
+        unlock_inodes(locked);
+    }
+    wrlock_inode(dir_id);
+    dir.get()->remove_all();
+    unlock_inode(dir_id);
+}
+// a directory in /.snapshots that is not a snapshot goes the usual way
+i64 EasyFileSystem::remove_snapshot(u32 parent_id, string name, u32 uid, u32 gid)
+{
+    shared_ptr<Inode> parent = get_inode(parent_id);
+    pthread_mutex_lock(&snapshot_lock);
+    rdlock_inode(parent_id);
+    shared_ptr<Inode> snap = parent.get()->find(name);
+    unlock_inode(parent_id);
+    if (snap != nullptr && !snap.get()->is_readonly())
+    {
+        pthread_mutex_unlock(&snapshot_lock);
+        return unlink(parent_id, name, uid, gid);
+    }
+    i64 re = 0;
+    if (snap == nullptr)
+        re = -ENOENT;
+    else if (!snap.get()->is_dir())
+        re = -ENOTDIR;
+    else if (!permit(parent, uid, gid, W_OK))
+        re = -EACCES;
+    else
+    {
+        remove_tree(snap);
+        vector<u32> locked = {parent_id, snap.get()->get_id()};
+        wrlock_inodes(locked);
+        parent.get()->remove(name);
+        if (snap.get()->sub_nlink() && !defer_release(snap.get()->get_id()))
+            release(snap);
+        unlock_inodes(locked);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return re;
+}
+void EasyFileSystem::release(shared_ptr<Inode> inode)
+{
+    inode.get()->clear();
+    permission_generation[inode.get()->get_id() % inode_lock_group]++;
+    dealloc_inode(inode.get()->get_id());
+}
+void EasyFileSystem::add_lookup(u32 inode_id, u64 nlookup)
+{
+    pthread_mutex_lock(&lookup_lock);
+    lookup_count[inode_id] += nlookup;
+    pthread_mutex_unlock(&lookup_lock);
+}
+// called with the inode locked once its last link is gone; the inode is kept
+// until the kernel forgets its last reference
+bool EasyFileSystem::defer_release(u32 inode_id)
+{
+    pthread_mutex_lock(&lookup_lock);
+    bool referenced = lookup_count.count(inode_id) > 0;
+    if (referenced)
+        orphans.insert(inode_id);
+    pthread_mutex_unlock(&lookup_lock);
+    return referenced;
+}
+void EasyFileSystem::forget(u32 inode_id, u64 nlookup)
+{
+    pthread_mutex_lock(&lookup_lock);
+    auto iter = lookup_count.find(inode_id);
+    bool orphan = false;
+    if (iter != lookup_count.end())
+    {
+        iter->second -= min(iter->second, nlookup);
+        if (iter->second == 0)
+        {
+            lookup_count.erase(iter);
+            orphan = orphans.erase(inode_id) > 0;
+        }
+    }
+    pthread_mutex_unlock(&lookup_lock);
+    if (orphan)
+    {
+        wrlock_inode(inode_id);
+        release(get_inode(inode_id));
+        unlock_inode(inode_id);
+    }
+}
+void EasyFileSystem::forget_all()
+{
+    pthread_mutex_lock(&lookup_lock);
+    set<u32> orphan_ids;
+    orphan_ids.swap(orphans);
+    lookup_count.clear();
+    pthread_mutex_unlock(&lookup_lock);
+    for (u32 inode_id : orphan_ids)
+    {
+        wrlock_inode(inode_id);
+        release(get_inode(inode_id));
+        unlock_inode(inode_id);
+    }
+}
+
+shared_ptr<Inode> EasyFileSystem::get_inode(u32 inode_id)
+{
+    u32 inode_block_id, inode_offset;
+    get_disk_inode_pos(inode_id, inode_block_id, inode_offset);
+    return shared_ptr<Inode>(new Inode(inode_id, inode_block_id, inode_offset, this, block_device));
+}
+
+// inodes sharing an inode block are read under a single cache lookup
+vector<struct stat> EasyFileSystem::get_stats(const vector<u32> &inode_ids)
+{
+    vector<struct stat> stats(inode_ids.size());
+    vector<u32> order;
+    for (u32 i = 0; i < inode_ids.size(); i++)
+        order.push_back(i);
+    sort(order.begin(), order.end(), [&inode_ids](u32 a, u32 b)
+         { return inode_ids[a] < inode_ids[b]; });
+    u32 i = 0;
+    while (i < order.size())
+    {
+        u32 block_id, block_offset;
+        get_disk_inode_pos(inode_ids[order[i]], block_id, block_offset);
+        u32 j = i;
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(block_id, block_device, -1)
+            .get()
+            ->read<Block, u32>(0, [this, &inode_ids, &order, &stats, &j, block_id](const Block &inode_block) -> u32
+                               {
+                                   u32 current_block_id, block_offset;
+                                   while (j < order.size())
+                                   {
+                                       this->get_disk_inode_pos(inode_ids[order[j]], current_block_id, block_offset);
+                                       if (current_block_id != block_id)
+                                           break;
+                                       stats[order[j]] = ((const DiskInode *)(inode_block.data + block_offset))->get_stat(inode_ids[order[j]], this->block_device);
+                                       j++;
+                                   }
+                                   return 0;
+                               });
+        i = j;
+    }
+    for (u32 k = 0; k < inode_ids.size(); k++)
+        stats[k].st_blocks += delayed_count(inode_ids[k]);
+    return stats;
+}
+
+// decisions are cached per (inode, uid, gid); chmod, chown and freeing an inode
+// bump the generation of its lock group, which invalidates its cached entries
+bool EasyFileSystem::permit(shared_ptr<Inode> inode, u32 uid, u32 gid, u32 mask)
+{
+    u32 inode_id = inode.get()->get_id();
+    u32 generation = permission_generation[inode_id % inode_lock_group];
+    u32 slot = (inode_id * 2654435761u ^ uid * 40503u ^ gid) % permission_cache_size;
+    PermissionCacheEntry &entry = permission_cache[slot];
+    pthread_mutex_lock(&permission_locks[slot]);
+    if (entry.valid && entry.inode_id == inode_id && entry.uid == uid && entry.gid == gid && entry.generation == generation)
+    {
+        u32 perm = entry.perm;
+        pthread_mutex_unlock(&permission_locks[slot]);
+        return (perm & mask) == mask;
+    }
+    pthread_mutex_unlock(&permission_locks[slot]);
+    u32 mode, owner_uid, owner_gid;
+    inode.get()->get_permission(mode, owner_uid, owner_gid);
+    u32 perm = 0;
+    if (have_r_permission(mode, owner_uid, owner_gid, uid, gid))
+        perm |= R_OK;
+    if (have_w_permission(mode, owner_uid, owner_gid, uid, gid) && !inode.get()->is_readonly())
+        perm |= W_OK;
+    if (have_x_permission(mode, owner_uid, owner_gid, uid, gid))
+        perm |= X_OK;
+    pthread_mutex_lock(&permission_locks[slot]);
+    entry.inode_id = inode_id;
+    entry.uid = uid;
+    entry.gid = gid;
+    entry.generation = generation;
+    entry.perm = perm;
+    entry.valid = true;
+    pthread_mutex_unlock(&permission_locks[slot]);
+    return (perm & mask) == mask;
+}
+
+void EasyFileSystem::set_mode(shared_ptr<Inode> inode, u32 mode)
+{
+    inode.get()->set_mode(mode);
+    permission_generation[inode.get()->get_id() % inode_lock_group]++;
+}
+
+void EasyFileSystem::set_owner(shared_ptr<Inode> inode, u32 uid, u32 gid)
+{
+    inode.get()->set_owner(uid, gid);
+    permission_generation[inode.get()->get_id() % inode_lock_group]++;
+}
+
+void EasyFileSystem::rdlock_inode(u32 inode_id)
+{
+    pthread_rwlock_rdlock(&inode_locks[inode_id % inode_lock_group]);
+}
+
+void EasyFileSystem::wrlock_inode(u32 inode_id)
+{
+    pthread_rwlock_wrlock(&inode_locks[inode_id % inode_lock_group]);
+}
+
+void EasyFileSystem::unlock_inode(u32 inode_id)
+{
+    pthread_rwlock_unlock(&inode_locks[inode_id % inode_lock_group]);
+}
+
+// several inodes may share a lock group, so lock each group once in ascending order
+void EasyFileSystem::wrlock_inodes(vector<u32> inode_ids)
+{
+    vector<u32> groups;
+    for (u32 inode_id : inode_ids)
+        groups.push_back(inode_id % inode_lock_group);
+    sort(groups.begin(), groups.end());
+    groups.erase(unique(groups.begin(), groups.end()), groups.end());
+    for (u32 group_id : groups)
+        pthread_rwlock_wrlock(&inode_locks[group_id]);
+}
+
+void EasyFileSystem::unlock_inodes(vector<u32> inode_ids)
+{
+    vector<u32> groups;
+    for (u32 inode_id : inode_ids)
+        groups.push_back(inode_id % inode_lock_group);
+    sort(groups.begin(), groups.end());
+    groups.erase(unique(groups.begin(), groups.end()), groups.end());
+    for (auto iter = groups.rbegin(); iter != groups.rend(); iter++)
+        pthread_rwlock_unlock(&inode_locks[*iter]);
+}
+
+// the entry is looked up under delayed_lock, its blocks are only touched under the
+// lock of the inode's block
+shared_ptr<DelayedFile> EasyFileSystem::get_delayed(u32 inode_id, bool create)
+{
+    if (!create && delayed_total == 0)
+        return shared_ptr<DelayedFile>(nullptr);
+    shared_ptr<DelayedFile> file(nullptr);
+    pthread_mutex_lock(&delayed_lock);
+    auto it = delayed.find(inode_id);
+    if (it != delayed.end())
+        file = it->second;
+    else if (create)
+    {
+        file = shared_ptr<DelayedFile>(new DelayedFile());
+        file.get()->count = 0;
+        delayed[inode_id] = file;
+    }
+    pthread_mutex_unlock(&delayed_lock);
+    return file;
+}
+void EasyFileSystem::count_delayed(DelayedFile &file, u32 n)
+{
+    file.count += n;
+    delayed_total += n;
+}
+bool EasyFileSystem::delayed_full(u32 n)
+{
+    return delayed_total + n > delayed_total_max;
+}
+u32 EasyFileSystem::delayed_count(u32 inode_id)
+{
+    shared_ptr<DelayedFile> file = get_delayed(inode_id, false);
+    return file == nullptr ? 0 : file.get()->count.load();
+}
+void EasyFileSystem::drop_delayed(u32 inode_id)
+{
+    pthread_mutex_lock(&delayed_lock);
+    auto it = delayed.find(inode_id);
+    if (it != delayed.end())
+    {
+        delayed_total -= it->second.get()->count;
+        delayed.erase(it);
+    }
+    pthread_mutex_unlock(&delayed_lock);
+}
+void EasyFileSystem::flush_delayed()
+{
+    vector<u32> inode_ids;
+    pthread_mutex_lock(&delayed_lock);
+    for (auto &entry : delayed)
+        inode_ids.push_back(entry.first);
+    pthread_mutex_unlock(&delayed_lock);
+    for (u32 inode_id : inode_ids)
+        get_inode(inode_id).get()->flush_delayed();
+}
+
+// only block numbers are recorded, the contents are read again on the next mount
+void EasyFileSystem::save_cached(string path)
+{
+    vector<CachedBlock> cached = BLOCK_CACHE_MANAGER.get_cached(block_device);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+    FILE *fp = fdopen(fd, "wb");
+    u32 header[2] = {warm_magic, (u32)cached.size()};
+    fwrite(header, sizeof(header), 1, fp);
+    fwrite(cached.data(), sizeof(CachedBlock), cached.size(), fp);
+    fclose(fp);
+}
+
+// runs of blocks with the same tag are loaded as one multi-block request, which the
+// device spreads over its stripes; a list left from another volume only costs reads
+void EasyFileSystem::warm_up(string path, const atomic<bool> &stop)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr)
+        return;
+    u32 header[2];
+    vector<CachedBlock> cached;
+    if (fread(header, sizeof(header), 1, fp) == 1 && header[0] == warm_magic && header[1] <= block_cache_group * block_cache_way)
+    {
+        cached.resize(header[1]);
+        cached.resize(fread(cached.data(), sizeof(CachedBlock), cached.size(), fp));
+    }
+    fclose(fp);
+    u32 i = 0;
+    while (i < cached.size() && !stop)
+    {
+        vector<u32> block_ids;
+        i32 inode_id = cached[i].inode_id;
+        for (; i < cached.size() && cached[i].inode_id == inode_id && block_ids.size() < warm_batch; i++)
+        {
+            if (cached[i].block_id < block_device.get()->get_total_blocks())
+                block_ids.push_back(cached[i].block_id);
+        }
+        if (!block_ids.empty())
+            BLOCK_CACHE_MANAGER.load(block_ids, block_device, inode_id);
+    }
 }
\ No newline at end of file
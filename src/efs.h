@@ -1,36 +1,123 @@
-#ifndef __EFS_H_
-#define __EFS_H_
-
-#include "vfs.h"
-#include "bitmap.h"
-
-class EasyFileSystem
-{
-    shared_ptr<BlockDevice> block_device;
-    shared_ptr<Bitmap> inode_bitmap;
-    shared_ptr<Bitmap> data_bitmap;
-    shared_ptr<Inode> root;
-    u32 inode_area_start_block;
-    u32 data_area_start_block;
-    u32 uid, gid;
-
-public:
-    EasyFileSystem(shared_ptr<BlockDevice> _block_device, shared_ptr<Bitmap> _inode_bitmap, shared_ptr<Bitmap> _data_bitmap, u32 _inode_area_start_block, u32 _data_area_start_block);
-    static shared_ptr<EasyFileSystem> open(shared_ptr<BlockDevice> _block_device);
-    static shared_ptr<EasyFileSystem> create(shared_ptr<BlockDevice> _block_device);
-    void get_disk_inode_pos(u32 inode_id, u32 &block_id, u32 &block_offset);
-    u32 get_inode_id(u32 block_id, u32 block_offset);
-    u32 alloc_inode();
-    u32 alloc_data();
-    void dealloc_inode(u32 inode_id);
-    void dealloc_data(u32 block_id);
-    shared_ptr<Inode> find(string path, i32 &err);
-    shared_ptr<Inode> create(string path, DiskInodeType type, i32 &err, u32 mode);
-    i64 unlink(string path);
-    i64 rename(string from, string to);
-    i64 link(string from, string to);
-    shared_ptr<Inode> get_inode(u32 inode_id);
-    void set_user(u32 _uid, u32 _gid);
-    void get_user(u32 &_uid, u32 &_gid);
-};
+#ifndef __EFS_H_
+#define __EFS_H_
+
+#include "vfs.h"
+#include "bitmap.h"
+
+struct PermissionCacheEntry
+{
+    u32 inode_id;
+    u32 uid;
+    u32 gid;
+    u32 generation;
+    u32 perm;
+    bool valid;
+};
+
+// the blocks of one file written into holes and not yet given a place on disk, by index
+struct DelayedFile
+{
+    map<u32, Block> blocks;
+    atomic<u32> count;
+};
+
+// a data area with its bitmap and reference count table; the first one is made by mkfs,
+// each grow adds one after the old end of the volume
+struct DataSegment
+{
+    shared_ptr<Bitmap> bitmap;
+    u32 data_start;
+    u32 data_blocks;
+    u32 refcount_start;
+    u32 refcount_blocks;
+};
+
+class EasyFileSystem
+{
+    shared_ptr<BlockDevice> block_device;
+    shared_ptr<Bitmap> inode_bitmap;
+    shared_ptr<Inode> root;
+    u32 inode_area_start_block;
+    // entries below segment_count are never changed again, so they are read without a lock
+    DataSegment segments[max_grow_segments + 1];
+    atomic<u32> segment_count;
+    pthread_mutex_t grow_lock;
+    // snapshots are taken and removed one at a time
+    pthread_mutex_t snapshot_lock;
+    pthread_rwlock_t inode_locks[inode_lock_group];
+    PermissionCacheEntry permission_cache[permission_cache_size];
+    pthread_mutex_t permission_locks[permission_cache_size];
+    atomic<u32> permission_generation[inode_lock_group];
+    unordered_map<u32, u64> lookup_count;
+    set<u32> orphans;
+    pthread_mutex_t lookup_lock;
+    unordered_map<u32, shared_ptr<DelayedFile>> delayed;
+    atomic<u32> delayed_total;
+    pthread_mutex_t delayed_lock;
+    shared_ptr<Inode> find_parent(const vector<string> &paths, i32 &err);
+    void release(shared_ptr<Inode> inode);
+    bool defer_release(u32 inode_id);
+    void load_segments();
+    void load_refcounts();
+    void load_block_counts();
+    void make_snapshot_dir();
+    const DataSegment &segment_of(u32 block_id);
+    bool unshare_data(u32 block_id);
+    void clone_tree(shared_ptr<Inode> src, shared_ptr<Inode> dst, unordered_map<u32, shared_ptr<Inode>> &cloned);
+    void remove_tree(shared_ptr<Inode> dir);
+
+public:
+    EasyFileSystem(shared_ptr<BlockDevice> _block_device, shared_ptr<Bitmap> _inode_bitmap, shared_ptr<Bitmap> _data_bitmap, u32 _inode_area_start_block, u32 _data_area_start_block);
+    static shared_ptr<EasyFileSystem> open(shared_ptr<BlockDevice> _block_device);
+    // the volume fills the whole device; inode_count is rounded up to a whole bitmap block
+    static shared_ptr<EasyFileSystem> create(shared_ptr<BlockDevice> _block_device, u32 inode_count = default_inode_count);
+    static bool probe(string password, u32 &stripe_count, u32 &stripe_unit, CipherType &cipher, u32 &total_blocks);
+    void get_disk_inode_pos(u32 inode_id, u32 &block_id, u32 &block_offset);
+    u32 get_inode_id(u32 block_id, u32 block_offset);
+    u32 alloc_inode();
+    u32 alloc_data();
+    vector<u32> alloc_data_run(u32 count);
+    void dealloc_inode(u32 inode_id);
+    void dealloc_data(u32 block_id);
+    void dealloc_data(const vector<u32> &block_ids);
+    vector<bool> share_data(const vector<u32> &block_ids);
+    bool is_shared(u32 block_id);
+    // extend the volume to total_blocks, rounded down to whole stripes, while it is in use; an errno
+    i32 grow(u64 total_blocks);
+    shared_ptr<Inode> find(string path, i32 &err);
+    shared_ptr<Inode> create(string path, DiskInodeType type, i32 &err, u32 mode);
+    i64 unlink(string path);
+    i64 rename(string from, string to);
+    i64 link(string from, string to);
+    shared_ptr<Inode> lookup(u32 parent_id, string name, u32 uid, u32 gid, i32 &err, bool remember = false);
+    shared_ptr<Inode> create(u32 parent_id, string name, DiskInodeType type, u32 uid, u32 gid, i32 &err, u32 mode, bool remember = false);
+    i64 unlink(u32 parent_id, string name, u32 uid, u32 gid);
+    i64 rename(u32 parent_from_id, string name_from, u32 parent_to_id, string name_to, u32 uid, u32 gid);
+    i64 link(u32 inode_id, u32 parent_to_id, string name_to, u32 uid, u32 gid);
+    bool is_snapshot_dir(u32 inode_id);
+    shared_ptr<Inode> snapshot(u32 parent_id, string name, u32 uid, u32 gid, i32 &err, bool remember = false);
+    i64 remove_snapshot(u32 parent_id, string name, u32 uid, u32 gid);
+    bool permit(shared_ptr<Inode> inode, u32 uid, u32 gid, u32 mask);
+    void set_mode(shared_ptr<Inode> inode, u32 mode);
+    void set_owner(shared_ptr<Inode> inode, u32 uid, u32 gid);
+    void add_lookup(u32 inode_id, u64 nlookup);
+    void forget(u32 inode_id, u64 nlookup);
+    void forget_all();
+    shared_ptr<Inode> get_inode(u32 inode_id);
+    vector<struct stat> get_stats(const vector<u32> &inode_ids);
+    void rdlock_inode(u32 inode_id);
+    void wrlock_inode(u32 inode_id);
+    void unlock_inode(u32 inode_id);
+    void wrlock_inodes(vector<u32> inode_ids);
+    void unlock_inodes(vector<u32> inode_ids);
+    shared_ptr<DelayedFile> get_delayed(u32 inode_id, bool create);
+    void count_delayed(DelayedFile &file, u32 n);
+    bool delayed_full(u32 n);
+    u32 delayed_count(u32 inode_id);
+    void drop_delayed(u32 inode_id);
+    void flush_delayed();
+    void save_cached(string path);
+    void warm_up(string path, const atomic<bool> &stop);
+    ~EasyFileSystem();
+};
 #endif
\ No newline at end of file
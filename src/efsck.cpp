@@ -0,0 +1,476 @@
+#include "efs.h"
+#include <thread>
+#include <cstdarg>
+
+// ./efsck [-r] [-j threads] [password]
+// checks an unmounted volume: every allocated inode, its block map and index blocks and its
+// directory entries are read by a pool of threads, and the counts are compared with the
+// bitmaps, the reference count tables, the link counts and the entry counts; -r writes the
+// counts found back
+
+shared_ptr<BlockDevice> block_device;
+u32 inode_num, inode_area_start, data_area_start;
+
+// the first data area and the ones added by growing the volume
+struct Segment
+{
+    u32 bitmap_start;
+    u32 data_start;
+    u32 data_blocks;
+    u32 refcount_start;
+    u32 refcount_blocks;
+};
+vector<Segment> segments;
+u32 num_threads = 4;
+bool repair = false;
+// files keep a block count once a mount has counted them
+bool blocks_counted = false;
+
+vector<bool> inode_used;
+// owners of each block from the first data area on, and entries naming each inode
+vector<atomic<u32>> block_refs;
+vector<atomic<u32>> inode_links;
+// inodes whose block map points outside the data area
+vector<atomic<bool>> inode_bad;
+atomic<u32> next_chunk;
+atomic<u32> errors;
+atomic<u32> repaired;
+pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const u32 chunk_inodes = 256;
+
+struct DanglingEntry
+{
+    u32 dir_id;
+    u32 slot;
+    u32 child_id;
+};
+vector<DanglingEntry> dangling;
+
+void report(bool repairable, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&print_lock);
+    vfprintf(stdout, fmt, args);
+    fputs(repairable && repair ? ", fixed\n" : "\n", stdout);
+    pthread_mutex_unlock(&print_lock);
+    va_end(args);
+    errors++;
+    if (repairable && repair)
+        repaired++;
+}
+
+DiskInode read_inode(u32 inode_id)
+{
+    return BLOCK_CACHE_MANAGER
+        .get_block_cache(inode_area_start + inode_id / inodes_per_block, block_device, -1)
+        .get()
+        ->peek<DiskInode>((inode_id % inodes_per_block) * inode_size);
+}
+
+template <typename F>
+void modify_inode(u32 inode_id, F f)
+{
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(inode_area_start + inode_id / inodes_per_block, block_device, -1)
+        .get()
+        ->modify_and_sync<DiskInode, u32>((inode_id % inodes_per_block) * inode_size, [&f](DiskInode &disk_inode) -> u32
+                                          {
+                                              f(disk_inode);
+                                              return 0;
+                                          });
+}
+
+const Segment &segment_of(u32 block_id)
+{
+    u32 i = segments.size() - 1;
+    while (i > 0 && block_id < segments[i].data_start)
+        i--;
+    return segments[i];
+}
+
+// the table of the first data area may lie in any of them
+bool in_table(u32 block_id)
+{
+    for (auto &segment : segments)
+        if (block_id >= segment.refcount_start && block_id < segment.refcount_start + segment.refcount_blocks)
+            return true;
+    return false;
+}
+
+bool in_data_area(u32 block_id)
+{
+    const Segment &segment = segment_of(block_id);
+    return block_id >= segment.data_start && block_id < segment.data_start + segment.data_blocks && !in_table(block_id);
+}
+
+u8 read_refcount(const Segment &segment, u32 block_id)
+{
+    u32 pos = block_id - segment.data_start;
+    return BLOCK_CACHE_MANAGER
+        .get_block_cache(segment.refcount_start + pos / block_sz, block_device, -1)
+        .get()
+        ->peek<Block>(0)
+        .data[pos % block_sz];
+}
+
+// runs f on each chunk of inode ids handed out to the threads
+template <typename F>
+void parallel_inodes(F f)
+{
+    next_chunk = 0;
+    vector<std::thread> ths;
+    for (u32 t = 0; t < num_threads; t++)
+        ths.push_back(std::thread([&f]()
+                                  {
+                                      for (u32 chunk = next_chunk++; chunk * chunk_inodes < inode_num; chunk = next_chunk++)
+                                          for (u32 inode_id = chunk * chunk_inodes; inode_id < min(inode_num, (chunk + 1) * chunk_inodes); inode_id++)
+                                              if (inode_used[inode_id])
+                                                  f(inode_id);
+                                  }));
+    for (auto &th : ths)
+        th.join();
+}
+
+// pass 1: count the owners of every block and the entries naming every inode
+void scan_inode(u32 inode_id, vector<DanglingEntry> &found)
+{
+    DiskInode disk_inode = read_inode(inode_id);
+    if (!disk_inode.is_dir() && !disk_inode.is_file())
+    {
+        report(false, "inode %u: unknown type", inode_id);
+        inode_bad[inode_id] = true;
+        return;
+    }
+    u32 held = 0;
+    disk_inode.walk_blocks(block_device, [inode_id, &held](u32 block_id, bool index) -> bool
+                           {
+                               if (!in_data_area(block_id))
+                               {
+                                   report(false, "inode %u: %s block %u outside the data area", inode_id, index ? "index" : "data", block_id);
+                                   inode_bad[inode_id] = true;
+                                   return false;
+                               }
+                               block_refs[block_id - data_area_start]++;
+                               held++;
+                               return true;
+                           });
+    if (inode_bad[inode_id])
+        return;
+    if (disk_inode.is_file())
+    {
+        if (blocks_counted && held != disk_inode.allocated_blocks())
+        {
+            report(true, "inode %u: holds %u blocks, recorded %u", inode_id, held, disk_inode.allocated_blocks());
+            if (repair)
+                modify_inode(inode_id, [](DiskInode &d)
+                             { d.recount_blocks(block_device); });
+        }
+        return;
+    }
+    u32 slots = disk_inode.get_size() / dirent_sz, count = 0;
+    vector<DirEntry> dirents(slots);
+    disk_inode.read_data(0, (u8 *)dirents.data(), slots * dirent_sz, block_device, -1);
+    for (u32 i = 0; i < slots; i++)
+    {
+        if (dirents[i].get_name().empty())
+            continue;
+        u32 child_id = dirents[i].get_inode_number();
+        if (child_id >= inode_num || !inode_used[child_id] || child_id == 0)
+        {
+            report(true, "inode %u: entry %s names free inode %u", inode_id, dirents[i].get_name().c_str(), child_id);
+            found.push_back({inode_id, i, child_id});
+            continue;
+        }
+        inode_links[child_id]++;
+        count++;
+    }
+    if (count != disk_inode.get_dirent_num())
+    {
+        report(true, "inode %u: %u entries, recorded %u", inode_id, count, disk_inode.get_dirent_num());
+        if (repair)
+            modify_inode(inode_id, [count](DiskInode &d)
+                         {
+                             while (d.get_dirent_num() > count)
+                                 d.sub_dirent_num();
+                             while (d.get_dirent_num() < count)
+                                 d.add_dirent_num();
+                         });
+    }
+}
+
+// pass 2: link counts, orphans and the shared flag
+void check_inode(u32 inode_id)
+{
+    DiskInode disk_inode = read_inode(inode_id);
+    u32 links = inode_id == 0 ? 1 : (u32)inode_links[inode_id];
+    if (links == 0)
+    {
+        // unlinked while open, or cut off by a lost entry
+        report(true, "inode %u: not in any directory", inode_id);
+        return;
+    }
+    if (links != disk_inode.get_nlink())
+    {
+        report(true, "inode %u: %u links, recorded %u", inode_id, links, disk_inode.get_nlink());
+        if (repair)
+            modify_inode(inode_id, [links](DiskInode &d)
+                         {
+                             while (d.get_nlink() > links)
+                                 d.sub_nlink();
+                             while (d.get_nlink() < links)
+                                 d.add_nlink();
+                         });
+    }
+    if (disk_inode.is_shared() || inode_bad[inode_id])
+        return;
+    bool shared = false;
+    disk_inode.walk_blocks(block_device, [&shared](u32 block_id, bool index) -> bool
+                           {
+                               if (!index && block_refs[block_id - data_area_start] > 1)
+                                   shared = true;
+                               return true;
+                           });
+    if (shared)
+    {
+        report(true, "inode %u: holds shared blocks but is not marked shared", inode_id);
+        if (repair)
+            modify_inode(inode_id, [](DiskInode &d)
+                         { d.set_shared(); });
+    }
+}
+
+// orphans give back their blocks before the bitmaps are compared
+void drop_orphan(u32 inode_id)
+{
+    DiskInode disk_inode = read_inode(inode_id);
+    if (!inode_bad[inode_id])
+        disk_inode.walk_blocks(block_device, [](u32 block_id, bool) -> bool
+                               {
+                                   block_refs[block_id - data_area_start]--;
+                                   return true;
+                               });
+    inode_used[inode_id] = false;
+}
+
+// pass 3: the data bitmaps and the reference counts against the owners found, one bitmap block
+// per task
+void check_data(const Segment &segment, u32 bitmap_block)
+{
+    BitmapBlock bits = BLOCK_CACHE_MANAGER
+                           .get_block_cache(segment.bitmap_start + bitmap_block, block_device, -1)
+                           .get()
+                           ->peek<BitmapBlock>(0);
+    BitmapBlock expect = {};
+    bool mismatch = false;
+    for (u32 i = 0; i < block_bits; i++)
+    {
+        u32 pos = bitmap_block * block_bits + i;
+        bool marked = (bits.data[i / 64] >> (i % 64)) & 1;
+        // past the end of the area the bits of a grown volume are kept set
+        if (pos >= segment.data_blocks)
+        {
+            if (segments.size() == 1)
+                break;
+            expect.data[i / 64] |= 1ull << (i % 64);
+            if (!marked)
+            {
+                report(true, "data bitmap block %u: bit %u past the end of the area is free", segment.bitmap_start + bitmap_block, i);
+                mismatch = true;
+            }
+            continue;
+        }
+        u32 block_id = segment.data_start + pos;
+        bool table = in_table(block_id);
+        u32 refs = block_refs[block_id - data_area_start];
+        bool used = table || refs > 0;
+        if (used)
+            expect.data[i / 64] |= 1ull << (i % 64);
+        if (used != marked)
+        {
+            report(true, "block %u: %s, marked %s", block_id, used ? "in use" : "free", marked ? "used" : "free");
+            mismatch = true;
+        }
+        if (segment.refcount_blocks == 0 || table)
+            continue;
+        u32 extra = refs > 1 ? min(refs - 1, refcount_max) : 0;
+        u32 recorded = read_refcount(segment, block_id);
+        if (extra != recorded)
+        {
+            report(true, "block %u: %u owners, reference count %u", block_id, refs, recorded);
+            if (repair)
+            {
+                u32 table_pos = pos;
+                BLOCK_CACHE_MANAGER
+                    .get_block_cache(segment.refcount_start + table_pos / block_sz, block_device, -1)
+                    .get()
+                    ->modify_and_sync<Block, u32>(0, [table_pos, extra](Block &block) -> u32
+                                                  {
+                                                      block.data[table_pos % block_sz] = extra;
+                                                      return 0;
+                                                  });
+            }
+        }
+    }
+    if (mismatch && repair)
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(segment.bitmap_start + bitmap_block, block_device, -1)
+            .get()
+            ->modify_and_sync<BitmapBlock, u32>(0, [&expect](BitmapBlock &bitmap_block) -> u32
+                                                {
+                                                    bitmap_block = expect;
+                                                    return 0;
+                                                });
+}
+
+int main(int argc, char **argv)
+{
+    string password = "";
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0)
+            repair = true;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            num_threads = max(1, atoi(argv[++i]));
+        else
+            password = argv[i];
+    }
+    u32 stripe_count, stripe_unit, total_blocks;
+    CipherType cipher;
+    if (!EasyFileSystem::probe(password, stripe_count, stripe_unit, cipher, total_blocks))
+    {
+        cout << "Open failed: incorrect password or file corrupted" << endl;
+        return 8;
+    }
+    block_device = shared_ptr<BlockDevice>(new BlockDevice(password, stripe_count, stripe_unit, cipher, false, total_blocks));
+    SuperBlock super_block = BLOCK_CACHE_MANAGER.get_block_cache(0, block_device, -1).get()->peek<SuperBlock>(0);
+    inode_num = super_block.inode_bitmap_blocks * block_bits;
+    inode_area_start = 1 + super_block.inode_bitmap_blocks;
+    blocks_counted = super_block.has_block_counts();
+    u32 data_bitmap_start = inode_area_start + super_block.inode_area_blocks;
+    data_area_start = data_bitmap_start + super_block.data_bitmap_blocks;
+    inode_num = min(inode_num, super_block.inode_area_blocks * inodes_per_block);
+    // an older volume has no reference count table yet
+    segments.push_back({data_bitmap_start, data_area_start, super_block.data_area_blocks,
+                        super_block.is_current() ? super_block.get_refcount_start() : 0,
+                        super_block.is_current() ? super_block.get_refcount_blocks() : 0});
+    for (u32 i = 0; i < super_block.get_segment_count() && i < max_grow_segments; i++)
+    {
+        GrownSegment grown = super_block.get_segment(i);
+        u32 data_blocks = grown.data_blocks;
+        segments.push_back({grown.start, grown.start + grown.bitmap_blocks, data_blocks, grown.start + grown.bitmap_blocks, (data_blocks + block_sz - 1) / block_sz});
+    }
+    for (u32 i = 0; i < segments.size(); i++)
+    {
+        const Segment &segment = segments[i];
+        u32 bitmap_blocks = segment.data_start - segment.bitmap_start;
+        if ((u64)segment.data_start + segment.data_blocks > super_block.total_blocks || (u64)bitmap_blocks * block_bits < segment.data_blocks ||
+            (i > 0 && segment.bitmap_start < segments[i - 1].data_start + segments[i - 1].data_blocks))
+        {
+            cout << "Bad super block geometry" << endl;
+            return 8;
+        }
+    }
+    const Segment &first = segments[0];
+    const Segment &holder = segment_of(first.refcount_start);
+    if (first.refcount_blocks > 0 && (first.refcount_start < holder.data_start || first.refcount_start + first.refcount_blocks > holder.data_start + holder.data_blocks ||
+                                      first.refcount_blocks < (first.data_blocks + block_sz - 1) / block_sz))
+    {
+        cout << "Bad reference count table at " << first.refcount_start << endl;
+        return 8;
+    }
+
+    timespec s, e;
+    clock_gettime(CLOCK_REALTIME, &s);
+    inode_used.resize(inode_num);
+    for (u32 b = 0; b * block_bits < inode_num; b++)
+    {
+        BitmapBlock bits = BLOCK_CACHE_MANAGER.get_block_cache(1 + b, block_device, -1).get()->peek<BitmapBlock>(0);
+        for (u32 i = 0; i < block_bits && b * block_bits + i < inode_num; i++)
+            inode_used[b * block_bits + i] = (bits.data[i / 64] >> (i % 64)) & 1;
+    }
+    if (!inode_used[0] || !read_inode(0).is_dir())
+    {
+        cout << "Root directory missing" << endl;
+        return 8;
+    }
+    u32 data_total = super_block.total_blocks - data_area_start;
+    block_refs = vector<atomic<u32>>(data_total);
+    inode_links = vector<atomic<u32>>(inode_num);
+    inode_bad = vector<atomic<bool>>(inode_num);
+    for (u32 i = 0; i < data_total; i++)
+        block_refs[i] = 0;
+    for (u32 i = 0; i < inode_num; i++)
+    {
+        inode_links[i] = 0;
+        inode_bad[i] = false;
+    }
+    errors = 0;
+    repaired = 0;
+
+    vector<vector<DanglingEntry>> found(inode_num / chunk_inodes + 1);
+    parallel_inodes([&found](u32 inode_id)
+                    { scan_inode(inode_id, found[inode_id / chunk_inodes]); });
+    for (auto &entries : found)
+        dangling.insert(dangling.end(), entries.begin(), entries.end());
+    if (repair)
+        for (auto &entry : dangling)
+        {
+            DirEntry empty;
+            modify_inode(entry.dir_id, [&entry, &empty](DiskInode &d)
+                         { d.write_at(entry.slot * dirent_sz, empty.as_bytes(), dirent_sz, block_device, -1); });
+        }
+
+    parallel_inodes(check_inode);
+    // inodes no entry names are freed together with their blocks
+    vector<u32> orphans;
+    for (u32 inode_id = 1; inode_id < inode_num; inode_id++)
+        if (inode_used[inode_id] && inode_links[inode_id] == 0)
+            orphans.push_back(inode_id);
+    if (repair)
+        for (u32 inode_id : orphans)
+        {
+            drop_orphan(inode_id);
+            u32 b = inode_id / block_bits, i = inode_id % block_bits;
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(1 + b, block_device, -1)
+                .get()
+                ->modify_and_sync<BitmapBlock, u32>(0, [i](BitmapBlock &bitmap_block) -> u32
+                                                    {
+                                                        bitmap_block.data[i / 64] &= ~(1ull << (i % 64));
+                                                        return 0;
+                                                    });
+        }
+
+    // one task per bitmap block of every segment
+    vector<pair<u32, u32>> tasks;
+    for (u32 i = 0; i < segments.size(); i++)
+        for (u32 b = 0; segments[i].bitmap_start + b < segments[i].data_start; b++)
+            tasks.push_back({i, b});
+    next_chunk = 0;
+    vector<std::thread> ths;
+    for (u32 t = 0; t < num_threads; t++)
+        ths.push_back(std::thread([&tasks]()
+                                  {
+                                      for (u32 k = next_chunk++; k < tasks.size(); k = next_chunk++)
+                                          check_data(segments[tasks[k].first], tasks[k].second);
+                                  }));
+    for (auto &th : ths)
+        th.join();
+    BLOCK_CACHE_MANAGER.flush();
+    clock_gettime(CLOCK_REALTIME, &e);
+
+    u32 files = 0, used = 0;
+    for (u32 i = 0; i < inode_num; i++)
+        files += inode_used[i];
+    for (u32 i = 0; i < data_total; i++)
+        used += block_refs[i] > 0;
+    for (auto &segment : segments)
+        used += segment.refcount_blocks;
+    double ms = (e.tv_sec - s.tv_sec) * 1000 + (double)(e.tv_nsec - s.tv_nsec) / 1000000;
+    printf("%u inodes, %u data blocks, %u problems (%u fixed) in %.1lf ms\n", files, used, (u32)errors, (u32)repaired, ms);
+    if (errors == 0)
+        return 0;
+    return errors == repaired ? 1 : 4;
+}
@@ -0,0 +1,53 @@
+#include "utils.h"
+
+// ./efsgrow <mountpoint> <size>
+// grows a mounted volume to size bytes, which may end in K, M or G; the device files are
+// extended and the new blocks can be allocated at once, without unmounting
+
+u64 parse_size(const char *arg)
+{
+    char *end;
+    u64 size = strtoull(arg, &end, 10);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        // fall through
+    case 'M':
+    case 'm':
+        size <<= 10;
+        // fall through
+    case 'K':
+    case 'k':
+        size <<= 10;
+    }
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        cout << "Usage: " << argv[0] << " <mountpoint> <size>" << endl;
+        return 1;
+    }
+    u64 size = parse_size(argv[2]);
+    int fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        cout << "Cannot open " << argv[1] << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    int re = ioctl(fd, efs_ioc_grow, &size);
+    int err = errno;
+    close(fd);
+    if (re != 0)
+    {
+        // EINVAL: not larger than now by a whole segment, EFBIG: past the block number range,
+        // ENOSPC: grown too many times
+        cout << "Grow failed: " << strerror(err) << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include "utils.h"
+
+// ./efsstat <mountpoint>
+// prints the block cache hits and misses of a mounted volume so far, the numbers it
+// otherwise reports only when it is unmounted
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        cout << "Usage: " << argv[0] << " <mountpoint>" << endl;
+        return 1;
+    }
+    int fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        cout << "Cannot open " << argv[1] << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    CacheStats stats;
+    int re = ioctl(fd, efs_ioc_cache_stats, &stats);
+    int err = errno;
+    close(fd);
+    if (re != 0)
+    {
+        // ENOTTY: not an easyfs mount
+        cout << "Cannot read the cache statistics: " << strerror(err) << endl;
+        return 1;
+    }
+    const char *pool_names[2] = {"metadata", "data"};
+    for (u32 pool = 0; pool < 2; pool++)
+        cout << pool_names[pool] << " cache: " << stats.hits[pool] << " hits, " << stats.misses[pool] << " misses" << endl;
+    return 0;
+}
@@ -1,470 +1,996 @@
-#include "layout.h"
-
-void SuperBlock::initialize(u32 _total_blocks, u32 _inode_bitmap_blocks, u32 _inode_area_blocks, u32 _data_bitmap_blocks, u32 _data_area_blocks)
-{
-    magic = efs_magic;
-    total_blocks = _total_blocks;
-    inode_bitmap_blocks = _inode_bitmap_blocks;
-    inode_area_blocks = _inode_area_blocks;
-    data_bitmap_blocks = _data_bitmap_blocks;
-    data_area_blocks = _data_area_blocks;
-}
-bool SuperBlock::is_valid() const
-{
-    return magic == efs_magic;
-}
-
-void DiskInode::initialize(DiskInodeType _type)
-{
-    size = 0;
-    memset(direct, 0, inode_direct_count * sizeof(u32));
-    indirect1 = 0;
-    indirect2 = 0;
-    nlink = 1;
-    type = _type;
-    dirent_num = 0;
-    uid = gid = 0;
-    mode = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH;
-    timespec time_s;
-    clock_gettime(CLOCK_REALTIME, &time_s);
-    atime = ctime = time_s.tv_sec;
-}
-
-u32 DiskInode::get_dirent_num() const
-{
-    return dirent_num;
-}
-void DiskInode::add_dirent_num()
-{
-    dirent_num++;
-}
-void DiskInode::sub_dirent_num()
-{
-    dirent_num--;
-}
-
-i64 DiskInode::get_atime() const
-{
-    return atime;
-}
-void DiskInode::refresh_atime()
-{
-    timespec time_s;
-    clock_gettime(CLOCK_REALTIME, &time_s);
-    atime = time_s.tv_sec;
-}
-i64 DiskInode::get_ctime() const
-{
-    return ctime;
-}
-void DiskInode::refresh_ctime()
-{
-    timespec time_s;
-    clock_gettime(CLOCK_REALTIME, &time_s);
-    ctime = time_s.tv_sec;
-}
-
-void DiskInode::set_atime(i64 time)
-{
-    atime = time;
-}
-void DiskInode::set_ctime(i64 time)
-{
-    ctime = time;
-}
-u32 DiskInode::get_uid() const
-{
-    return uid;
-}
-void DiskInode::set_uid(u32 _uid)
-{
-    uid = _uid;
-}
-u32 DiskInode::get_gid() const
-{
-    return gid;
-}
-void DiskInode::set_gid(u32 _gid)
-{
-    gid = _gid;
-}
-u32 DiskInode::get_mode() const
-{
-    return mode;
-}
-void DiskInode::set_mode(u32 _mode)
-{
-    mode = _mode;
-}
-
-u32 DiskInode::get_size() const
-{
-    return size;
-}
-
-u32 DiskInode::get_nlink() const
-{
-    return nlink;
-}
-void DiskInode::add_nlink()
-{
-    nlink++;
-}
-void DiskInode::sub_nlink()
-{
-    nlink--;
-}
-
-bool DiskInode::is_dir() const
-{
-    return type == DiskInodeType::Directory;
-}
-bool DiskInode::is_file() const
-{
-    return type == DiskInodeType::File;
-}
-u32 DiskInode::data_blocks() const
-{
-    return _data_blocks(size);
-}
-u32 DiskInode::_data_blocks(u32 _size) const
-{
-    return (_size + block_sz - 1) / block_sz;
-}
-u32 DiskInode::total_blocks(u32 _size) const
-{
-    u32 n_data_blocks = _data_blocks(_size);
-    u32 total = n_data_blocks;
-    if (n_data_blocks > inode_direct_count)
-    {
-        total += 1;
-    }
-    if (n_data_blocks > indirect1_bound)
-    {
-        total += 1;
-        total += (n_data_blocks - indirect1_bound + inode_indirect1_count - 1) / inode_indirect1_count;
-    }
-    return total;
-}
-u32 DiskInode::blocks_num_needed(u32 new_size)
-{
-    assert(new_size > size);
-    return total_blocks(new_size) - total_blocks(size);
-}
-u32 DiskInode::get_block_id(u32 inner_id, shared_ptr<BlockDevice> device) const
-{
-    if (inner_id < inode_direct_count)
-    {
-        return direct[inner_id];
-    }
-    else if (inner_id < indirect1_bound)
-    {
-        return BLOCK_CACHE_MANAGER
-            .get_block_cache(indirect1, device, -1)
-            .get()
-            ->read<IndirectBlock, u32>(0, [inner_id](const IndirectBlock &indirect_block) -> u32
-                                       { return indirect_block.data[inner_id - inode_direct_count]; });
-    }
-    else if (inner_id < indirect2_bound)
-    {
-        u32 last = inner_id - indirect1_bound;
-        u32 _indirect1 = BLOCK_CACHE_MANAGER
-                             .get_block_cache(indirect2, device, -1)
-                             .get()
-                             ->read<IndirectBlock, u32>(0, [last](const IndirectBlock &indirect_block) -> u32
-                                                        { return indirect_block.data[last / inode_indirect1_count]; });
-        return BLOCK_CACHE_MANAGER
-            .get_block_cache(_indirect1, device, -1)
-            .get()
-            ->read<IndirectBlock, u32>(0, [last](const IndirectBlock &indirect_block) -> u32
-                                       { return indirect_block.data[last % inode_indirect1_count]; });
-    }
-    return 0;
-}
-bool DiskInode::increase_size(u32 new_size, vector<u32> new_blocks, shared_ptr<BlockDevice> device)
-{
-    assert(new_size <= indirect2_bound * block_sz);
-    u32 current_blocks = data_blocks();
-    size = new_size;
-    u32 total_blocks = data_blocks();
-    auto iter = new_blocks.begin();
-    while (current_blocks < min(total_blocks, inode_direct_count))
-    {
-        direct[current_blocks] = *iter;
-        iter++;
-        current_blocks++;
-    }
-    if (total_blocks > inode_direct_count)
-    {
-        if (current_blocks == inode_direct_count)
-        {
-            indirect1 = *iter;
-            iter++;
-        }
-        current_blocks -= inode_direct_count;
-        total_blocks -= inode_direct_count;
-    }
-    else
-    {
-        return true;
-    }
-    BLOCK_CACHE_MANAGER
-        .get_block_cache(indirect1, device, -1)
-        .get()
-        ->modify_and_sync<IndirectBlock, u32>(0, [&current_blocks, total_blocks, &iter](IndirectBlock &indirect_block) -> u32
-                                              {
-                                                  while (current_blocks < min(total_blocks, inode_indirect1_count))
-                                                  {
-                                                      indirect_block.data[current_blocks] = *iter;
-                                                      iter++;
-                                                      current_blocks++;
-                                                  }
-                                                  return 0;
-                                              });
-    if (total_blocks > inode_indirect1_count)
-    {
-        if (current_blocks == inode_indirect1_count)
-        {
-            indirect2 = *iter;
-            iter++;
-        }
-        current_blocks -= inode_indirect1_count;
-        total_blocks -= inode_indirect1_count;
-    }
-    else
-    {
-        return true;
-    }
-    u32 a0 = current_blocks / inode_indirect1_count;
-    u32 b0 = current_blocks % inode_indirect1_count;
-    u32 a1 = total_blocks / inode_indirect1_count;
-    u32 b1 = total_blocks % inode_indirect1_count;
-    BLOCK_CACHE_MANAGER
-        .get_block_cache(indirect2, device, -1)
-        .get()
-        ->modify_and_sync<IndirectBlock, u32>(0, [&a0, &b0, a1, b1, total_blocks, &iter, device](IndirectBlock &indirect2_block) -> u32
-                                              {
-                                                  while ((a0 < a1) || (a0 == a1 && b0 < b1))
-                                                  {
-                                                      if (b0 == 0)
-                                                      {
-                                                          indirect2_block.data[a0] = *iter;
-                                                          iter++;
-                                                      }
-                                                      BLOCK_CACHE_MANAGER
-                                                          .get_block_cache(indirect2_block.data[a0], device, -1)
-                                                          .get()
-                                                          ->modify_and_sync<IndirectBlock, u32>(0, [b0, &iter](IndirectBlock &indirect1_block) -> u32
-                                                                                                {
-                                                                                                    indirect1_block.data[b0] = *iter;
-                                                                                                    iter++;
-                                                                                                    return 0;
-                                                                                                });
-                                                      b0++;
-                                                      if (b0 == inode_indirect1_count)
-                                                      {
-                                                          b0 = 0;
-                                                          a0++;
-                                                      }
-                                                  }
-                                                  return 0;
-                                              });
-    return true;
-}
-vector<u32> DiskInode::clear_size(shared_ptr<BlockDevice> device)
-{
-    vector<u32> v;
-    u32 n_data_blocks = data_blocks();
-    size = 0;
-    u32 current_blocks = 0;
-    while (current_blocks < min(n_data_blocks, inode_direct_count))
-    {
-        v.push_back(direct[current_blocks]);
-        direct[current_blocks] = 0;
-        current_blocks++;
-    }
-    if (n_data_blocks > inode_direct_count)
-    {
-        v.push_back(indirect1);
-        n_data_blocks -= inode_direct_count;
-        current_blocks = 0;
-    }
-    else
-    {
-        return v;
-    }
-    BLOCK_CACHE_MANAGER
-        .get_block_cache(indirect1, device, -1)
-        .get()
-        ->read<IndirectBlock, u32>(0, [&current_blocks, n_data_blocks, &v](const IndirectBlock &indirect_block) -> u32
-                                   {
-                                       while (current_blocks < min(n_data_blocks, inode_indirect1_count))
-                                       {
-                                           v.push_back(indirect_block.data[current_blocks]);
-                                           current_blocks++;
-                                       }
-                                       return 0;
-                                   });
-    indirect1 = 0;
-    if (n_data_blocks > inode_indirect1_count)
-    {
-        v.push_back(indirect2);
-        n_data_blocks -= inode_indirect1_count;
-    }
-    else
-    {
-        return v;
-    }
-    u32 a1 = n_data_blocks / inode_indirect1_count;
-    u32 b1 = n_data_blocks % inode_indirect1_count;
-    BLOCK_CACHE_MANAGER
-        .get_block_cache(indirect2, device, -1)
-        .get()
-        ->read<IndirectBlock, u32>(0, [a1, b1, n_data_blocks, &v, device](const IndirectBlock &indirect2_block) -> u32
-                                   {
-                                       u32 a0 = 0;
-                                       u32 b0 = 0;
-                                       while ((a0 < a1) || (a0 == a1 && b0 < b1))
-                                       {
-                                           if (b0 == 0)
-                                           {
-                                               v.push_back(indirect2_block.data[a0]);
-                                           }
-                                           BLOCK_CACHE_MANAGER
-                                               .get_block_cache(indirect2_block.data[a0], device, -1)
-                                               .get()
-                                               ->read<IndirectBlock, u32>(0, [b0, &v](const IndirectBlock &indirect1_block) -> u32
-                                                                          {
-                                                                              v.push_back(indirect1_block.data[b0]);
-                                                                              return 0;
-                                                                          });
-                                           b0++;
-                                           if (b0 == inode_indirect1_count)
-                                           {
-                                               b0 = 0;
-                                               a0++;
-                                           }
-                                       }
-                                       return 0;
-                                   });
-    indirect2 = 0;
-    return v;
-}
-u32 DiskInode::read_at(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id)
-{
-    u32 start = offset;
-    u32 end = min(offset + _size, size);
-    if (start >= end)
-    {
-        return 0;
-    }
-    u32 start_block = start / block_sz;
-    u32 read_size = 0;
-    while (1)
-    {
-        u32 end_current_block = min((start / block_sz + 1) * block_sz, end);
-        u32 block_read_size = end_current_block - start;
-        u8 *dst = buf + read_size;
-        BLOCK_CACHE_MANAGER
-            .get_block_cache(get_block_id(start_block, device), device, inode_id)
-            .get()
-            ->read<Block, u32>(0, [dst, start, block_read_size](const Block &data_block) -> u32
-                               {
-                                   memcpy(dst, data_block.data + start % block_sz, block_read_size);
-                                   return 0;
-                               });
-        read_size += block_read_size;
-        if (end_current_block == end)
-        {
-            break;
-        }
-        start_block += 1;
-        start = end_current_block;
-    }
-    refresh_atime();
-    return read_size;
-}
-u32 DiskInode::write_at(u32 offset, const u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id)
-{
-    u32 start = offset;
-    u32 end = min(offset + _size, size);
-    assert(start <= end);
-    u32 start_block = start / block_sz;
-    u32 write_size = 0;
-    while (1)
-    {
-        u32 end_current_block = min((start / block_sz + 1) * block_sz, end);
-        u32 block_write_size = end_current_block - start;
-        const u8 *src = buf + write_size;
-        if (inode_id == -1)
-            BLOCK_CACHE_MANAGER
-                .get_block_cache(get_block_id(start_block, device), device, inode_id)
-                .get()
-                ->modify_and_sync<Block, u32>(0, [src, start, block_write_size](Block &data_block) -> u32
-                                              {
-                                                  memcpy(data_block.data + start % block_sz, src, block_write_size);
-                                                  return 0;
-                                              });
-        else
-            BLOCK_CACHE_MANAGER
-                .get_block_cache(get_block_id(start_block, device), device, inode_id)
-                .get()
-                ->modify<Block, u32>(0, [src, start, block_write_size](Block &data_block) -> u32
-                                     {
-                                         memcpy(data_block.data + start % block_sz, src, block_write_size);
-                                         return 0;
-                                     });
-        write_size += block_write_size;
-        if (end_current_block == end)
-        {
-            break;
-        }
-        start_block += 1;
-        start = end_current_block;
-    }
-    refresh_ctime();
-    return write_size;
-}
-
-bool DiskInode::permit_r(u32 _uid, u32 _gid) const
-{
-    return have_r_permission(mode, uid, gid, _uid, _gid);
-}
-bool DiskInode::permit_w(u32 _uid, u32 _gid) const
-{
-    return have_w_permission(mode, uid, gid, _uid, _gid);
-}
-bool DiskInode::permit_x(u32 _uid, u32 _gid) const
-{
-    return have_x_permission(mode, uid, gid, _uid, _gid);
-}
-
-DirEntry::DirEntry()
-{
-    memset(name, 0, name_length_limit + 1);
-    inode_number = 0;
-}
-DirEntry::DirEntry(string _name, u32 _inode_number)
-{
-    u32 length = _name.length();
-    assert(length <= name_length_limit);
-    memcpy(name, _name.c_str(), length);
-    name[length] = 0;
-    inode_number = _inode_number;
-}
-string DirEntry::get_name()
-{
-    return string((char *)name);
-}
-u32 DirEntry::get_inode_number()
-{
-    return inode_number;
-}
-const u8 *DirEntry::as_bytes()
-{
-    return name;
-}
-u8 *DirEntry::as_bytes_mut()
-{
-    return name;
+#include "layout.h"
+
+void SuperBlock::initialize(u32 _total_blocks, u32 _inode_bitmap_blocks, u32 _inode_area_blocks, u32 _data_bitmap_blocks, u32 _data_area_blocks, u32 _stripe_count, u32 _stripe_unit, CipherType _cipher)
+{
+    magic = efs_magic;
+    total_blocks = _total_blocks;
+    inode_bitmap_blocks = _inode_bitmap_blocks;
+    inode_area_blocks = _inode_area_blocks;
+    data_bitmap_blocks = _data_bitmap_blocks;
+    data_area_blocks = _data_area_blocks;
+    stripe_count = _stripe_count;
+    stripe_unit = _stripe_unit;
+    cipher = _cipher;
+    refcount_start = 0;
+    refcount_blocks = 0;
+    block_size = block_sz;
+    segment_count = 0;
+    blocks_counted = 1;
+}
+bool SuperBlock::is_valid() const
+{
+    return magic == efs_magic_grown || magic == efs_magic || magic == efs_magic_v3 || magic == efs_magic_v2 || magic == efs_magic_v1;
+}
+bool SuperBlock::is_current() const
+{
+    return magic == efs_magic || magic == efs_magic_grown;
+}
+// an older volume takes the current magic on its first mount, so that binaries
+// which cannot read inline files or shared blocks refuse it from then on; it has
+// no reference count table until the mount finds room for one
+void SuperBlock::upgrade()
+{
+    stripe_count = get_stripe_count();
+    stripe_unit = get_stripe_unit();
+    cipher = get_cipher();
+    block_size = get_block_size();
+    refcount_start = 0;
+    refcount_blocks = 0;
+    magic = efs_magic;
+}
+// volumes from before the geometry was recorded are striped block by block over device_num files
+u32 SuperBlock::get_stripe_count() const
+{
+    return magic == efs_magic_v1 ? device_num : stripe_count;
+}
+u32 SuperBlock::get_stripe_unit() const
+{
+    return magic == efs_magic_v1 ? 1 : stripe_unit;
+}
+CipherType SuperBlock::get_cipher() const
+{
+    return magic == efs_magic_v1 ? Aes128 : cipher;
+}
+u32 SuperBlock::get_refcount_start() const
+{
+    return refcount_start;
+}
+u32 SuperBlock::get_refcount_blocks() const
+{
+    return refcount_blocks;
+}
+void SuperBlock::set_refcount(u32 _refcount_start, u32 _refcount_blocks)
+{
+    refcount_start = _refcount_start;
+    refcount_blocks = _refcount_blocks;
+}
+// the rest of block 0 was zero before the block size was recorded, and blocks were block_sz then
+u32 SuperBlock::get_block_size() const
+{
+    return block_size == 0 ? block_sz : block_size;
+}
+// zero on a volume never grown, the rest of block 0 was zero before
+u32 SuperBlock::get_segment_count() const
+{
+    return magic == efs_magic_grown ? segment_count : 0;
+}
+GrownSegment SuperBlock::get_segment(u32 i) const
+{
+    return segments[i];
+}
+// zero on a volume whose files were made before they kept a block count
+bool SuperBlock::has_block_counts() const
+{
+    return blocks_counted != 0;
+}
+void SuperBlock::set_block_counts()
+{
+    blocks_counted = 1;
+}
+void SuperBlock::add_segment(GrownSegment segment, u32 _total_blocks)
+{
+    segment_count = get_segment_count();
+    segments[segment_count++] = segment;
+    total_blocks = _total_blocks;
+    magic = efs_magic_grown;
+}
+
+void DiskInode::initialize(DiskInodeType _type)
+{
+    size = 0;
+    memset(direct, 0, inode_direct_count * sizeof(u32));
+    indirect1 = 0;
+    indirect2 = 0;
+    nlink = 1;
+    // new files start inline, directories always use blocks
+    type = _type == DiskInodeType::File ? (DiskInodeType)(_type | inode_inline_flag) : _type;
+    dirent_num = 0;
+    uid = gid = 0;
+    mode = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH;
+    timespec time_s;
+    clock_gettime(CLOCK_REALTIME, &time_s);
+    atime = ctime = time_s.tv_sec;
+}
+
+u32 DiskInode::get_dirent_num() const
+{
+    assert(is_dir());
+    return dirent_num;
+}
+void DiskInode::add_dirent_num()
+{
+    assert(is_dir());
+    dirent_num++;
+}
+void DiskInode::sub_dirent_num()
+{
+    assert(is_dir());
+    dirent_num--;
+}
+
+i64 DiskInode::get_atime() const
+{
+    return atime;
+}
+void DiskInode::refresh_atime()
+{
+    timespec time_s;
+    clock_gettime(CLOCK_REALTIME, &time_s);
+    atime = time_s.tv_sec;
+}
+i64 DiskInode::get_ctime() const
+{
+    return ctime;
+}
+void DiskInode::refresh_ctime()
+{
+    timespec time_s;
+    clock_gettime(CLOCK_REALTIME, &time_s);
+    ctime = time_s.tv_sec;
+}
+
+void DiskInode::set_atime(i64 time)
+{
+    atime = time;
+}
+void DiskInode::set_ctime(i64 time)
+{
+    ctime = time;
+}
+u32 DiskInode::get_uid() const
+{
+    return uid;
+}
+void DiskInode::set_uid(u32 _uid)
+{
+    uid = _uid;
+}
+u32 DiskInode::get_gid() const
+{
+    return gid;
+}
+void DiskInode::set_gid(u32 _gid)
+{
+    gid = _gid;
+}
+u32 DiskInode::get_mode() const
+{
+    return mode;
+}
+void DiskInode::set_mode(u32 _mode)
+{
+    mode = _mode;
+}
+
+u32 DiskInode::get_size() const
+{
+    return size;
+}
+
+u32 DiskInode::get_nlink() const
+{
+    return nlink;
+}
+void DiskInode::add_nlink()
+{
+    nlink++;
+}
+void DiskInode::sub_nlink()
+{
+    nlink--;
+}
+
+bool DiskInode::is_dir() const
+{
+    return (type & ~(inode_inline_flag | inode_shared_flag | inode_readonly_flag)) == DiskInodeType::Directory;
+}
+bool DiskInode::is_file() const
+{
+    return (type & ~(inode_inline_flag | inode_shared_flag | inode_readonly_flag)) == DiskInodeType::File;
+}
+bool DiskInode::is_inline() const
+{
+    return (type & inode_inline_flag) != 0;
+}
+bool DiskInode::is_shared() const
+{
+    return (type & inode_shared_flag) != 0;
+}
+void DiskInode::set_shared()
+{
+    type = (DiskInodeType)(type | inode_shared_flag);
+}
+bool DiskInode::is_readonly() const
+{
+    return (type & inode_readonly_flag) != 0;
+}
+void DiskInode::set_readonly()
+{
+    type = (DiskInodeType)(type | inode_readonly_flag);
+}
+// where the inline bytes start within the inode record
+u32 DiskInode::inline_offset() const
+{
+    return (const u8 *)direct - (const u8 *)this;
+}
+void DiskInode::increase_inline(u32 new_size)
+{
+    assert(is_inline() && new_size <= inline_data_max);
+    size = max(size, new_size);
+}
+// copy the inline bytes out and turn the space back into an empty block map
+void DiskInode::end_inline(u8 *data)
+{
+    assert(is_inline());
+    memcpy(data, direct, size);
+    memset(direct, 0, inline_data_max);
+    type = (DiskInodeType)(type & ~inode_inline_flag);
+    size = 0;
+}
+u32 DiskInode::data_blocks() const
+{
+    return is_inline() ? 0 : _data_blocks(size);
+}
+u32 DiskInode::_data_blocks(u32 _size) const
+{
+    return (_size + block_sz - 1) / block_sz;
+}
+u32 DiskInode::total_blocks(u32 _size) const
+{
+    u32 n_data_blocks = _data_blocks(_size);
+    u32 total = n_data_blocks;
+    if (n_data_blocks > inode_direct_count)
+    {
+        total += 1;
+    }
+    if (n_data_blocks > indirect1_bound)
+    {
+        total += 1;
+        total += (n_data_blocks - indirect1_bound + inode_indirect1_count - 1) / inode_indirect1_count;
+    }
+    return total;
+}
+// 0 is the super block, so in a block map it marks a hole
+u32 DiskInode::get_block_entry(u32 inner_id, shared_ptr<BlockDevice> device) const
+{
+    if (inner_id < inode_direct_count)
+    {
+        return direct[inner_id];
+    }
+    else if (inner_id < indirect1_bound)
+    {
+        if (indirect1 == 0)
+            return 0;
+        return BLOCK_CACHE_MANAGER
+            .get_block_cache(indirect1, device, -1)
+            .get()
+            ->peek<u32>((inner_id - inode_direct_count) * sizeof(u32));
+    }
+    else if (inner_id < indirect2_bound)
+    {
+        if (indirect2 == 0)
+            return 0;
+        u32 last = inner_id - indirect1_bound;
+        u32 _indirect1 = BLOCK_CACHE_MANAGER
+                             .get_block_cache(indirect2, device, -1)
+                             .get()
+                             ->peek<u32>(last / inode_indirect1_count * sizeof(u32));
+        if (_indirect1 == 0)
+            return 0;
+        return BLOCK_CACHE_MANAGER
+            .get_block_cache(_indirect1, device, -1)
+            .get()
+            ->peek<u32>(last % inode_indirect1_count * sizeof(u32));
+    }
+    return 0;
+}
+// the block to read, 0 for a hole or a block that was never written
+u32 DiskInode::get_block_id(u32 inner_id, shared_ptr<BlockDevice> device) const
+{
+    u32 entry = get_block_entry(inner_id, device);
+    return (entry & block_unwritten_flag) ? 0 : entry;
+}
+// point a mapped block elsewhere; the index blocks above it are already there
+void DiskInode::set_block_entry(u32 inner_id, u32 block_id, shared_ptr<BlockDevice> device)
+{
+    if (inner_id < inode_direct_count)
+    {
+        direct[inner_id] = block_id;
+        return;
+    }
+    u32 index_block = indirect1;
+    u32 index = inner_id - inode_direct_count;
+    if (inner_id >= indirect1_bound)
+    {
+        u32 last = inner_id - indirect1_bound;
+        index_block = BLOCK_CACHE_MANAGER
+                          .get_block_cache(indirect2, device, -1)
+                          .get()
+                          ->peek<u32>(last / inode_indirect1_count * sizeof(u32));
+        index = last % inode_indirect1_count;
+    }
+    assert(index_block != 0);
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(index_block, device, -1)
+        .get()
+        ->modify_and_sync<IndirectBlock, u32>(0, [index, block_id](IndirectBlock &indirect_block) -> u32
+                                              {
+                                                  indirect_block.data[index] = block_id;
+                                                  return 0;
+                                              });
+}
+vector<u32> DiskInode::get_block_ids(u32 inner_start, u32 inner_end, shared_ptr<BlockDevice> device) const
+{
+    vector<u32> block_ids;
+    for (u32 inner_id = inner_start; inner_id < inner_end; inner_id++)
+        block_ids.push_back(get_block_id(inner_id, device));
+    return block_ids;
+}
+// the blocks past the old end are holes until fill_holes gives them storage
+void DiskInode::increase_size(u32 new_size)
+{
+    assert(new_size <= indirect2_bound * block_sz);
+    size = max(size, new_size);
+}
+static u32 alloc_index_block(shared_ptr<BlockDevice> device, function<u32()> &alloc)
+{
+    u32 block_id = alloc();
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(block_id, device, -1, false)
+        .get()
+        ->modify<IndirectBlock, u32>(0, [](IndirectBlock &indirect_block) -> u32
+                                     {
+                                         memset(indirect_block.data, 0, block_sz);
+                                         return 0;
+                                     });
+    return block_id;
+}
+// give each hole among the blocks covering [start, end) a data block; a block the range
+// covers only in part is zeroed first, a whole one is about to be overwritten anyway.
+// An unwritten block is taken over the same way. With unwritten set, the holes are
+// only reserved: they get blocks marked unwritten and nothing is zeroed. Index blocks
+// come from alloc_index when it is given, and alloc may leave a hole by returning 0
+void DiskInode::fill_holes(u32 start, u32 end, shared_ptr<BlockDevice> device, i32 inode_id, function<u32()> alloc, bool unwritten, function<u32()> alloc_index)
+{
+    if (start >= end || is_inline())
+        return;
+    u32 inner_start = start / block_sz;
+    u32 inner_end = (end - 1) / block_sz + 1;
+    vector<u32> block_ids = get_block_ids(inner_start, inner_end, device);
+    auto has_hole = [&block_ids, inner_start](u32 from, u32 to) -> bool
+    {
+        return find(block_ids.begin() + (from - inner_start), block_ids.begin() + (to - inner_start), 0) != block_ids.begin() + (to - inner_start);
+    };
+    if (!has_hole(inner_start, inner_end))
+        return;
+    u32 allocated = 0;
+    alloc = [&allocated, take = alloc]() -> u32
+    {
+        u32 block_id = take();
+        if (block_id != 0)
+            allocated++;
+        return block_id;
+    };
+    if (alloc_index == nullptr)
+        alloc_index = alloc;
+    else
+        alloc_index = [&allocated, take = alloc_index]() -> u32
+        {
+            allocated++;
+            return take();
+        };
+    auto new_data = [start, end, device, inode_id, &alloc, unwritten](u32 inner_id, u32 entry) -> u32
+    {
+        if (unwritten)
+            return entry != 0 ? entry : alloc() | block_unwritten_flag;
+        u32 block_id = entry != 0 ? entry & ~block_unwritten_flag : alloc();
+        if (block_id != 0 && (inner_id * block_sz < start || (inner_id + 1) * block_sz > end))
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(block_id, device, inode_id, false)
+                .get()
+                ->modify<Block, u32>(0, [](Block &data_block) -> u32
+                                     {
+                                         memset(data_block.data, 0, block_sz);
+                                         return 0;
+                                     });
+        return block_id;
+    };
+    u32 inner = inner_start;
+    // fills the entries [inner, chunk_end) of the index block whose first entry is base
+    auto fill_index = [&inner, &new_data, &has_hole, device](u32 index_block, u32 base, u32 chunk_end)
+    {
+        if (!has_hole(inner, chunk_end))
+        {
+            inner = chunk_end;
+            return;
+        }
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(index_block, device, -1)
+            .get()
+            ->modify_and_sync<IndirectBlock, u32>(0, [&inner, &new_data, base, chunk_end](IndirectBlock &indirect_block) -> u32
+                                                  {
+                                                      for (; inner < chunk_end; inner++)
+                                                      {
+                                                          u32 &entry = indirect_block.data[inner - base];
+                                                          if (entry == 0 || (entry & block_unwritten_flag))
+                                                              entry = new_data(inner, entry);
+                                                      }
+                                                      return 0;
+                                                  });
+    };
+    for (; inner < min(inner_end, direct_bound); inner++)
+    {
+        if (direct[inner] == 0 || (direct[inner] & block_unwritten_flag))
+            direct[inner] = new_data(inner, direct[inner]);
+    }
+    if (inner < inner_end && inner < indirect1_bound)
+    {
+        if (indirect1 == 0)
+            indirect1 = alloc_index_block(device, alloc_index);
+        fill_index(indirect1, direct_bound, min(inner_end, indirect1_bound));
+    }
+    while (inner < inner_end)
+    {
+        if (indirect2 == 0)
+            indirect2 = alloc_index_block(device, alloc_index);
+        u32 a0 = (inner - indirect1_bound) / inode_indirect1_count;
+        u32 base = indirect1_bound + a0 * inode_indirect1_count;
+        u32 chunk_end = min(inner_end, base + inode_indirect1_count);
+        if (!has_hole(inner, chunk_end))
+        {
+            inner = chunk_end;
+            continue;
+        }
+        u32 _indirect1 = BLOCK_CACHE_MANAGER
+                             .get_block_cache(indirect2, device, -1)
+                             .get()
+                             ->modify_and_sync<IndirectBlock, u32>(0, [a0, device, &alloc_index](IndirectBlock &indirect2_block) -> u32
+                                                                   {
+                                                                       if (indirect2_block.data[a0] == 0)
+                                                                           indirect2_block.data[a0] = alloc_index_block(device, alloc_index);
+                                                                       return indirect2_block.data[a0];
+                                                                   });
+        fill_index(_indirect1, base, chunk_end);
+    }
+    if (is_file())
+        block_count += allocated;
+}
+// unmap the blocks [inner_start, inner_end) and return them, along with any index
+// block that is left without entries
+vector<u32> DiskInode::release_blocks(u32 inner_start, u32 inner_end, shared_ptr<BlockDevice> device)
+{
+    vector<u32> v;
+    u32 inner = inner_start;
+    for (; inner < min(inner_end, direct_bound); inner++)
+    {
+        if (direct[inner] != 0)
+        {
+            v.push_back(direct[inner] & ~block_unwritten_flag);
+            direct[inner] = 0;
+        }
+    }
+    // clears the entries [inner, chunk_end) of the index block whose first entry is base,
+    // true if it has none left
+    auto release_index = [&inner, &v, device](u32 index_block, u32 base, u32 chunk_end) -> bool
+    {
+        return BLOCK_CACHE_MANAGER
+            .get_block_cache(index_block, device, -1)
+            .get()
+            ->modify_and_sync<IndirectBlock, bool>(0, [&inner, &v, base, chunk_end](IndirectBlock &indirect_block) -> bool
+                                                   {
+                                                       for (; inner < chunk_end; inner++)
+                                                       {
+                                                           if (indirect_block.data[inner - base] != 0)
+                                                           {
+                                                               v.push_back(indirect_block.data[inner - base] & ~block_unwritten_flag);
+                                                               indirect_block.data[inner - base] = 0;
+                                                           }
+                                                       }
+                                                       for (u32 i = 0; i < inode_indirect1_count; i++)
+                                                       {
+                                                           if (indirect_block.data[i] != 0)
+                                                               return false;
+                                                       }
+                                                       return true;
+                                                   });
+    };
+    if (inner < inner_end && inner < indirect1_bound)
+    {
+        u32 chunk_end = min(inner_end, indirect1_bound);
+        if (indirect1 != 0 && release_index(indirect1, direct_bound, chunk_end))
+        {
+            v.push_back(indirect1);
+            indirect1 = 0;
+        }
+        inner = chunk_end;
+    }
+    if (inner < inner_end && indirect2 != 0)
+    {
+        bool empty = BLOCK_CACHE_MANAGER
+                         .get_block_cache(indirect2, device, -1)
+                         .get()
+                         ->modify_and_sync<IndirectBlock, bool>(0, [&inner, inner_end, &v, &release_index](IndirectBlock &indirect2_block) -> bool
+                                                                {
+                                                                    while (inner < inner_end)
+                                                                    {
+                                                                        u32 a0 = (inner - indirect1_bound) / inode_indirect1_count;
+                                                                        u32 base = indirect1_bound + a0 * inode_indirect1_count;
+                                                                        u32 chunk_end = min(inner_end, base + inode_indirect1_count);
+                                                                        if (indirect2_block.data[a0] != 0 && release_index(indirect2_block.data[a0], base, chunk_end))
+                                                                        {
+                                                                            v.push_back(indirect2_block.data[a0]);
+                                                                            indirect2_block.data[a0] = 0;
+                                                                        }
+                                                                        inner = chunk_end;
+                                                                    }
+                                                                    for (u32 i = 0; i < inode_indirect1_count; i++)
+                                                                    {
+                                                                        if (indirect2_block.data[i] != 0)
+                                                                            return false;
+                                                                    }
+                                                                    return true;
+                                                                });
+        if (empty)
+        {
+            v.push_back(indirect2);
+            indirect2 = 0;
+        }
+    }
+    if (is_file())
+        block_count -= v.size();
+    return v;
+}
+vector<u32> DiskInode::clear_size(shared_ptr<BlockDevice> device)
+{
+    vector<u32> v;
+    if (is_inline())
+    {
+        memset(direct, 0, inline_data_max);
+        size = 0;
+        return v;
+    }
+    v = release_blocks(0, data_blocks(), device);
+    size = 0;
+    return v;
+}
+// cut the file to new_size; the tail of the last block is zeroed so a later extension reads
+// zeros, and the blocks past it are returned together with the index blocks they emptied
+vector<u32> DiskInode::decrease_size(u32 new_size, shared_ptr<BlockDevice> device, i32 inode_id)
+{
+    vector<u32> v;
+    if (new_size >= size)
+        return v;
+    refresh_ctime();
+    if (is_inline())
+    {
+        memset((u8 *)direct + new_size, 0, size - new_size);
+        size = new_size;
+        return v;
+    }
+    u32 new_blocks = _data_blocks(new_size);
+    zero_range(new_size, min(size, new_blocks * block_sz), device, inode_id);
+    v = release_blocks(new_blocks, data_blocks(), device);
+    size = new_size;
+    return v;
+}
+// zero [start, end) in the blocks that hold data, a hole already reads as zeros
+void DiskInode::zero_range(u32 start, u32 end, shared_ptr<BlockDevice> device, i32 inode_id)
+{
+    while (start < end)
+    {
+        u32 end_current_block = min((start / block_sz + 1) * block_sz, end);
+        u32 block_id = get_block_id(start / block_sz, device);
+        if (block_id != 0)
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(block_id, device, inode_id)
+                .get()
+                ->modify<Block, u32>(0, [start, end_current_block](Block &data_block) -> u32
+                                     {
+                                         memset(data_block.data + start % block_sz, 0, end_current_block - start);
+                                         return 0;
+                                     });
+        start = end_current_block;
+    }
+}
+// zero [offset, offset + len) without changing the size; the whole blocks in the range
+// are unmapped and returned, so they read back as a hole
+vector<u32> DiskInode::punch_hole(u32 offset, u32 len, shared_ptr<BlockDevice> device, i32 inode_id)
+{
+    vector<u32> v;
+    u32 start = offset;
+    u32 end = min(offset + len, size);
+    if (start >= end)
+        return v;
+    refresh_ctime();
+    if (is_inline())
+    {
+        memset((u8 *)direct + start, 0, end - start);
+        return v;
+    }
+    u32 first_block = (start + block_sz - 1) / block_sz;
+    // nothing past the end of the file is ever read, so its last block goes whole
+    u32 last_block = end == size ? data_blocks() : end / block_sz;
+    if (first_block >= last_block)
+    {
+        zero_range(start, end, device, inode_id);
+        return v;
+    }
+    zero_range(start, first_block * block_sz, device, inode_id);
+    zero_range(last_block * block_sz, end, device, inode_id);
+    return release_blocks(first_block, last_block, device);
+}
+// the offset of the first data or hole at or after offset; the end of the file counts as a hole
+i64 DiskInode::seek(u32 offset, int whence, shared_ptr<BlockDevice> device) const
+{
+    if (offset >= size)
+        return -ENXIO;
+    if (is_inline())
+        return whence == SEEK_DATA ? offset : size;
+    u32 n_data_blocks = data_blocks();
+    for (u32 inner_id = offset / block_sz; inner_id < n_data_blocks; inner_id++)
+    {
+        bool hole = get_block_id(inner_id, device) == 0;
+        if (hole == (whence == SEEK_HOLE))
+            return max(offset, inner_id * block_sz);
+    }
+    return whence == SEEK_DATA ? -ENXIO : size;
+}
+u32 DiskInode::read_data(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id) const
+{
+    u32 start = offset;
+    u32 end = min(offset + _size, size);
+    if (start >= end)
+    {
+        return 0;
+    }
+    if (is_inline())
+    {
+        memcpy(buf, (const u8 *)direct + start, end - start);
+        return end - start;
+    }
+    vector<u32> block_ids = get_block_ids(start / block_sz, (end - 1) / block_sz + 1, device);
+    // fetch the blocks that are not cached from all stripes at once
+    if (block_ids.size() > 1)
+        BLOCK_CACHE_MANAGER.load(block_ids, device, inode_id);
+    u32 read_size = 0;
+    for (u32 block_id : block_ids)
+    {
+        u32 end_current_block = min((start / block_sz + 1) * block_sz, end);
+        u32 block_read_size = end_current_block - start;
+        u8 *dst = buf + read_size;
+        if (block_id == 0)
+            memset(dst, 0, block_read_size);
+        else
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(block_id, device, inode_id)
+                .get()
+                ->read<Block, u32>(0, [dst, start, block_read_size](const Block &data_block) -> u32
+                                   {
+                                       memcpy(dst, data_block.data + start % block_sz, block_read_size);
+                                       return 0;
+                                   });
+        read_size += block_read_size;
+        start = end_current_block;
+    }
+    return read_size;
+}
+// long file transfers, and those asked for with O_DIRECT, skip the cache; a mapped
+// device gains nothing from it since its cached blocks are the mapping itself
+bool DiskInode::use_stream(u32 _size, bool direct, shared_ptr<BlockDevice> device, i32 inode_id) const
+{
+    return inode_id != -1 && !is_inline() && (direct || _size >= stream_threshold) && device.get()->map_block(0) == nullptr;
+}
+// the full blocks go between buf and the device in one request, the partial
+// blocks at either end through the cache
+u32 DiskInode::read_stream(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id) const
+{
+    u32 start = offset;
+    u32 end = min(offset + _size, size);
+    if (start >= end)
+    {
+        return 0;
+    }
+    u32 first_block = (start + block_sz - 1) / block_sz;
+    u32 last_block = end / block_sz;
+    if (first_block >= last_block)
+        return read_data(offset, buf, _size, device, inode_id);
+    u32 read_size = read_data(start, buf, first_block * block_sz - start, device, inode_id);
+    vector<u32> block_ids = get_block_ids(first_block, last_block, device);
+    BLOCK_CACHE_MANAGER.read_direct(block_ids, (Block *)(buf + read_size), device);
+    read_size += (last_block - first_block) * block_sz;
+    read_size += read_data(last_block * block_sz, buf + read_size, end - last_block * block_sz, device, inode_id);
+    return read_size;
+}
+u32 DiskInode::read_at(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id, bool direct)
+{
+    if (use_stream(_size, direct, device, inode_id))
+    {
+        u32 read_size = read_stream(offset, buf, _size, device, inode_id);
+        if (read_size > 0)
+            refresh_atime();
+        return read_size;
+    }
+    if (offset < size && !is_inline())
+        BLOCK_CACHE_MANAGER.read_ahead(inode_id, offset, min(_size, size - offset), data_blocks(), [this, device](u32 inner_id) -> u32
+                                       { return get_block_id(inner_id, device); },
+                                       device);
+    u32 read_size = read_data(offset, buf, _size, device, inode_id);
+    if (read_size > 0)
+        refresh_atime();
+    return read_size;
+}
+u32 DiskInode::read_slices(u32 offset, u32 _size, vector<BlockSlice> &slices, shared_ptr<BlockDevice> device, i32 inode_id) const
+{
+    u32 start = offset;
+    u32 end = min(offset + _size, size);
+    if (start >= end)
+    {
+        return 0;
+    }
+    // inline contents are sliced out of the inode block by Inode::read_slices
+    assert(!is_inline());
+    BLOCK_CACHE_MANAGER.read_ahead(inode_id, start, end - start, data_blocks(), [this, device](u32 inner_id) -> u32
+                                   { return get_block_id(inner_id, device); },
+                                   device);
+    vector<u32> block_ids = get_block_ids(start / block_sz, (end - 1) / block_sz + 1, device);
+    if (block_ids.size() > 1)
+        BLOCK_CACHE_MANAGER.load(block_ids, device, inode_id);
+    u32 read_size = 0;
+    for (u32 block_id : block_ids)
+    {
+        u32 end_current_block = min((start / block_sz + 1) * block_sz, end);
+        u32 block_read_size = end_current_block - start;
+        // a hole is left without a block, the reader supplies the zeros
+        BlockSlice slice;
+        if (block_id != 0)
+            slice.block = BLOCK_CACHE_MANAGER.get_block_cache(block_id, device, inode_id);
+        slice.offset = start % block_sz;
+        slice.len = block_read_size;
+        slices.push_back(slice);
+        read_size += block_read_size;
+        start = end_current_block;
+    }
+    return read_size;
+}
+u32 DiskInode::write_at(u32 offset, const u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id, bool direct)
+{
+    const u8 *src = buf;
+    return write_from(
+        offset, _size, [&src](u8 *dst, u32 len)
+        {
+            memcpy(dst, src, len);
+            src += len;
+        },
+        device, inode_id, direct);
+}
+u32 DiskInode::write_from(u32 offset, u32 _size, function<void(u8 *, u32)> fill, shared_ptr<BlockDevice> device, i32 inode_id, bool direct)
+{
+    u32 start = offset;
+    u32 end = min(offset + _size, size);
+    assert(start <= end);
+    if (is_inline())
+    {
+        fill((u8 *)this->direct + start, end - start);
+        refresh_ctime();
+        return end - start;
+    }
+    u32 first_block = (start + block_sz - 1) / block_sz;
+    u32 last_block = end / block_sz;
+    if (use_stream(end - start, direct, device, inode_id) && first_block < last_block)
+    {
+        // the full blocks are filled into one staging run and written around the cache
+        u32 write_size = 0;
+        if (start < first_block * block_sz)
+            write_size += write_from(start, first_block * block_sz - start, fill, device, inode_id);
+        vector<Block> blocks(last_block - first_block);
+        fill(blocks.data()->data, blocks.size() * block_sz);
+        BLOCK_CACHE_MANAGER.write_direct(get_block_ids(first_block, last_block, device), blocks.data(), device);
+        write_size += blocks.size() * block_sz;
+        if (last_block * block_sz < end)
+            write_size += write_from(last_block * block_sz, end - last_block * block_sz, fill, device, inode_id);
+        refresh_ctime();
+        return write_size;
+    }
+    u32 start_block = start / block_sz;
+    u32 write_size = 0;
+    while (1)
+    {
+        u32 end_current_block = min((start / block_sz + 1) * block_sz, end);
+        u32 block_write_size = end_current_block - start;
+        bool load = block_write_size < block_sz;
+        if (inode_id == -1)
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(get_block_id(start_block, device), device, inode_id, load)
+                .get()
+                ->modify_and_sync<Block, u32>(0, [&fill, start, block_write_size](Block &data_block) -> u32
+                                              {
+                                                  fill(data_block.data + start % block_sz, block_write_size);
+                                                  return 0;
+                                              });
+        else
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(get_block_id(start_block, device), device, inode_id, load)
+                .get()
+                ->modify<Block, u32>(0, [&fill, start, block_write_size](Block &data_block) -> u32
+                                     {
+                                         fill(data_block.data + start % block_sz, block_write_size);
+                                         return 0;
+                                     });
+        write_size += block_write_size;
+        if (end_current_block == end)
+        {
+            break;
+        }
+        start_block += 1;
+        start = end_current_block;
+    }
+    refresh_ctime();
+    return write_size;
+}
+
+bool DiskInode::permit_r(u32 _uid, u32 _gid) const
+{
+    return have_r_permission(mode, uid, gid, _uid, _gid);
+}
+bool DiskInode::permit_w(u32 _uid, u32 _gid) const
+{
+    return have_w_permission(mode, uid, gid, _uid, _gid);
+}
+bool DiskInode::permit_x(u32 _uid, u32 _gid) const
+{
+    return have_x_permission(mode, uid, gid, _uid, _gid);
+}
+// data and index blocks actually held, which a sparse file keeps below total_blocks(size);
+// a directory never has holes
+u32 DiskInode::allocated_blocks() const
+{
+    if (is_inline())
+        return 0;
+    return is_dir() ? total_blocks(size) : block_count;
+}
+// the same by walking the block map
+u32 DiskInode::count_blocks(shared_ptr<BlockDevice> device) const
+{
+    if (is_inline())
+        return 0;
+    auto count_index = [device](u32 index_block) -> u32
+    {
+        return BLOCK_CACHE_MANAGER
+            .get_block_cache(index_block, device, -1)
+            .get()
+            ->read<IndirectBlock, u32>(0, [](const IndirectBlock &indirect_block) -> u32
+                                       { return inode_indirect1_count - count(indirect_block.data, indirect_block.data + inode_indirect1_count, 0); });
+    };
+    u32 total = inode_direct_count - count(direct, direct + inode_direct_count, 0);
+    if (indirect1 != 0)
+        total += 1 + count_index(indirect1);
+    if (indirect2 != 0)
+    {
+        vector<u32> indirect1_blocks = BLOCK_CACHE_MANAGER
+                                           .get_block_cache(indirect2, device, -1)
+                                           .get()
+                                           ->read<IndirectBlock, vector<u32>>(0, [](const IndirectBlock &indirect2_block) -> vector<u32>
+                                                                              {
+                                                                                  vector<u32> v;
+                                                                                  for (u32 i = 0; i < inode_indirect1_count; i++)
+                                                                                      if (indirect2_block.data[i] != 0)
+                                                                                          v.push_back(indirect2_block.data[i]);
+                                                                                  return v;
+                                                                              });
+        total += 1;
+        for (u32 _indirect1 : indirect1_blocks)
+            total += 1 + count_index(_indirect1);
+    }
+    return total;
+}
+void DiskInode::recount_blocks(shared_ptr<BlockDevice> device)
+{
+    assert(is_file());
+    block_count = count_blocks(device);
+}
+void DiskInode::walk_blocks(shared_ptr<BlockDevice> device, function<bool(u32, bool)> f) const
+{
+    if (is_inline())
+        return;
+    auto read_index = [device](u32 index_block) -> IndirectBlock
+    {
+        return BLOCK_CACHE_MANAGER
+            .get_block_cache(index_block, device, -1)
+            .get()
+            ->peek<IndirectBlock>(0);
+    };
+    auto walk_index = [&f, &read_index](u32 index_block) -> void
+    {
+        if (!f(index_block, true))
+            return;
+        IndirectBlock indirect_block = read_index(index_block);
+        for (u32 i = 0; i < inode_indirect1_count; i++)
+            if (indirect_block.data[i] != 0)
+                f(indirect_block.data[i] & ~block_unwritten_flag, false);
+    };
+    for (u32 i = 0; i < inode_direct_count; i++)
+        if (direct[i] != 0)
+            f(direct[i] & ~block_unwritten_flag, false);
+    if (indirect1 != 0)
+        walk_index(indirect1);
+    if (indirect2 != 0 && f(indirect2, true))
+    {
+        IndirectBlock indirect2_block = read_index(indirect2);
+        for (u32 i = 0; i < inode_indirect1_count; i++)
+            if (indirect2_block.data[i] != 0)
+                walk_index(indirect2_block.data[i]);
+    }
+}
+struct stat DiskInode::get_stat(u32 inode_id, shared_ptr<BlockDevice> device) const
+{
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_atime = atime;
+    st.st_ctime = ctime;
+    st.st_dev = 0;
+    st.st_gid = gid;
+    st.st_ino = inode_id;
+    st.st_mode = is_readonly() ? mode & ~(S_IWUSR | S_IWGRP | S_IWOTH) : mode;
+    if (is_dir())
+        st.st_mode |= S_IFDIR;
+    else
+        st.st_mode |= S_IFREG;
+    st.st_mtime = ctime;
+    st.st_nlink = nlink;
+    st.st_rdev = 0;
+    st.st_size = size;
+    st.st_uid = uid;
+    st.st_blksize = block_sz;
+    st.st_blocks = allocated_blocks();
+    return st;
+}
+
+DirEntry::DirEntry()
+{
+    memset(name, 0, name_length_limit + 1);
+    inode_number = 0;
+}
+DirEntry::DirEntry(string _name, u32 _inode_number)
+{
+    u32 length = _name.length();
+    assert(length <= name_length_limit);
+    memcpy(name, _name.c_str(), length);
+    name[length] = 0;
+    inode_number = _inode_number;
+}
+string DirEntry::get_name()
+{
+    return string((char *)name);
+}
+u32 DirEntry::get_inode_number()
+{
+    return inode_number;
+}
+const u8 *DirEntry::as_bytes()
+{
+    return name;
+}
+u8 *DirEntry::as_bytes_mut()
+{
+    return name;
 }
\ No newline at end of file
@@ -1,97 +1,169 @@
-#ifndef __LAYOUT_H_
-#define __LAYOUT_H_
-
-#include "block_cache.h"
-
-struct SuperBlock
-{
-    u32 magic;
-    u32 total_blocks;
-    u32 inode_bitmap_blocks;
-    u32 inode_area_blocks;
-    u32 data_bitmap_blocks;
-    u32 data_area_blocks;
-
-public:
-    void initialize(u32 _total_blocks, u32 _inode_bitmap_blocks, u32 _inode_area_blocks, u32 _data_bitmap_blocks, u32 _data_area_blocks);
-    bool is_valid() const;
-};
-
-struct IndirectBlock
-{
-    u32 data[block_sz / 4];
-};
-
-enum DiskInodeType : u32
-{
-    File,
-    Directory
-};
-
-class DiskInode
-{
-    u32 size;
-    u32 direct[inode_direct_count];
-    u32 indirect1;
-    u32 indirect2;
-    u32 nlink;
-    u32 uid;
-    u32 gid;
-    u32 mode;
-    DiskInodeType type;
-    u32 dirent_num;
-    i64 atime;
-    i64 ctime;
-
-public:
-    u32 get_dirent_num() const;
-    void add_dirent_num();
-    void sub_dirent_num();
-    i64 get_atime() const;
-    void set_atime(i64 time);
-    void refresh_atime();
-    i64 get_ctime() const;
-    void set_ctime(i64 time);
-    void refresh_ctime();
-    u32 get_uid() const;
-    void set_uid(u32 _uid);
-    u32 get_gid() const;
-    void set_gid(u32 _gid);
-    u32 get_mode() const;
-    void set_mode(u32 _mode);
-    u32 get_nlink() const;
-    void add_nlink();
-    void sub_nlink();
-    u32 get_size() const;
-    void initialize(DiskInodeType _type);
-    bool is_dir() const;
-    bool is_file() const;
-    u32 data_blocks() const;
-    u32 _data_blocks(u32 _size) const;
-    u32 total_blocks(u32 _size) const;
-    u32 blocks_num_needed(u32 new_size);
-    u32 get_block_id(u32 inner_id, shared_ptr<BlockDevice> device) const;
-    bool increase_size(u32 new_size, vector<u32> new_blocks, shared_ptr<BlockDevice> device);
-    vector<u32> clear_size(shared_ptr<BlockDevice> device);
-    u32 read_at(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id);
-    u32 write_at(u32 offset, const u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id);
-    bool permit_r(u32 _uid, u32 _gid) const;
-    bool permit_w(u32 _uid, u32 _gid) const;
-    bool permit_x(u32 _uid, u32 _gid) const;
-};
-
-class DirEntry
-{
-    u8 name[name_length_limit + 1];
-    u32 inode_number;
-
-public:
-    DirEntry();
-    DirEntry(string _name, u32 _inode_number);
-    string get_name();
-    u32 get_inode_number();
-    const u8 *as_bytes();
-    u8 *as_bytes_mut();
-};
-
+#ifndef __LAYOUT_H_
+#define __LAYOUT_H_
+
+#include "block_cache.h"
+
+// the blocks added by one grow: a data bitmap at start, then the data area, whose first
+// blocks are its reference count table
+struct GrownSegment
+{
+    u32 start;
+    u32 bitmap_blocks;
+    u32 data_blocks;
+};
+
+struct SuperBlock
+{
+    u32 magic;
+    u32 total_blocks;
+    u32 inode_bitmap_blocks;
+    u32 inode_area_blocks;
+    u32 data_bitmap_blocks;
+    u32 data_area_blocks;
+    u32 stripe_count;
+    u32 stripe_unit;
+    CipherType cipher;
+    u32 refcount_start;
+    u32 refcount_blocks;
+    u32 block_size;
+    u32 segment_count;
+    GrownSegment segments[max_grow_segments];
+    u32 blocks_counted;
+
+public:
+    void initialize(u32 _total_blocks, u32 _inode_bitmap_blocks, u32 _inode_area_blocks, u32 _data_bitmap_blocks, u32 _data_area_blocks, u32 _stripe_count, u32 _stripe_unit, CipherType _cipher);
+    bool is_valid() const;
+    bool is_current() const;
+    void upgrade();
+    u32 get_stripe_count() const;
+    u32 get_stripe_unit() const;
+    CipherType get_cipher() const;
+    u32 get_refcount_start() const;
+    u32 get_refcount_blocks() const;
+    void set_refcount(u32 _refcount_start, u32 _refcount_blocks);
+    u32 get_block_size() const;
+    u32 get_segment_count() const;
+    GrownSegment get_segment(u32 i) const;
+    void add_segment(GrownSegment segment, u32 _total_blocks);
+    bool has_block_counts() const;
+    void set_block_counts();
+};
+
+struct IndirectBlock
+{
+    u32 data[block_sz / 4];
+};
+
+struct BlockSlice
+{
+    BlockCacheRef block;
+    u32 offset;
+    u32 len;
+};
+
+enum DiskInodeType : u32
+{
+    File,
+    Directory
+};
+
+class DiskInode
+{
+    u32 size;
+    u32 direct[inode_direct_count];
+    u32 indirect1;
+    u32 indirect2;
+    u32 nlink;
+    u32 uid;
+    u32 gid;
+    u32 mode;
+    DiskInodeType type;
+    union
+    {
+        u32 dirent_num;
+        // data and index blocks held by a file
+        u32 block_count;
+    };
+    i64 atime;
+    i64 ctime;
+
+public:
+    u32 get_dirent_num() const;
+    void add_dirent_num();
+    void sub_dirent_num();
+    i64 get_atime() const;
+    void set_atime(i64 time);
+    void refresh_atime();
+    i64 get_ctime() const;
+    void set_ctime(i64 time);
+    void refresh_ctime();
+    u32 get_uid() const;
+    void set_uid(u32 _uid);
+    u32 get_gid() const;
+    void set_gid(u32 _gid);
+    u32 get_mode() const;
+    void set_mode(u32 _mode);
+    u32 get_nlink() const;
+    void add_nlink();
+    void sub_nlink();
+    u32 get_size() const;
+    void initialize(DiskInodeType _type);
+    bool is_dir() const;
+    bool is_file() const;
+    bool is_inline() const;
+    bool is_shared() const;
+    void set_shared();
+    bool is_readonly() const;
+    void set_readonly();
+    u32 inline_offset() const;
+    void increase_inline(u32 new_size);
+    void end_inline(u8 *data);
+    u32 data_blocks() const;
+    u32 _data_blocks(u32 _size) const;
+    u32 total_blocks(u32 _size) const;
+    u32 get_block_entry(u32 inner_id, shared_ptr<BlockDevice> device) const;
+    u32 get_block_id(u32 inner_id, shared_ptr<BlockDevice> device) const;
+    void set_block_entry(u32 inner_id, u32 block_id, shared_ptr<BlockDevice> device);
+    vector<u32> get_block_ids(u32 inner_start, u32 inner_end, shared_ptr<BlockDevice> device) const;
+    void increase_size(u32 new_size);
+    void fill_holes(u32 start, u32 end, shared_ptr<BlockDevice> device, i32 inode_id, function<u32()> alloc, bool unwritten = false, function<u32()> alloc_index = nullptr);
+    vector<u32> release_blocks(u32 inner_start, u32 inner_end, shared_ptr<BlockDevice> device);
+    vector<u32> clear_size(shared_ptr<BlockDevice> device);
+    vector<u32> decrease_size(u32 new_size, shared_ptr<BlockDevice> device, i32 inode_id);
+    void zero_range(u32 start, u32 end, shared_ptr<BlockDevice> device, i32 inode_id);
+    vector<u32> punch_hole(u32 offset, u32 len, shared_ptr<BlockDevice> device, i32 inode_id);
+    i64 seek(u32 offset, int whence, shared_ptr<BlockDevice> device) const;
+    u32 read_data(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id) const;
+    bool use_stream(u32 _size, bool direct, shared_ptr<BlockDevice> device, i32 inode_id) const;
+    u32 read_stream(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id) const;
+    u32 read_at(u32 offset, u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id, bool direct = false);
+    u32 read_slices(u32 offset, u32 _size, vector<BlockSlice> &slices, shared_ptr<BlockDevice> device, i32 inode_id) const;
+    u32 write_at(u32 offset, const u8 *buf, u32 _size, shared_ptr<BlockDevice> device, i32 inode_id, bool direct = false);
+    u32 write_from(u32 offset, u32 _size, function<void(u8 *, u32)> fill, shared_ptr<BlockDevice> device, i32 inode_id, bool direct = false);
+    bool permit_r(u32 _uid, u32 _gid) const;
+    bool permit_w(u32 _uid, u32 _gid) const;
+    bool permit_x(u32 _uid, u32 _gid) const;
+    u32 allocated_blocks() const;
+    u32 count_blocks(shared_ptr<BlockDevice> device) const;
+    void recount_blocks(shared_ptr<BlockDevice> device);
+    // every block the inode holds; f gets index = true for an index block and reads it only if
+    // f returns true
+    void walk_blocks(shared_ptr<BlockDevice> device, function<bool(u32, bool)> f) const;
+    struct stat get_stat(u32 inode_id, shared_ptr<BlockDevice> device) const;
+};
+
+class DirEntry
+{
+    u8 name[name_length_limit + 1];
+    u32 inode_number;
+
+public:
+    DirEntry();
+    DirEntry(string _name, u32 _inode_number);
+    string get_name();
+    u32 get_inode_number();
+    const u8 *as_bytes();
+    u8 *as_bytes_mut();
+};
+
 #endif
\ No newline at end of file
@@ -2,59 +2,61 @@
 
 int main(int argc, char *argv[])
 {
-  // // ./easyfs /disk 0 -f ...
-  // ./easyfs /disk 2 uid gid -f ...
-  // ./easyfs /disk 3 uid gid password -f ...
+  // ./easyfs /disk 0 -f ...
+  // ./easyfs /disk 1 password -f ...
+  // the volume is made beforehand by mkfs.efs, which records its geometry in the super block
+  // -o attr_timeout=T,entry_timeout=T,writeback_cache,max_write=N,max_read=N
+  // -o odirect to bypass the host page cache, -o huge_pages for the block cache
+  // permissions are checked against the uid/gid of each request, by the kernel as well since
+  // a cached dentry skips lookup; add -o allow_other to share the mount
   u32 arg_num = atoi(argv[2]);
-  u32 uid = 0, gid = 0;
-  if (arg_num >= 2)
-  {
-    uid = atoi(argv[3]);
-    gid = atoi(argv[4]);
-  }
   string password = "";
-  if (arg_num == 3)
+  if (arg_num == 1)
   {
-    password = argv[5];
+    password = argv[3];
   }
   arg_num++;
   for (u32 i = 2; i < argc - arg_num; i++)
   {
     argv[i] = argv[i + arg_num];
   }
+  struct fuse_args args = FUSE_ARGS_INIT((int)(argc - arg_num), argv);
+  EasyFSConfig config;
+  if (fuse_opt_parse(&args, &config, easyfs_opts, nullptr) == -1)
+    return -1;
+  fuse_opt_add_arg(&args, "-odefault_permissions");
+  if (config.huge_pages)
+    BLOCK_CACHE_MANAGER.use_huge_pages();
   shared_ptr<EasyFileSystem> efs;
   shared_ptr<BlockDevice> block_device;
-  bool create = false;
-  for (u32 i = 0; i < device_num; i++)
+  u32 stripe_count, stripe_unit, total_blocks;
+  CipherType cipher;
+  if (access((root_file + "0").c_str(), F_OK) != 0)
   {
-    FILE *fp = fopen((root_file + to_string(i)).c_str(), "r+");
-    if (fp == nullptr)
-    {
-      int fd = open((root_file + to_string(i)).c_str(), O_RDWR | O_CREAT, 0666);
-      ftruncate(fd, device_sz / device_num);
-      close(fd);
-      create = true;
-    }
+    cout << "No volume at " << root_file << "0, make one with mkfs.efs first" << endl;
+    return -1;
   }
-  block_device = shared_ptr<BlockDevice>(new BlockDevice(password));
-  if (create)
+  if (!EasyFileSystem::probe(password, stripe_count, stripe_unit, cipher, total_blocks))
   {
-    efs = EasyFileSystem::create(block_device);
+    cout << "Open failed: incorrect password or file corrupted" << endl;
+    return -1;
   }
+  // a mapping goes through the page cache, so O_DIRECT keeps plaintext volumes on the read/write path
+  if (cipher == Plain && !config.odirect)
+    block_device = shared_ptr<BlockDevice>(new MmapBlockDevice(stripe_count, stripe_unit, total_blocks));
   else
-  {
-    efs = EasyFileSystem::open(block_device);
-  }
+    block_device = shared_ptr<BlockDevice>(new BlockDevice(password, stripe_count, stripe_unit, cipher, config.odirect, total_blocks));
+  efs = EasyFileSystem::open(block_device);
 
   if (efs == nullptr)
   {
     cout << "Open failed: incorrect password or file corrupted" << endl;
     return -1;
   }
-  efs.get()->set_user(uid, gid);
-  EasyFS fs(block_device, efs, uid, gid);
+  EasyFS fs(block_device, efs, config);
 
-  int status = fs.run(argc - arg_num, argv);
+  int status = fs.run(args.argc, args.argv);
+  fuse_opt_free_args(&args);
 
   return status;
 }
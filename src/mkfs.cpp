@@ -0,0 +1,120 @@
+#include "efs.h"
+
+// ./mkfs.efs [-f] [-i inodes] [-b block_size] [-d devices] [-u stripe_unit] [-s size] [-c aes128|plain] [password]
+// formats the device files /tmp/disk0 .. /tmp/disk<devices - 1>; the size may end in K, M or G
+// and is split evenly over the devices; -f formats over an existing volume
+
+u64 parse_size(const char *arg)
+{
+    char *end;
+    u64 size = strtoull(arg, &end, 10);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        // fall through
+    case 'M':
+    case 'm':
+        size <<= 10;
+        // fall through
+    case 'K':
+    case 'k':
+        size <<= 10;
+    }
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    bool force = false;
+    u32 inode_count = default_inode_count;
+    u32 stripe_count = device_num, stripe_unit = 1;
+    u64 size = device_sz;
+    CipherType cipher = Aes128;
+    string password = "";
+    for (int i = 1; i < argc; i++)
+    {
+        string opt = argv[i];
+        if (opt == "-f")
+            force = true;
+        else if (opt.size() == 2 && opt[0] == '-' && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            if (opt == "-i")
+                inode_count = atoi(value);
+            else if (opt == "-b")
+            {
+                // the block layout is compiled in, the size is only recorded so a mismatched binary refuses the volume
+                char *end;
+                if (strtoul(value, &end, 10) != block_sz || *end != '\0')
+                {
+                    cout << "Block size " << value << " not supported, it must be " << block_sz << endl;
+                    return 1;
+                }
+            }
+            else if (opt == "-d")
+                stripe_count = atoi(value);
+            else if (opt == "-u")
+                stripe_unit = atoi(value);
+            else if (opt == "-s")
+                size = parse_size(value);
+            else if (opt == "-c" && (strcmp(value, "plain") == 0 || strcmp(value, "aes128") == 0))
+                cipher = strcmp(value, "plain") == 0 ? Plain : Aes128;
+            else
+            {
+                cout << "Unknown option " << opt << " " << value << endl;
+                return 1;
+            }
+        }
+        else
+            password = argv[i];
+    }
+    if (stripe_count == 0 || stripe_count > max_stripe_count || stripe_unit == 0)
+    {
+        cout << "Invalid stripe geometry" << endl;
+        return 1;
+    }
+    // block numbers keep their high bit for unwritten blocks
+    u64 stripe_blocks = (u64)stripe_count * stripe_unit;
+    u64 total_blocks = size / block_sz / stripe_blocks * stripe_blocks;
+    if (total_blocks == 0 || total_blocks >= block_unwritten_flag)
+    {
+        cout << "Invalid volume size" << endl;
+        return 1;
+    }
+    if (inode_count == 0)
+    {
+        cout << "Invalid inode count" << endl;
+        return 1;
+    }
+    if (!force && access((root_file + "0").c_str(), F_OK) == 0)
+    {
+        cout << root_file << "0 exists, add -f to format over it" << endl;
+        return 1;
+    }
+    for (u32 i = 0; i < stripe_count; i++)
+    {
+        int fd = open((root_file + to_string(i)).c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd < 0 || ftruncate(fd, total_blocks / stripe_count * block_sz) != 0)
+        {
+            cout << "Cannot create " << root_file << i << endl;
+            return 1;
+        }
+        close(fd);
+    }
+    // a block list saved from an earlier volume means nothing on this one
+    unlink(warm_file.c_str());
+    shared_ptr<BlockDevice> block_device(new BlockDevice(password, stripe_count, stripe_unit, cipher, false, total_blocks));
+    shared_ptr<EasyFileSystem> efs = EasyFileSystem::create(block_device, inode_count);
+    if (efs == nullptr)
+    {
+        cout << "Volume too small for " << inode_count << " inodes" << endl;
+        return 1;
+    }
+    SuperBlock super_block = BLOCK_CACHE_MANAGER.get_block_cache(0, block_device, -1).get()->peek<SuperBlock>(0);
+    printf("%u blocks of %u bytes over %u devices (stripe unit %u), %s\n", super_block.total_blocks, super_block.get_block_size(),
+           super_block.get_stripe_count(), super_block.get_stripe_unit(), cipher == Plain ? "plaintext" : "aes128");
+    printf("%u inodes, %u data blocks\n", super_block.inode_bitmap_blocks * block_bits, super_block.data_area_blocks);
+    return 0;
+}
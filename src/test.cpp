@@ -1,7 +1,37 @@
 #include "efs.h"
+#include <thread>
+#include <sys/wait.h>
 const u32 len = 8 * 1024 * 1024;
 u8 buf[len];
 u8 buf2[len];
+// the tools are built in their own directories and run like from the shell
+int run_tool(string command, string &output)
+{
+    FILE *fp = popen(command.c_str(), "r");
+    assert(fp != nullptr);
+    char line[256];
+    output = "";
+    while (fgets(line, sizeof(line), fp) != nullptr)
+        output += line;
+    int status = pclose(fp);
+    assert(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+u64 checksum_disks()
+{
+    u64 sum = 0;
+    for (u32 i = 0; i < device_num; i++)
+    {
+        FILE *fp = fopen((root_file + to_string(i)).c_str(), "r");
+        assert(fp != nullptr);
+        size_t n;
+        while ((n = fread(buf2, 1, len, fp)) > 0)
+            for (size_t j = 0; j < n / sizeof(u64); j++)
+                sum = (sum ^ ((u64 *)buf2)[j]) * 1099511628211ull;
+        fclose(fp);
+    }
+    return sum;
+}
 int main()
 {
     for (u32 i = 0; i < device_num; i++)
@@ -14,6 +44,36 @@ int main()
             close(fd);
         }
     }
+    {
+        string output;
+        assert(run_tool("../mkfs/mkfs.efs -f -b 4096 -c plain", output) == 1);
+        assert(output.find("Block size 4096 not supported") != string::npos);
+        assert(run_tool("../mkfs/mkfs.efs -f -d 2 -u 4 -i 8192 -s 512M -c plain", output) == 0);
+        // nothing of this volume may stay in the block cache when the next one is formatted
+        // over it, so it is opened in a child
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
+        {
+            u32 stripe_count, stripe_unit, total_blocks;
+            CipherType cipher;
+            assert(EasyFileSystem::probe("", stripe_count, stripe_unit, cipher, total_blocks));
+            assert(stripe_count == 2 && stripe_unit == 4 && cipher == Plain && total_blocks == 512 * 1024 * 1024 / block_sz);
+            shared_ptr<BlockDevice> block_device(new BlockDevice("", stripe_count, stripe_unit, cipher, false, total_blocks));
+            shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+            assert(efs != nullptr);
+            SuperBlock super_block = BLOCK_CACHE_MANAGER.get_block_cache(0, block_device, -1).get()->peek<SuperBlock>(0);
+            assert(super_block.get_block_size() == block_sz && super_block.get_stripe_count() == 2 && super_block.get_stripe_unit() == 4);
+            assert(super_block.inode_bitmap_blocks == 8192 / block_bits && super_block.inode_area_blocks == 8192 / inodes_per_block);
+            assert(super_block.has_block_counts() && super_block.get_segment_count() == 0);
+            i32 err;
+            assert(efs.get()->find("/" + snapshot_dir_name, err) != nullptr);
+            _exit(0);
+        }
+        int status;
+        assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    cout << "test mkfs ok." << endl;
     {
         shared_ptr<BlockDevice> block_device(new BlockDevice(""));
         shared_ptr<EasyFileSystem> efs = EasyFileSystem::create(block_device);
@@ -42,5 +102,471 @@ int main()
             assert(buf2[i] == i % 256);
     }
     cout << "test 2-level index ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        struct Pair
+        {
+            u64 first;
+            u64 second;
+        };
+        // a peek racing with writers sees both halves of one write, never a mix of two
+        u32 block_id = efs.get()->alloc_data();
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(block_id, block_device, -1)
+            .get()
+            ->modify<Pair, u32>(0, [](Pair &pair) -> u32
+                                {
+                                    pair.first = pair.second = 0;
+                                    return 0;
+                                });
+        atomic<bool> stop(false);
+        std::thread writer([&block_device, &stop, block_id]()
+                           {
+                               while (!stop)
+                                   BLOCK_CACHE_MANAGER
+                                       .get_block_cache(block_id, block_device, -1)
+                                       .get()
+                                       ->modify<Pair, u32>(0, [](Pair &pair) -> u32
+                                                           {
+                                                               pair.first++;
+                                                               pair.second = pair.first;
+                                                               return 0;
+                                                           });
+                           });
+        u64 last = 0;
+        for (u32 i = 0; i < 1000000; i++)
+        {
+            Pair pair = BLOCK_CACHE_MANAGER.get_block_cache(block_id, block_device, -1).get()->peek<Pair>(0);
+            assert(pair.first == pair.second && pair.first >= last);
+            last = pair.first;
+        }
+        stop = true;
+        writer.join();
+        efs.get()->dealloc_data(block_id);
+    }
+    cout << "test seqlock peek ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        // half of a group's metadata ways can be pinned, pinning again is free
+        u32 group_id = block_cache_group - 1;
+        for (u32 i = 0; i < meta_cache_way / 2; i++)
+            assert(BLOCK_CACHE_MANAGER.pin(group_id + i * block_cache_group, block_device));
+        assert(!BLOCK_CACHE_MANAGER.pin(group_id + meta_cache_way / 2 * block_cache_group, block_device));
+        assert(BLOCK_CACHE_MANAGER.pin(group_id, block_device));
+        // pinned blocks stay cached however many others of the group pass through
+        for (u32 i = 0; i < 4 * block_cache_way; i++)
+            BLOCK_CACHE_MANAGER.get_block_cache(group_id + (meta_cache_way + i) * block_cache_group, block_device, -1);
+        for (u32 i = 0; i < meta_cache_way / 2; i++)
+        {
+            u64 hits, misses, hits1, misses1;
+            BLOCK_CACHE_MANAGER.get_stats(MetaPool, hits, misses);
+            BLOCK_CACHE_MANAGER.get_block_cache(group_id + i * block_cache_group, block_device, -1);
+            BLOCK_CACHE_MANAGER.get_stats(MetaPool, hits1, misses1);
+            assert(misses1 == misses);
+        }
+        // flush_inode writes back the blocks of one file and leaves the others dirty
+        i32 err;
+        shared_ptr<Inode> files[2];
+        u32 block_ids[2];
+        for (u32 i = 0; i < 2; i++)
+        {
+            files[i] = efs.get()->create("/flushed" + to_string(i), DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+            assert(files[i] != nullptr);
+            block_ids[i] = efs.get()->alloc_data();
+            // as a freed index block would be, still cached as metadata
+            BLOCK_CACHE_MANAGER.get_block_cache(block_ids[i], block_device, -1);
+            BLOCK_CACHE_MANAGER
+                .get_block_cache(block_ids[i], block_device, files[i].get()->get_id())
+                .get()
+                ->modify<Block, u32>(0, [i](Block &block) -> u32
+                                     {
+                                         memset(block.data, 0x5a + i, block_sz);
+                                         return 0;
+                                     });
+        }
+        BLOCK_CACHE_MANAGER.flush_inode(files[0].get()->get_id());
+        assert(!BLOCK_CACHE_MANAGER.get_block_cache(block_ids[0], block_device, files[0].get()->get_id()).get()->is_modified());
+        assert(BLOCK_CACHE_MANAGER.get_block_cache(block_ids[1], block_device, files[1].get()->get_id()).get()->is_modified());
+        Block block;
+        block_device.get()->read_block(block_ids[0], block);
+        for (u32 i = 0; i < block_sz; i++)
+            assert(block.data[i] == 0x5a);
+        BLOCK_CACHE_MANAGER.flush(block_ids[1]);
+        for (u32 i = 0; i < 2; i++)
+        {
+            efs.get()->dealloc_data(block_ids[i]);
+            assert(efs.get()->unlink("/flushed" + to_string(i)) == 0);
+        }
+    }
+    cout << "test cache pools ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->create("/small", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        for (u32 i = 0; i < block_sz; i++)
+            buf[i] = i % 251;
+        // kept in the inode up to inline_data_max, then moved to a block of its own
+        file.get()->write_at(0, buf, inline_data_max);
+        assert(file.get()->get_stat().st_blocks == 0);
+        assert(file.get()->read_at(0, buf2, len) == inline_data_max);
+        file.get()->write_at(inline_data_max, buf + inline_data_max, block_sz - inline_data_max);
+        assert(file.get()->get_stat().st_blocks == 1);
+        u32 len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == block_sz);
+        for (u32 i = 0; i < block_sz; i++)
+            assert(buf2[i] == i % 251);
+    }
+    cout << "test inline data ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->create("/sparse", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        for (u32 i = 0; i < 8 * block_sz; i++)
+            buf[i] = i % 256;
+        file.get()->write_at(0, buf, 8 * block_sz);
+        assert(file.get()->get_stat().st_blocks == 8);
+        // the two whole blocks in the range are unmapped, the ends around them zeroed
+        file.get()->punch_hole(block_sz + 100, 3 * block_sz);
+        assert(file.get()->get_stat().st_size == 8 * block_sz);
+        assert(file.get()->get_stat().st_blocks == 6);
+        u32 len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == 8 * block_sz);
+        for (u32 i = 0; i < 8 * block_sz; i++)
+            assert(buf2[i] == (i >= block_sz + 100 && i < 4 * block_sz + 100 ? 0 : i % 256));
+        assert(file.get()->seek(0, SEEK_HOLE) == 2 * block_sz);
+        assert(file.get()->seek(2 * block_sz, SEEK_DATA) == 4 * block_sz);
+        assert(file.get()->seek(4 * block_sz, SEEK_HOLE) == 8 * block_sz);
+        assert(file.get()->seek(8 * block_sz, SEEK_DATA) == -ENXIO);
+    }
+    cout << "test hole punching ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->create("/uncounted", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        memset(buf, 1, 3 * block_sz);
+        file.get()->write_at(0, buf, block_sz);
+        file.get()->write_at(40 * block_sz, buf, 2 * block_sz);
+        file.get()->flush_delayed();
+        assert(file.get()->get_stat().st_blocks == 4);
+        // make it look like a volume from before files kept a block count: the count sits
+        // just before the two timestamps and was always zero for a file
+        u32 block_id, block_offset;
+        efs.get()->get_disk_inode_pos(file.get()->get_id(), block_id, block_offset);
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(block_id, block_device, -1)
+            .get()
+            ->modify_and_sync<u32, u32>(block_offset + sizeof(DiskInode) - 2 * sizeof(i64) - sizeof(u32), [](u32 &count) -> u32
+                                        {
+                                            count = 0;
+                                            return 0;
+                                        });
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(0, block_device, -1)
+            .get()
+            ->modify_and_sync<SuperBlock, u32>(0, [](SuperBlock &super_block) -> u32
+                                               {
+                                                   super_block.blocks_counted = 0;
+                                                   return 0;
+                                               });
+        assert(file.get()->get_stat().st_blocks == 0);
+    }
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        // the mount counts every file once
+        shared_ptr<Inode> file = efs.get()->find("/uncounted", err);
+        assert(file != nullptr);
+        assert(file.get()->get_stat().st_blocks == 4);
+        assert(BLOCK_CACHE_MANAGER.get_block_cache(0, block_device, -1).get()->peek<SuperBlock>(0).has_block_counts());
+        file.get()->punch_hole(40 * block_sz, block_sz);
+        assert(file.get()->get_stat().st_blocks == 3);
+    }
+    cout << "test block count upgrade ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->create("/truncated", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        for (u32 i = 0; i < 3 * block_sz + 10; i++)
+            buf[i] = i % 256;
+        file.get()->write_at(0, buf, 3 * block_sz + 10);
+        // shrinking frees the tail, growing again reads zeros past the old end
+        file.get()->truncate(block_sz + 10);
+        assert(file.get()->get_stat().st_size == block_sz + 10);
+        assert(file.get()->get_stat().st_blocks == 2);
+        file.get()->truncate(4 * block_sz);
+        assert(file.get()->get_stat().st_size == 4 * block_sz);
+        assert(file.get()->get_stat().st_blocks == 2);
+        u32 len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == 4 * block_sz);
+        for (u32 i = 0; i < 4 * block_sz; i++)
+            assert(buf2[i] == (i < block_sz + 10 ? i % 256 : 0));
+    }
+    cout << "test truncate ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->create("/preallocated", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        assert(file.get()->preallocate(0, 4 * block_sz, false) == 0);
+        assert(file.get()->get_stat().st_size == 4 * block_sz);
+        assert(file.get()->get_stat().st_blocks == 4);
+        // reserved blocks read as zeros until written, whatever they held before
+        memset(buf2, 0xff, 4 * block_sz);
+        u32 len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == 4 * block_sz);
+        for (u32 i = 0; i < 4 * block_sz; i++)
+            assert(buf2[i] == 0);
+        file.get()->write_at(block_sz + 5, (const u8 *)"unwritten", 9);
+        assert(file.get()->get_stat().st_blocks == 4);
+        len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == 4 * block_sz);
+        for (u32 i = 0; i < 4 * block_sz; i++)
+            assert(buf2[i] == (i >= block_sz + 5 && i < block_sz + 14 ? "unwritten"[i - block_sz - 5] : 0));
+        // keep_size reserves only inside the file
+        assert(file.get()->preallocate(0, 8 * block_sz, true) == 0);
+        assert(file.get()->get_stat().st_size == 4 * block_sz);
+        assert(file.get()->get_stat().st_blocks == 4);
+    }
+    cout << "test preallocation ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->create("/delayed", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        file.get()->truncate(4 * block_sz);
+        const u32 order[4] = {3, 1, 0, 2};
+        for (u32 i = 0; i < 4; i++)
+        {
+            memset(buf, 'a' + order[i], block_sz);
+            file.get()->write_at(order[i] * block_sz, buf, block_sz);
+        }
+        // held in memory and counted, with nothing mapped yet
+        assert(file.get()->get_stat().st_blocks == 4);
+        vector<u32> block_ids = file.get()->read_disk_inode<vector<u32>>([&block_device](const DiskInode &disk_inode) -> vector<u32>
+                                                                         { return disk_inode.get_block_ids(0, 4, block_device); });
+        for (u32 i = 0; i < 4; i++)
+            assert(block_ids[i] == 0);
+        // the flush gives the file one run, in file order
+        file.get()->flush_delayed();
+        block_ids = file.get()->read_disk_inode<vector<u32>>([&block_device](const DiskInode &disk_inode) -> vector<u32>
+                                                             { return disk_inode.get_block_ids(0, 4, block_device); });
+        for (u32 i = 1; i < 4; i++)
+            assert(block_ids[i] == block_ids[0] + i);
+        u32 len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == 4 * block_sz);
+        for (u32 i = 0; i < 4 * block_sz; i++)
+            assert(buf2[i] == 'a' + i / block_sz);
+    }
+    cout << "test delayed allocation ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> src = efs.get()->create("/source", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        shared_ptr<Inode> copy = efs.get()->create("/copy", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(src != nullptr && copy != nullptr);
+        for (u32 i = 0; i < 4 * block_sz; i++)
+            buf[i] = i % 253;
+        src.get()->write_at(0, buf, 4 * block_sz);
+        assert(copy.get()->copy_from(src, 0, 0, 4 * block_sz) == 4 * block_sz);
+        auto first_block = [&block_device](shared_ptr<Inode> inode) -> u32
+        {
+            return inode.get()->read_disk_inode<u32>([&block_device](const DiskInode &disk_inode) -> u32
+                                                     { return disk_inode.get_block_id(0, block_device); });
+        };
+        assert(first_block(copy) == first_block(src));
+        // the blocks are shared until one side writes, which then gets its own
+        memset(buf, 0xaa, block_sz);
+        src.get()->write_at(block_sz, buf, block_sz);
+        u32 len1 = copy.get()->read_at(0, buf2, len);
+        assert(len1 == 4 * block_sz);
+        for (u32 i = 0; i < 4 * block_sz; i++)
+            assert(buf2[i] == i % 253);
+        len1 = src.get()->read_at(0, buf2, len);
+        assert(len1 == 4 * block_sz);
+        for (u32 i = 0; i < 4 * block_sz; i++)
+            assert(buf2[i] == (i >= block_sz && i < 2 * block_sz ? 0xaa : i % 253));
+    }
+    cout << "test copy_file_range ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->create("/snapped", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        for (u32 i = 0; i < 2 * block_sz; i++)
+            buf[i] = i % 241;
+        file.get()->write_at(0, buf, 2 * block_sz);
+        shared_ptr<Inode> snapshots = efs.get()->find("/" + snapshot_dir_name, err);
+        assert(snapshots != nullptr);
+        u32 snapshots_id = snapshots.get()->get_id();
+        assert(efs.get()->snapshot(snapshots_id, "first", 0, 0, err) != nullptr);
+        // later writes to the live file do not reach the snapshot, which cannot be written
+        memset(buf, 0, block_sz);
+        file.get()->write_at(0, buf, block_sz);
+        shared_ptr<Inode> image = efs.get()->find("/" + snapshot_dir_name + "/first/snapped", err);
+        assert(image != nullptr && image.get()->is_readonly());
+        u32 len1 = image.get()->read_at(0, buf2, len);
+        assert(len1 == 2 * block_sz);
+        for (u32 i = 0; i < 2 * block_sz; i++)
+            assert(buf2[i] == i % 241);
+        assert(efs.get()->unlink("/" + snapshot_dir_name + "/first/snapped") == -EROFS);
+        image = nullptr;
+        assert(efs.get()->remove_snapshot(snapshots_id, "first", 0, 0) == 0);
+        assert(efs.get()->find("/" + snapshot_dir_name + "/first", err) == nullptr);
+        len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == 2 * block_sz);
+        for (u32 i = 0; i < 2 * block_sz; i++)
+            assert(buf2[i] == (i < block_sz ? 0 : i % 241));
+        // the writer bumps the first file, then the second, so an image of a single moment
+        // never finds the second ahead of the first or more than one step behind it
+        shared_ptr<Inode> pair[2];
+        u32 step = 0;
+        for (u32 i = 0; i < 2; i++)
+        {
+            pair[i] = efs.get()->create("/pair" + to_string(i), DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+            assert(pair[i] != nullptr);
+            pair[i].get()->write_at(0, (u8 *)&step, sizeof(step));
+            // other files in between make the walk take a while from one to the other
+            for (u32 j = 0; j < 64 && i == 0; j++)
+                assert(efs.get()->create("/filler" + to_string(j), DiskInodeType::File, err, S_IRUSR | S_IWUSR) != nullptr);
+        }
+        atomic<bool> stop(false);
+        std::thread writer([&efs, &pair, &stop]()
+                           {
+                               for (u32 step = 1; !stop; step++)
+                                   for (u32 i = 0; i < 2; i++)
+                                   {
+                                       efs.get()->rdlock_inode(pair[i].get()->get_id());
+                                       pair[i].get()->write_at(0, (u8 *)&step, sizeof(step));
+                                       efs.get()->unlock_inode(pair[i].get()->get_id());
+                                   }
+                           });
+        for (u32 i = 0; i < 16; i++)
+        {
+            assert(efs.get()->snapshot(snapshots_id, "pair", 0, 0, err) != nullptr);
+            u32 steps[2];
+            for (u32 j = 0; j < 2; j++)
+            {
+                image = efs.get()->find("/" + snapshot_dir_name + "/pair/pair" + to_string(j), err);
+                assert(image != nullptr);
+                assert(image.get()->read_at(0, (u8 *)&steps[j], sizeof(u32)) == sizeof(u32));
+            }
+            assert(steps[0] == steps[1] || steps[0] == steps[1] + 1);
+            image = nullptr;
+            assert(efs.get()->remove_snapshot(snapshots_id, "pair", 0, 0) == 0);
+        }
+        stop = true;
+        writer.join();
+    }
+    cout << "test snapshot ok." << endl;
+    {
+        shared_ptr<BlockDevice> block_device(new BlockDevice(""));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        // a grow has to add more blocks than its own bitmap and reference counts take
+        assert(efs.get()->grow(device_block_num) == -EINVAL);
+        assert(efs.get()->grow(device_block_num + 8192) == 0);
+        assert(block_device.get()->get_total_blocks() == device_block_num + 8192);
+        shared_ptr<Inode> file = efs.get()->create("/grown", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(file != nullptr);
+        for (u32 i = 0; i < 8 * block_sz; i++)
+            buf[i] = i % 239;
+        file.get()->write_at(0, buf, 8 * block_sz);
+        // held back writes reach the disk on unmount
+        efs.get()->flush_delayed();
+    }
+    {
+        u32 stripe_count, stripe_unit, total_blocks;
+        CipherType cipher;
+        assert(EasyFileSystem::probe("", stripe_count, stripe_unit, cipher, total_blocks));
+        assert(total_blocks == device_block_num + 8192);
+        shared_ptr<BlockDevice> block_device(new BlockDevice("", stripe_count, stripe_unit, cipher, false, total_blocks));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        i32 err;
+        shared_ptr<Inode> file = efs.get()->find("/grown", err);
+        assert(file != nullptr);
+        u32 len1 = file.get()->read_at(0, buf2, len);
+        assert(len1 == 8 * block_sz);
+        for (u32 i = 0; i < 8 * block_sz; i++)
+            assert(buf2[i] == i % 239);
+    }
+    cout << "test online grow ok." << endl;
+    {
+        u32 stripe_count, stripe_unit, total_blocks;
+        CipherType cipher;
+        assert(EasyFileSystem::probe("", stripe_count, stripe_unit, cipher, total_blocks));
+        shared_ptr<BlockDevice> block_device(new BlockDevice("", stripe_count, stripe_unit, cipher, false, total_blocks));
+        shared_ptr<EasyFileSystem> efs = EasyFileSystem::open(block_device);
+        assert(efs != nullptr);
+        efs.get()->flush_delayed();
+        BLOCK_CACHE_MANAGER.flush();
+        // a clean volume is not written at all, even with -r
+        string output;
+        u64 sum = checksum_disks();
+        assert(run_tool("../efsck/efsck -r", output) == 0);
+        assert(output.find(" 0 problems") != string::npos);
+        assert(checksum_disks() == sum);
+        i32 err;
+        // an inode no entry names, a block marked used that nobody holds and a reference
+        // count on a block held once
+        shared_ptr<Inode> orphan = efs.get()->create("/orphan", DiskInodeType::File, err, S_IRUSR | S_IWUSR);
+        assert(orphan != nullptr);
+        memset(buf, 3, 2 * block_sz);
+        orphan.get()->write_at(0, buf, 2 * block_sz);
+        orphan.get()->flush_delayed();
+        efs.get()->get_inode(0).get()->remove("orphan");
+        u32 leaked = efs.get()->alloc_data();
+        shared_ptr<Inode> file = efs.get()->find("/grown", err);
+        assert(file != nullptr);
+        u32 counted = file.get()->read_disk_inode<u32>([&block_device](const DiskInode &disk_inode) -> u32
+                                                       { return disk_inode.get_block_id(0, block_device); });
+        SuperBlock super_block = BLOCK_CACHE_MANAGER.get_block_cache(0, block_device, -1).get()->peek<SuperBlock>(0);
+        u32 data_start = 1 + super_block.inode_bitmap_blocks + super_block.inode_area_blocks + super_block.data_bitmap_blocks;
+        assert(counted >= data_start && counted < data_start + super_block.data_area_blocks);
+        u32 pos = counted - data_start;
+        BLOCK_CACHE_MANAGER
+            .get_block_cache(super_block.get_refcount_start() + pos / block_sz, block_device, -1)
+            .get()
+            ->modify_and_sync<Block, u32>(0, [pos](Block &block) -> u32
+                                          {
+                                              block.data[pos % block_sz] = 1;
+                                              return 0;
+                                          });
+        BLOCK_CACHE_MANAGER.flush();
+        assert(run_tool("../efsck/efsck", output) == 4);
+        assert(output.find("inode " + to_string(orphan.get()->get_id()) + ": not in any directory") != string::npos);
+        assert(output.find("block " + to_string(leaked) + ": free, marked used") != string::npos);
+        assert(output.find("block " + to_string(counted) + ": 1 owners, reference count 1") != string::npos);
+        assert(run_tool("../efsck/efsck -r", output) == 1);
+        assert(run_tool("../efsck/efsck", output) == 0);
+    }
+    cout << "test efsck ok." << endl;
     return 0;
 }
\ No newline at end of file
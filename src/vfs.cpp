@@ -1,322 +1,680 @@
-#include "vfs.h"
-#include "efs.h"
-Inode::Inode(u32 _inode_id, u32 _block_id, u32 _block_offset, EasyFileSystem *_fs, shared_ptr<BlockDevice> _block_device)
-{
-    inode_id = _inode_id;
-    block_id = _block_id;
-    block_offset = _block_offset;
-    fs = _fs;
-    block_device = _block_device;
-}
-u32 Inode::get_id()
-{
-    return inode_id;
-}
-
-i64 Inode::find_inode_id(string name, DiskInode &disk_inode)
-{
-    assert(disk_inode.is_dir());
-    u32 file_count = disk_inode.get_size() / dirent_sz;
-    DirEntry dirent;
-    for (u32 i = 0; i < file_count; i++)
-    {
-        disk_inode.read_at(dirent_sz * i, dirent.as_bytes_mut(), dirent_sz, block_device, inode_id);
-        if (dirent.get_name() == name)
-            return dirent.get_inode_number();
-    }
-    return -1;
-}
-
-shared_ptr<Inode> Inode::find(string name)
-{
-    return modify_disk_inode<shared_ptr<Inode>>([this, name](DiskInode &disk_inode) -> shared_ptr<Inode>
-                                                {
-                                                    i64 inode_id = this->find_inode_id(name, disk_inode);
-                                                    if (inode_id < 0)
-                                                        return shared_ptr<Inode>(nullptr);
-                                                    u32 block_id, block_offset;
-                                                    this->fs->get_disk_inode_pos(inode_id, block_id, block_offset);
-                                                    return shared_ptr<Inode>(new Inode(inode_id, block_id, block_offset, this->fs, this->block_device));
-                                                });
-}
-
-void Inode::increase_size(u32 new_size, DiskInode &disk_inode)
-{
-    if (new_size <= disk_inode.get_size())
-        return;
-    u32 blocks_needed = disk_inode.blocks_num_needed(new_size);
-    vector<u32> v;
-    for (u32 i = 0; i < blocks_needed; i++)
-    {
-        v.push_back(fs->alloc_data());
-    }
-    disk_inode.increase_size(new_size, v, block_device);
-}
-
-shared_ptr<Inode> Inode::create(string name, DiskInodeType type, u32 uid, u32 gid, u32 mode)
-{
-    u32 new_inode_id = fs->alloc_inode();
-    u32 new_inode_block_id, new_inode_block_offset;
-    fs->get_disk_inode_pos(new_inode_id, new_inode_block_id, new_inode_block_offset);
-    BLOCK_CACHE_MANAGER
-        .get_block_cache(new_inode_block_id, block_device, -1)
-        .get()
-        ->modify_and_sync<DiskInode, u32>(new_inode_block_offset, [type, uid, gid, mode](DiskInode &new_node)
-                                          {
-                                              new_node.initialize(type);
-                                              new_node.set_uid(uid);
-                                              new_node.set_gid(gid);
-                                              new_node.set_mode(mode);
-                                              return 0;
-                                          });
-    modify_disk_inode<u32>([this, name, new_inode_id](DiskInode &root_inode)
-                           {
-                               u32 file_count = root_inode.get_size() / dirent_sz;
-                               u32 new_size = (file_count + 1) * dirent_sz;
-                               this->increase_size(new_size, root_inode);
-                               DirEntry dirent(name, new_inode_id);
-                               root_inode.write_at(file_count * dirent_sz, dirent.as_bytes(), dirent_sz, this->block_device, -1);
-                               root_inode.add_dirent_num();
-                               return 0;
-                           });
-    return shared_ptr<Inode>(new Inode(new_inode_id, new_inode_block_id, new_inode_block_offset, this->fs, this->block_device));
-}
-
-void Inode::remove(string name)
-{
-    modify_disk_inode<u32>([this, name](DiskInode &root_inode)
-                           {
-                               u32 file_count = root_inode.get_size() / dirent_sz;
-                               DirEntry dirent;
-                               for (u32 i = 0; i < file_count; i++)
-                               {
-                                   root_inode.read_at(dirent_sz * i, dirent.as_bytes_mut(), dirent_sz, block_device, -1);
-                                   if (dirent.get_name() == name)
-                                   {
-                                       DirEntry dirent_empty;
-                                       root_inode.write_at(i * dirent_sz, dirent_empty.as_bytes(), dirent_sz, this->block_device, -1);
-                                       root_inode.sub_dirent_num();
-                                       return 0;
-                                   }
-                               }
-                               return 0;
-                           });
-}
-
-u32 Inode::read_at(u32 offset, u8 *buf, u32 _size)
-{
-    return modify_disk_inode<u32>([this, offset, buf, _size](DiskInode &disk_inode) -> u32
-                                  { return disk_inode.read_at(offset, buf, _size, this->block_device, this->inode_id); });
-}
-
-u32 Inode::write_at(u32 offset, const u8 *buf, u32 _size)
-{
-    return modify_disk_inode<u32>([this, offset, buf, _size](DiskInode &disk_inode) -> u32
-                                  {
-                                      this->increase_size(offset + _size, disk_inode);
-                                      return disk_inode.write_at(offset, buf, _size, this->block_device, this->inode_id);
-                                  });
-}
-
-void Inode::clear()
-{
-    vector<u32> data_blocks_dealloc;
-    modify_disk_inode<u32>([this, &data_blocks_dealloc](DiskInode &disk_inode) -> u32
-                           {
-                               data_blocks_dealloc = disk_inode.clear_size(this->block_device);
-                               return 0;
-                           });
-    for (u32 data_block : data_blocks_dealloc)
-        this->fs->dealloc_data(data_block);
-}
-
-bool Inode::is_dir()
-{
-    return read_disk_inode<bool>([](const DiskInode &disk_inode) -> bool
-                                 { return disk_inode.is_dir(); });
-}
-
-bool Inode::is_file()
-{
-    return read_disk_inode<bool>([](const DiskInode &disk_inode) -> bool
-                                 { return disk_inode.is_file(); });
-}
-
-void Inode::sync()
-{
-    BLOCK_CACHE_MANAGER.flush_inode(inode_id);
-}
-
-vector<pair<string, u32>> Inode::ls()
-{
-    return modify_disk_inode<vector<pair<string, u32>>>([this](DiskInode &disk_inode) -> vector<pair<string, u32>>
-                                                        {
-                                                            u32 file_count = disk_inode.get_size() / dirent_sz;
-                                                            vector<pair<string, u32>> files;
-                                                            DirEntry dirent;
-                                                            for (u32 i = 0; i < file_count; i++)
-                                                            {
-                                                                disk_inode.read_at(dirent_sz * i, dirent.as_bytes_mut(), dirent_sz, this->block_device, -1);
-                                                                if (dirent.get_name().length() > 0)
-                                                                {
-                                                                    files.push_back(make_pair(dirent.get_name(), dirent.get_inode_number()));
-                                                                }
-                                                            }
-                                                            return files;
-                                                        });
-}
-
-u32 Inode::get_nlink()
-{
-    return read_disk_inode<u32>([](const DiskInode &disk_inode) -> u32
-                                { return disk_inode.get_nlink(); });
-}
-
-void Inode::add_nlink()
-{
-    modify_disk_inode<u32>([](DiskInode &disk_inode) -> u32
-                           {
-                               disk_inode.add_nlink();
-                               return 0;
-                           });
-}
-
-bool Inode::sub_nlink()
-{
-    return modify_disk_inode<bool>([](DiskInode &disk_inode) -> bool
-                                   {
-                                       disk_inode.sub_nlink();
-                                       if (disk_inode.get_nlink() == 0)
-                                           return true;
-                                       return false;
-                                   });
-}
-
-void Inode::rename(string old_name, string new_name)
-{
-    modify_disk_inode<u32>([this, old_name, new_name](DiskInode &root_inode)
-                           {
-                               u32 file_count = root_inode.get_size() / dirent_sz;
-                               DirEntry dirent;
-                               for (u32 i = 0; i < file_count; i++)
-                               {
-                                   root_inode.read_at(dirent_sz * i, dirent.as_bytes_mut(), dirent_sz, block_device, -1);
-                                   if (dirent.get_name() == old_name)
-                                   {
-                                       DirEntry dirent_new(new_name, dirent.get_inode_number());
-                                       root_inode.write_at(i * dirent_sz, dirent_new.as_bytes(), dirent_sz, this->block_device, -1);
-                                       return 0;
-                                   }
-                               }
-                               return 0;
-                           });
-}
-
-void Inode::link(string name, u32 inode_id)
-{
-    modify_disk_inode<u32>([this, name, inode_id](DiskInode &root_inode)
-                           {
-                               u32 file_count = root_inode.get_size() / dirent_sz;
-                               u32 new_size = (file_count + 1) * dirent_sz;
-                               this->increase_size(new_size, root_inode);
-                               DirEntry dirent(name, inode_id);
-                               root_inode.write_at(file_count * dirent_sz, dirent.as_bytes(), dirent_sz, this->block_device, -1);
-                               root_inode.add_dirent_num();
-                               return 0;
-                           });
-}
-
-struct stat Inode::get_stat()
-{
-    return read_disk_inode<struct stat>([this](const DiskInode &disk_inode) -> struct stat
-                                        {
-                                            struct stat st;
-                                            st.st_atime = disk_inode.get_atime();
-                                            st.st_ctime = disk_inode.get_ctime();
-                                            st.st_dev = 0;
-                                            st.st_gid = disk_inode.get_gid();
-                                            st.st_ino = this->inode_id;
-                                            st.st_mode = disk_inode.get_mode();
-                                            if (disk_inode.is_dir())
-                                                st.st_mode |= S_IFDIR;
-                                            else
-                                                st.st_mode |= S_IFREG;
-                                            st.st_mtime = disk_inode.get_ctime();
-                                            st.st_nlink = disk_inode.get_nlink();
-                                            st.st_rdev = 0;
-                                            st.st_size = disk_inode.get_size();
-                                            st.st_uid = disk_inode.get_uid();
-                                            st.st_blksize = block_sz;
-                                            st.st_blocks = disk_inode.total_blocks(st.st_size);
-                                            return st;
-                                        });
-}
-
-u32 Inode::get_dirent_num()
-{
-    return read_disk_inode<u32>([](const DiskInode &disk_inode) -> u32
-                                { return disk_inode.get_dirent_num(); });
-}
-
-void Inode::set_mode(u32 mode)
-{
-    modify_disk_inode<u32>([mode](DiskInode &root_inode)
-                           {
-                               root_inode.set_mode(mode);
-                               return 0;
-                           });
-}
-
-void Inode::set_owner(u32 uid, u32 gid)
-{
-    modify_disk_inode<u32>([uid, gid](DiskInode &root_inode)
-                           {
-                               root_inode.set_uid(uid);
-                               root_inode.set_gid(gid);
-                               return 0;
-                           });
-}
-
-void Inode::get_permission(u32 &mode, u32 &uid, u32 &gid)
-{
-    read_disk_inode<u32>([&mode, &uid, &gid](const DiskInode &disk_inode) -> u32
-                         {
-                             mode = disk_inode.get_mode();
-                             uid = disk_inode.get_uid();
-                             gid = disk_inode.get_gid();
-                             return 0;
-                         });
-}
-
-bool Inode::permit_r(u32 _uid, u32 _gid)
-{
-    return read_disk_inode<bool>([_uid, _gid](const DiskInode &disk_inode) -> bool
-                                 { return disk_inode.permit_r(_uid, _gid); });
-}
-bool Inode::permit_w(u32 _uid, u32 _gid)
-{
-    return read_disk_inode<bool>([_uid, _gid](const DiskInode &disk_inode) -> bool
-                                 { return disk_inode.permit_w(_uid, _gid); });
-}
-bool Inode::permit_x(u32 _uid, u32 _gid)
-{
-    return read_disk_inode<bool>([_uid, _gid](const DiskInode &disk_inode) -> bool
-                                 { return disk_inode.permit_x(_uid, _gid); });
-}
-
-void Inode::set_atime(i64 time)
-{
-    modify_disk_inode<u32>([time](DiskInode &root_inode)
-                           {
-                               root_inode.set_atime(time);
-                               return 0;
-                           });
-}
-void Inode::set_ctime(i64 time)
-{
-    modify_disk_inode<u32>([time](DiskInode &root_inode)
-                           {
-                               root_inode.set_ctime(time);
-                               return 0;
-                           });
+#include "vfs.h"
+#include "efs.h"
+Inode::Inode(u32 _inode_id, u32 _block_id, u32 _block_offset, EasyFileSystem *_fs, shared_ptr<BlockDevice> _block_device)
+{
+    inode_id = _inode_id;
+    block_id = _block_id;
+    block_offset = _block_offset;
+    fs = _fs;
+    block_device = _block_device;
+}
+u32 Inode::get_id()
+{
+    return inode_id;
+}
+
+i64 Inode::find_inode_id(string name, const DiskInode &disk_inode)
+{
+    assert(disk_inode.is_dir());
+    u32 file_count = disk_inode.get_size() / dirent_sz;
+    DirEntry dirent;
+    for (u32 i = 0; i < file_count; i++)
+    {
+        disk_inode.read_data(dirent_sz * i, dirent.as_bytes_mut(), dirent_sz, block_device, inode_id);
+        if (dirent.get_name() == name)
+            return dirent.get_inode_number();
+    }
+    return -1;
+}
+
+shared_ptr<Inode> Inode::find(string name)
+{
+    return read_disk_inode<shared_ptr<Inode>>([this, name](const DiskInode &disk_inode) -> shared_ptr<Inode>
+                                              {
+                                                  i64 inode_id = this->find_inode_id(name, disk_inode);
+                                                  if (inode_id < 0)
+                                                      return shared_ptr<Inode>(nullptr);
+                                                  u32 block_id, block_offset;
+                                                  this->fs->get_disk_inode_pos(inode_id, block_id, block_offset);
+                                                  return shared_ptr<Inode>(new Inode(inode_id, block_id, block_offset, this->fs, this->block_device));
+                                              });
+}
+
+void Inode::increase_size(u32 new_size, DiskInode &disk_inode)
+{
+    if (new_size <= disk_inode.get_size())
+        return;
+    if (disk_inode.is_inline())
+    {
+        if (new_size <= inline_data_max)
+        {
+            disk_inode.increase_inline(new_size);
+            return;
+        }
+        Block first;
+        memset(first.data, 0, block_sz);
+        u32 old_size = disk_inode.get_size();
+        disk_inode.end_inline(first.data);
+        disk_inode.increase_size(new_size);
+        if (old_size > 0)
+        {
+            fill_holes(0, old_size, disk_inode);
+            disk_inode.write_at(0, first.data, old_size, block_device, inode_id);
+        }
+        return;
+    }
+    disk_inode.increase_size(new_size);
+}
+
+static u32 count_holes(u32 start, u32 end, const DiskInode &disk_inode, shared_ptr<BlockDevice> device)
+{
+    u32 holes = 0;
+    for (u32 inner_id = start / block_sz; inner_id < (end - 1) / block_sz + 1; inner_id++)
+    {
+        if (disk_inode.get_block_entry(inner_id, device) == 0)
+            holes++;
+    }
+    return holes;
+}
+
+static function<u32()> take_run(EasyFileSystem *fs, vector<u32> &run, u32 &next)
+{
+    return [fs, &run, &next]() -> u32
+    { return next < run.size() ? run[next++] : fs->alloc_data(); };
+}
+
+static u32 copy_block(EasyFileSystem *fs, shared_ptr<BlockDevice> device, i32 inode_id, u32 block_id)
+{
+    Block data;
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(block_id, device, inode_id)
+        .get()
+        ->read<Block, u32>(0, [&data](const Block &block) -> u32
+                           {
+                               memcpy(data.data, block.data, block_sz);
+                               return 0;
+                           });
+    u32 new_block_id = fs->alloc_data();
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(new_block_id, device, inode_id, false)
+        .get()
+        ->modify<Block, u32>(0, [&data](Block &block) -> u32
+                             {
+                                 memcpy(block.data, data.data, block_sz);
+                                 return 0;
+                             });
+    return new_block_id;
+}
+
+void Inode::unshare(u32 offset, u32 len, DiskInode &disk_inode)
+{
+    if (len == 0 || !disk_inode.is_shared() || disk_inode.is_inline())
+        return;
+    u32 end = min(offset + len, disk_inode.data_blocks() * block_sz);
+    for (u32 inner_id = offset / block_sz; inner_id * block_sz < end; inner_id++)
+    {
+        u32 block_id = disk_inode.get_block_id(inner_id, block_device);
+        if (block_id == 0 || !fs->is_shared(block_id))
+            continue;
+        bool whole = inner_id * block_sz >= offset && (inner_id + 1) * block_sz <= offset + len;
+        disk_inode.set_block_entry(inner_id, whole ? fs->alloc_data() : copy_block(fs, block_device, inode_id, block_id), block_device);
+        fs->dealloc_data(block_id);
+    }
+}
+
+void Inode::fill_holes(u32 offset, u32 len, DiskInode &disk_inode)
+{
+    if (len == 0 || disk_inode.is_inline())
+        return;
+    u32 holes = count_holes(offset, offset + len, disk_inode, block_device);
+    vector<u32> run = holes > 1 ? fs->alloc_data_run(holes) : vector<u32>();
+    u32 next = 0;
+    disk_inode.fill_holes(offset, offset + len, block_device, disk_inode.is_dir() ? -1 : (i32)inode_id, take_run(fs, run, next));
+    fs->dealloc_data(vector<u32>(run.begin() + next, run.end()));
+}
+
+// false when the write has to go through the block map
+bool Inode::write_delayed(u32 offset, u32 _size, function<void(u8 *, u32)> &fill, DiskInode &disk_inode)
+{
+    if (_size == 0 || _size >= stream_threshold || !disk_inode.is_file() || disk_inode.is_inline())
+        return false;
+    u32 inner_start = offset / block_sz;
+    u32 inner_end = (offset + _size - 1) / block_sz + 1;
+    shared_ptr<DelayedFile> file = fs->get_delayed(inode_id, false);
+    u32 new_blocks = 0;
+    for (u32 inner_id = inner_start; inner_id < inner_end; inner_id++)
+    {
+        if (file != nullptr && file.get()->blocks.count(inner_id))
+            continue;
+        if (disk_inode.get_block_entry(inner_id, block_device) != 0)
+            return false;
+        new_blocks++;
+    }
+    if (file != nullptr && (file.get()->count + new_blocks > delayed_file_max || fs->delayed_full(new_blocks)))
+    {
+        flush_delayed(disk_inode);
+        return false;
+    }
+    if (fs->delayed_full(new_blocks))
+        return false;
+    if (file == nullptr)
+        file = fs->get_delayed(inode_id, true);
+    map<u32, Block> &blocks = file.get()->blocks;
+    for (u32 start = offset; start < offset + _size;)
+    {
+        u32 end_current_block = min((start / block_sz + 1) * block_sz, offset + _size);
+        auto it = blocks.find(start / block_sz);
+        if (it == blocks.end())
+        {
+            it = blocks.emplace(start / block_sz, Block()).first;
+            memset(it->second.data, 0, block_sz);
+        }
+        fill(it->second.data + start % block_sz, end_current_block - start);
+        start = end_current_block;
+    }
+    fs->count_delayed(*file.get(), new_blocks);
+    disk_inode.refresh_ctime();
+    return true;
+}
+
+void Inode::flush_delayed(DiskInode &disk_inode)
+{
+    shared_ptr<DelayedFile> file = fs->get_delayed(inode_id, false);
+    if (file == nullptr)
+        return;
+    map<u32, Block> &blocks = file.get()->blocks;
+    vector<u32> run = fs->alloc_data_run(blocks.size());
+    u32 next = 0;
+    function<u32()> alloc = take_run(fs, run, next);
+    u32 size = disk_inode.get_size();
+    auto it = blocks.begin();
+    while (it != blocks.end())
+    {
+        u32 inner_end = it->first + 1;
+        while (blocks.count(inner_end))
+            inner_end++;
+        disk_inode.fill_holes(it->first * block_sz, min(inner_end * block_sz, size), block_device, inode_id, alloc);
+        for (; it != blocks.end() && it->first < inner_end; it++)
+            disk_inode.write_at(it->first * block_sz, it->second.data, min(block_sz, size - it->first * block_sz), block_device, inode_id);
+    }
+    fs->dealloc_data(vector<u32>(run.begin() + next, run.end()));
+    fs->drop_delayed(inode_id);
+}
+
+void Inode::flush_delayed()
+{
+    if (fs->delayed_count(inode_id) == 0)
+        return;
+    modify_disk_inode<u32>([this](DiskInode &disk_inode) -> u32
+                           {
+                               this->flush_delayed(disk_inode);
+                               return 0;
+                           });
+}
+
+shared_ptr<Inode> Inode::create(string name, DiskInodeType type, u32 uid, u32 gid, u32 mode)
+{
+    u32 new_inode_id = fs->alloc_inode();
+    u32 new_inode_block_id, new_inode_block_offset;
+    fs->get_disk_inode_pos(new_inode_id, new_inode_block_id, new_inode_block_offset);
+    BLOCK_CACHE_MANAGER
+        .get_block_cache(new_inode_block_id, block_device, -1)
+        .get()
+        ->modify_and_sync<DiskInode, u32>(new_inode_block_offset, [type, uid, gid, mode](DiskInode &new_node)
+                                          {
+                                              new_node.initialize(type);
+                                              new_node.set_uid(uid);
+                                              new_node.set_gid(gid);
+                                              new_node.set_mode(mode);
+                                              return 0;
+                                          });
+    modify_disk_inode<u32>([this, name, new_inode_id](DiskInode &root_inode)
+                           {
+                               u32 file_count = root_inode.get_size() / dirent_sz;
+                               u32 new_size = (file_count + 1) * dirent_sz;
+                               this->increase_size(new_size, root_inode);
+                               this->fill_holes(file_count * dirent_sz, dirent_sz, root_inode);
+                               DirEntry dirent(name, new_inode_id);
+                               root_inode.write_at(file_count * dirent_sz, dirent.as_bytes(), dirent_sz, this->block_device, -1);
+                               root_inode.add_dirent_num();
+                               return 0;
+                           });
+    return shared_ptr<Inode>(new Inode(new_inode_id, new_inode_block_id, new_inode_block_offset, this->fs, this->block_device));
+}
+
+void Inode::remove(string name)
+{
+    modify_disk_inode<u32>([this, name](DiskInode &root_inode)
+                           {
+                               u32 file_count = root_inode.get_size() / dirent_sz;
+                               DirEntry dirent;
+                               for (u32 i = 0; i < file_count; i++)
+                               {
+                                   root_inode.read_at(dirent_sz * i, dirent.as_bytes_mut(), dirent_sz, block_device, -1);
+                                   if (dirent.get_name() == name)
+                                   {
+                                       DirEntry dirent_empty;
+                                       root_inode.write_at(i * dirent_sz, dirent_empty.as_bytes(), dirent_sz, this->block_device, -1);
+                                       root_inode.sub_dirent_num();
+                                       return 0;
+                                   }
+                               }
+                               return 0;
+                           });
+}
+
+void Inode::remove_all()
+{
+    vector<u32> data_blocks_dealloc;
+    modify_disk_inode<u32>([this, &data_blocks_dealloc](DiskInode &root_inode) -> u32
+                           {
+                               data_blocks_dealloc = root_inode.clear_size(this->block_device);
+                               while (root_inode.get_dirent_num() > 0)
+                                   root_inode.sub_dirent_num();
+                               return 0;
+                           });
+    this->fs->dealloc_data(data_blocks_dealloc);
+}
+
+u32 Inode::read_at(u32 offset, u8 *buf, u32 _size, bool direct)
+{
+    return modify_disk_inode<u32>([this, offset, buf, _size, direct](DiskInode &disk_inode) -> u32
+                                  {
+                                      this->flush_delayed(disk_inode);
+                                      return disk_inode.read_at(offset, buf, _size, this->block_device, this->inode_id, direct);
+                                  });
+}
+
+u32 Inode::write_at(u32 offset, const u8 *buf, u32 _size, bool direct)
+{
+    return modify_disk_inode<u32>([this, offset, buf, _size, direct](DiskInode &disk_inode) -> u32
+                                  {
+                                      this->increase_size(offset + _size, disk_inode);
+                                      u32 copied = 0;
+                                      function<void(u8 *, u32)> fill = [buf, &copied](u8 *dst, u32 len)
+                                      {
+                                          memcpy(dst, buf + copied, len);
+                                          copied += len;
+                                      };
+                                      if (!direct && this->write_delayed(offset, _size, fill, disk_inode))
+                                          return _size;
+                                      this->flush_delayed(disk_inode);
+                                      this->unshare(offset, _size, disk_inode);
+                                      this->fill_holes(offset, _size, disk_inode);
+                                      return disk_inode.write_at(offset, buf, _size, this->block_device, this->inode_id, direct);
+                                  });
+}
+
+u32 Inode::read_slices(u32 offset, u32 _size, vector<BlockSlice> &slices)
+{
+    return modify_disk_inode<u32>([this, offset, _size, &slices](DiskInode &disk_inode) -> u32
+                                  {
+                                      this->flush_delayed(disk_inode);
+                                      u32 read_size;
+                                      if (disk_inode.is_inline())
+                                      {
+                                          read_size = offset < disk_inode.get_size() ? min(_size, disk_inode.get_size() - offset) : 0;
+                                          if (read_size > 0)
+                                              slices.push_back(BlockSlice{BLOCK_CACHE_MANAGER.get_block_cache(this->block_id, this->block_device, -1),
+                                                                          this->block_offset + disk_inode.inline_offset() + offset, read_size});
+                                      }
+                                      else
+                                          read_size = disk_inode.read_slices(offset, _size, slices, this->block_device, this->inode_id);
+                                      if (read_size > 0)
+                                          disk_inode.refresh_atime();
+                                      return read_size;
+                                  });
+}
+
+u32 Inode::write_from(u32 offset, u32 _size, function<void(u8 *, u32)> fill, bool direct)
+{
+    return modify_disk_inode<u32>([this, offset, _size, &fill, direct](DiskInode &disk_inode) -> u32
+                                  {
+                                      this->increase_size(offset + _size, disk_inode);
+                                      if (!direct && this->write_delayed(offset, _size, fill, disk_inode))
+                                          return _size;
+                                      this->flush_delayed(disk_inode);
+                                      this->unshare(offset, _size, disk_inode);
+                                      this->fill_holes(offset, _size, disk_inode);
+                                      return disk_inode.write_from(offset, _size, fill, this->block_device, this->inode_id, direct);
+                                  });
+}
+
+void Inode::punch_hole(u32 offset, u32 len)
+{
+    vector<u32> data_blocks_dealloc;
+    modify_disk_inode<u32>([this, offset, len, &data_blocks_dealloc](DiskInode &disk_inode) -> u32
+                           {
+                               this->flush_delayed(disk_inode);
+                               if (len > 0)
+                               {
+                                   this->unshare(offset, 1, disk_inode);
+                                   this->unshare(offset + len - 1, 1, disk_inode);
+                               }
+                               data_blocks_dealloc = disk_inode.punch_hole(offset, len, this->block_device, this->inode_id);
+                               return 0;
+                           });
+    this->fs->dealloc_data(data_blocks_dealloc);
+}
+
+void Inode::truncate(u32 new_size)
+{
+    vector<u32> data_blocks_dealloc;
+    modify_disk_inode<u32>([this, new_size, &data_blocks_dealloc](DiskInode &disk_inode) -> u32
+                           {
+                               this->flush_delayed(disk_inode);
+                               if (new_size > disk_inode.get_size())
+                               {
+                                   this->increase_size(new_size, disk_inode);
+                                   disk_inode.refresh_ctime();
+                               }
+                               else
+                               {
+                                   this->unshare(new_size, 1, disk_inode);
+                                   data_blocks_dealloc = disk_inode.decrease_size(new_size, this->block_device, this->inode_id);
+                               }
+                               return 0;
+                           });
+    this->fs->dealloc_data(data_blocks_dealloc);
+}
+
+i32 Inode::preallocate(u32 offset, u32 len, bool keep_size)
+{
+    vector<u32> data_blocks_dealloc;
+    i32 ret = modify_disk_inode<i32>([this, offset, len, keep_size, &data_blocks_dealloc](DiskInode &disk_inode) -> i32
+                                     {
+                                         this->flush_delayed(disk_inode);
+                                         u32 old_size = disk_inode.get_size();
+                                         u32 end = keep_size ? min(offset + len, old_size) : offset + len;
+                                         if (offset >= end)
+                                             return 0;
+                                         this->increase_size(end, disk_inode);
+                                         if (disk_inode.is_inline())
+                                             return 0;
+                                         u32 holes = count_holes(offset, end, disk_inode, this->block_device);
+                                         vector<u32> run = this->fs->alloc_data_run(holes);
+                                         if (run.size() < holes)
+                                         {
+                                             data_blocks_dealloc = disk_inode.decrease_size(old_size, this->block_device, this->inode_id);
+                                             return -ENOSPC;
+                                         }
+                                         u32 next = 0;
+                                         disk_inode.fill_holes(offset, end, this->block_device, this->inode_id, take_run(this->fs, run, next), true);
+                                         data_blocks_dealloc.assign(run.begin() + next, run.end());
+                                         disk_inode.refresh_ctime();
+                                         return 0;
+                                     });
+    this->fs->dealloc_data(data_blocks_dealloc);
+    return ret;
+}
+
+u32 Inode::copy_data(shared_ptr<Inode> src, u32 src_offset, u32 offset, u32 len)
+{
+    vector<u8> buf(min(len, stream_threshold));
+    u32 copied = 0;
+    while (copied < len)
+    {
+        u32 n = src.get()->read_at(src_offset + copied, buf.data(), min(len - copied, (u32)buf.size()));
+        if (n == 0)
+            break;
+        write_at(offset + copied, buf.data(), n);
+        copied += n;
+    }
+    return copied;
+}
+
+// a block whose count is full, or any block without a count table, is copied instead
+u32 Inode::share_from(shared_ptr<Inode> src, u32 src_offset, u32 offset, u32 len)
+{
+    u32 n = (len + block_sz - 1) / block_sz;
+    u32 src_inner = src_offset / block_sz;
+    u32 inner = offset / block_sz;
+    src.get()->flush_delayed();
+    vector<u32> block_ids = src.get()->modify_disk_inode<vector<u32>>([this, src_inner, n](DiskInode &disk_inode) -> vector<u32>
+                                                                      {
+                                                                          disk_inode.set_shared();
+                                                                          return disk_inode.get_block_ids(src_inner, src_inner + n, this->block_device);
+                                                                      });
+    vector<bool> shared = fs->share_data(block_ids);
+    for (u32 i = 0; i < n; i++)
+    {
+        if (block_ids[i] != 0 && !shared[i])
+            block_ids[i] = copy_block(fs, block_device, inode_id, block_ids[i]);
+    }
+    vector<u32> data_blocks_dealloc;
+    modify_disk_inode<u32>([this, offset, len, inner, n, &block_ids, &data_blocks_dealloc](DiskInode &disk_inode) -> u32
+                           {
+                               this->flush_delayed(disk_inode);
+                               this->increase_size(offset + len, disk_inode);
+                               disk_inode.set_shared();
+                               data_blocks_dealloc = disk_inode.release_blocks(inner, inner + n, this->block_device);
+                               u32 next = 0;
+                               disk_inode.fill_holes(inner * block_sz, (inner + n) * block_sz, this->block_device, this->inode_id, [&block_ids, &next]() -> u32
+                                                     { return block_ids[next++]; },
+                                                     false, [this]() -> u32
+                                                     { return this->fs->alloc_data(); });
+                               disk_inode.refresh_ctime();
+                               return 0;
+                           });
+    fs->dealloc_data(data_blocks_dealloc);
+    return len;
+}
+
+u32 Inode::copy_from(shared_ptr<Inode> src, u32 src_offset, u32 offset, u32 len)
+{
+    u32 src_size = src.get()->read_disk_inode<u32>([](const DiskInode &disk_inode) -> u32
+                                                   { return disk_inode.get_size(); });
+    if (src_offset >= src_size)
+        return 0;
+    len = min(len, src_size - src_offset);
+    u32 copied = 0;
+    if (src_offset % block_sz == offset % block_sz && len >= block_sz)
+    {
+        u32 head = min(len, (block_sz - src_offset % block_sz) % block_sz);
+        copied = copy_data(src, src_offset, offset, head);
+        u32 body = (len - copied) / block_sz * block_sz;
+        u32 size = read_disk_inode<u32>([](const DiskInode &disk_inode) -> u32
+                                        { return disk_inode.get_size(); });
+        if (src_offset + len == src_size && offset + len >= size)
+            body = len - copied;
+        if (copied == head && body > 0)
+            copied += share_from(src, src_offset + copied, offset + copied, body);
+    }
+    return copied + copy_data(src, src_offset + copied, offset + copied, len - copied);
+}
+
+i64 Inode::seek(u32 offset, int whence)
+{
+    flush_delayed();
+    return read_disk_inode<i64>([this, offset, whence](const DiskInode &disk_inode) -> i64
+                                { return disk_inode.seek(offset, whence, this->block_device); });
+}
+
+void Inode::clear()
+{
+    vector<u32> data_blocks_dealloc;
+    modify_disk_inode<u32>([this, &data_blocks_dealloc](DiskInode &disk_inode) -> u32
+                           {
+                               this->fs->drop_delayed(this->inode_id);
+                               data_blocks_dealloc = disk_inode.clear_size(this->block_device);
+                               return 0;
+                           });
+    this->fs->dealloc_data(data_blocks_dealloc);
+}
+
+bool Inode::is_dir()
+{
+    return peek_disk_inode<bool>([](const DiskInode &disk_inode) -> bool
+                                 { return disk_inode.is_dir(); });
+}
+
+bool Inode::is_file()
+{
+    return peek_disk_inode<bool>([](const DiskInode &disk_inode) -> bool
+                                 { return disk_inode.is_file(); });
+}
+
+bool Inode::is_readonly()
+{
+    return peek_disk_inode<bool>([](const DiskInode &disk_inode) -> bool
+                                 { return disk_inode.is_readonly(); });
+}
+
+void Inode::set_readonly()
+{
+    modify_disk_inode<u32>([](DiskInode &disk_inode) -> u32
+                           {
+                               disk_inode.set_readonly();
+                               return 0;
+                           });
+}
+
+void Inode::sync()
+{
+    flush_delayed();
+    BLOCK_CACHE_MANAGER.flush_inode(inode_id);
+}
+
+u32 Inode::read_dirents(u32 index, DirEntry *dirents, u32 count)
+{
+    return read_disk_inode<u32>([this, index, dirents, count](const DiskInode &disk_inode) -> u32
+                                { return disk_inode.read_data(index * dirent_sz, (u8 *)dirents, count * dirent_sz, this->block_device, this->inode_id) / dirent_sz; });
+}
+
+u32 Inode::get_nlink()
+{
+    return peek_disk_inode<u32>([](const DiskInode &disk_inode) -> u32
+                                { return disk_inode.get_nlink(); });
+}
+
+void Inode::add_nlink()
+{
+    modify_disk_inode<u32>([](DiskInode &disk_inode) -> u32
+                           {
+                               disk_inode.add_nlink();
+                               return 0;
+                           });
+}
+
+bool Inode::sub_nlink()
+{
+    return modify_disk_inode<bool>([](DiskInode &disk_inode) -> bool
+                                   {
+                                       disk_inode.sub_nlink();
+                                       if (disk_inode.get_nlink() == 0)
+                                           return true;
+                                       return false;
+                                   });
+}
+
+void Inode::rename(string old_name, string new_name)
+{
+    modify_disk_inode<u32>([this, old_name, new_name](DiskInode &root_inode)
+                           {
+                               u32 file_count = root_inode.get_size() / dirent_sz;
+                               DirEntry dirent;
+                               for (u32 i = 0; i < file_count; i++)
+                               {
+                                   root_inode.read_at(dirent_sz * i, dirent.as_bytes_mut(), dirent_sz, block_device, -1);
+                                   if (dirent.get_name() == old_name)
+                                   {
+                                       DirEntry dirent_new(new_name, dirent.get_inode_number());
+                                       root_inode.write_at(i * dirent_sz, dirent_new.as_bytes(), dirent_sz, this->block_device, -1);
+                                       return 0;
+                                   }
+                               }
+                               return 0;
+                           });
+}
+
+void Inode::link(string name, u32 inode_id)
+{
+    modify_disk_inode<u32>([this, name, inode_id](DiskInode &root_inode)
+                           {
+                               u32 file_count = root_inode.get_size() / dirent_sz;
+                               u32 new_size = (file_count + 1) * dirent_sz;
+                               this->increase_size(new_size, root_inode);
+                               this->fill_holes(file_count * dirent_sz, dirent_sz, root_inode);
+                               DirEntry dirent(name, inode_id);
+                               root_inode.write_at(file_count * dirent_sz, dirent.as_bytes(), dirent_sz, this->block_device, -1);
+                               root_inode.add_dirent_num();
+                               return 0;
+                           });
+}
+
+struct stat Inode::get_stat()
+{
+    struct stat st = peek_disk_inode<struct stat>([this](const DiskInode &disk_inode) -> struct stat
+                                                  { return disk_inode.get_stat(this->inode_id, this->block_device); });
+    st.st_blocks += fs->delayed_count(inode_id);
+    return st;
+}
+
+u32 Inode::get_dirent_num()
+{
+    return peek_disk_inode<u32>([](const DiskInode &disk_inode) -> u32
+                                { return disk_inode.get_dirent_num(); });
+}
+
+void Inode::set_mode(u32 mode)
+{
+    modify_disk_inode<u32>([mode](DiskInode &root_inode)
+                           {
+                               root_inode.set_mode(mode);
+                               return 0;
+                           });
+}
+
+void Inode::set_owner(u32 uid, u32 gid)
+{
+    modify_disk_inode<u32>([uid, gid](DiskInode &root_inode)
+                           {
+                               root_inode.set_uid(uid);
+                               root_inode.set_gid(gid);
+                               return 0;
+                           });
+}
+
+void Inode::get_permission(u32 &mode, u32 &uid, u32 &gid)
+{
+    peek_disk_inode<u32>([&mode, &uid, &gid](const DiskInode &disk_inode) -> u32
+                         {
+                             mode = disk_inode.get_mode();
+                             uid = disk_inode.get_uid();
+                             gid = disk_inode.get_gid();
+                             return 0;
+                         });
+}
+
+bool Inode::permit_r(u32 _uid, u32 _gid)
+{
+    return peek_disk_inode<bool>([_uid, _gid](const DiskInode &disk_inode) -> bool
+                                 { return disk_inode.permit_r(_uid, _gid); });
+}
+bool Inode::permit_w(u32 _uid, u32 _gid)
+{
+    return peek_disk_inode<bool>([_uid, _gid](const DiskInode &disk_inode) -> bool
+                                 { return disk_inode.permit_w(_uid, _gid); });
+}
+bool Inode::permit_x(u32 _uid, u32 _gid)
+{
+    return peek_disk_inode<bool>([_uid, _gid](const DiskInode &disk_inode) -> bool
+                                 { return disk_inode.permit_x(_uid, _gid); });
+}
+
+void Inode::set_atime(i64 time)
+{
+    modify_disk_inode<u32>([time](DiskInode &root_inode)
+                           {
+                               root_inode.set_atime(time);
+                               return 0;
+                           });
+}
+void Inode::set_ctime(i64 time)
+{
+    modify_disk_inode<u32>([time](DiskInode &root_inode)
+                           {
+                               root_inode.set_ctime(time);
+                               return 0;
+                           });
 }
\ No newline at end of file
@@ -1,81 +1,135 @@
-#ifndef __VFS_H_
-#define __VFS_H_
-
-#include "layout.h"
-class EasyFileSystem;
-class Inode
-{
-    u32 inode_id;
-    u32 block_id;
-    u32 block_offset;
-    EasyFileSystem *fs;
-    shared_ptr<BlockDevice> block_device;
-
-public:
-    Inode(u32 _inode_id, u32 _block_id, u32 _block_offset, EasyFileSystem *_fs, shared_ptr<BlockDevice> _block_device);
-    u32 get_id();
-
-    template <typename V>
-    V read_disk_inode(function<V(const DiskInode &)> f)
-    {
-        return BLOCK_CACHE_MANAGER.get_block_cache(block_id, block_device, -1).get()->read<DiskInode, V>(block_offset, f);
-    }
-
-    template <typename V>
-    V modify_disk_inode(function<V(DiskInode &)> f)
-    {
-        return BLOCK_CACHE_MANAGER.get_block_cache(block_id, block_device, -1).get()->modify_and_sync<DiskInode, V>(block_offset, f);
-    }
-
-    i64 find_inode_id(string name, DiskInode &disk_inode);
-
-    shared_ptr<Inode> find(string name);
-
-    void increase_size(u32 new_size, DiskInode &disk_inode);
-
-    shared_ptr<Inode> create(string name, DiskInodeType type, u32 uid, u32 gid, u32 mode);
-
-    void remove(string name);
-
-    vector<pair<string, u32>> ls();
-
-    u32 read_at(u32 offset, u8 *buf, u32 _size);
-
-    u32 write_at(u32 offset, const u8 *buf, u32 _size);
-
-    void clear();
-
-    bool is_dir();
-
-    bool is_file();
-
-    void sync();
-
-    u32 get_nlink();
-
-    void add_nlink();
-
-    bool sub_nlink();
-
-    void rename(string old_name, string new_name);
-
-    void link(string name, u32 inode_id);
-
-    struct stat get_stat();
-
-    u32 get_dirent_num();
-
-    void set_mode(u32 mode);
-
-    void set_owner(u32 uid, u32 gid);
-
-    void get_permission(u32 &mode, u32 &uid, u32 &gid);
-
-    bool permit_r(u32 _uid, u32 _gid);
-    bool permit_w(u32 _uid, u32 _gid);
-    bool permit_x(u32 _uid, u32 _gid);
-    void set_atime(i64 time);
-    void set_ctime(i64 time);
-};
-
+#ifndef __VFS_H_
+#define __VFS_H_
+
+#include "layout.h"
+class EasyFileSystem;
+class Inode
+{
+    u32 inode_id;
+    u32 block_id;
+    u32 block_offset;
+    EasyFileSystem *fs;
+    shared_ptr<BlockDevice> block_device;
+
+public:
+    Inode(u32 _inode_id, u32 _block_id, u32 _block_offset, EasyFileSystem *_fs, shared_ptr<BlockDevice> _block_device);
+    u32 get_id();
+
+    template <typename V, typename F>
+    V read_disk_inode(F f)
+    {
+        return BLOCK_CACHE_MANAGER.get_block_cache(block_id, block_device, -1).get()->read<DiskInode, V>(block_offset, f);
+    }
+
+    // for field getters: f runs on a validated copy instead of under the block lock
+    template <typename V, typename F>
+    V peek_disk_inode(F f)
+    {
+        DiskInode disk_inode = BLOCK_CACHE_MANAGER.get_block_cache(block_id, block_device, -1).get()->peek<DiskInode>(block_offset);
+        return f(disk_inode);
+    }
+
+    template <typename V, typename F>
+    V modify_disk_inode(F f)
+    {
+        return BLOCK_CACHE_MANAGER.get_block_cache(block_id, block_device, -1).get()->modify_and_sync<DiskInode, V>(block_offset, f);
+    }
+
+    i64 find_inode_id(string name, const DiskInode &disk_inode);
+
+    shared_ptr<Inode> find(string name);
+
+    void increase_size(u32 new_size, DiskInode &disk_inode);
+
+    void fill_holes(u32 offset, u32 len, DiskInode &disk_inode);
+
+    bool write_delayed(u32 offset, u32 _size, function<void(u8 *, u32)> &fill, DiskInode &disk_inode);
+
+    void flush_delayed(DiskInode &disk_inode);
+
+    void unshare(u32 offset, u32 len, DiskInode &disk_inode);
+
+    u32 copy_data(shared_ptr<Inode> src, u32 src_offset, u32 offset, u32 len);
+
+    u32 share_from(shared_ptr<Inode> src, u32 src_offset, u32 offset, u32 len);
+
+    shared_ptr<Inode> create(string name, DiskInodeType type, u32 uid, u32 gid, u32 mode);
+
+    void remove(string name);
+
+    // drops every entry of a directory at once, the entries must already be released
+    void remove_all();
+
+    // reads up to count directory slots starting at slot index; empty slots have an empty name
+    u32 read_dirents(u32 index, DirEntry *dirents, u32 count);
+
+    // direct moves the full blocks around the block cache whatever the size
+    u32 read_at(u32 offset, u8 *buf, u32 _size, bool direct = false);
+
+    u32 read_slices(u32 offset, u32 _size, vector<BlockSlice> &slices);
+
+    u32 write_at(u32 offset, const u8 *buf, u32 _size, bool direct = false);
+
+    u32 write_from(u32 offset, u32 _size, function<void(u8 *, u32)> fill, bool direct = false);
+
+    void clear();
+
+    // give the blocks held back by buffered writes their place on disk
+    void flush_delayed();
+
+    // zero a range, unmapping the whole blocks in it
+    void punch_hole(u32 offset, u32 len);
+
+    // shrinking frees the tail, growing only moves the size and leaves a hole
+    void truncate(u32 new_size);
+
+    // reserve blocks for a range, as contiguous as the bitmap allows; they read as zeros
+    // until written. keep_size reserves only inside the file. -ENOSPC if they do not fit
+    i32 preallocate(u32 offset, u32 len, bool keep_size);
+
+    // copy_file_range: copies up to len bytes of src from src_offset, sharing whole blocks
+    // with src where the two ranges line up
+    u32 copy_from(shared_ptr<Inode> src, u32 src_offset, u32 offset, u32 len);
+
+    // SEEK_DATA or SEEK_HOLE from offset, -ENXIO past the end
+    i64 seek(u32 offset, int whence);
+
+    bool is_dir();
+
+    bool is_file();
+
+    bool is_readonly();
+
+    // marks an inode cloned into a snapshot
+    void set_readonly();
+
+    void sync();
+
+    u32 get_nlink();
+
+    void add_nlink();
+
+    bool sub_nlink();
+
+    void rename(string old_name, string new_name);
+
+    void link(string name, u32 inode_id);
+
+    struct stat get_stat();
+
+    u32 get_dirent_num();
+
+    void set_mode(u32 mode);
+
+    void set_owner(u32 uid, u32 gid);
+
+    void get_permission(u32 &mode, u32 &uid, u32 &gid);
+
+    bool permit_r(u32 _uid, u32 _gid);
+    bool permit_w(u32 _uid, u32 _gid);
+    bool permit_x(u32 _uid, u32 _gid);
+    void set_atime(i64 time);
+    void set_ctime(i64 time);
+};
+
 #endif
\ No newline at end of file